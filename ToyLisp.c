@@ -10,48 +10,63 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdint.h>
 
 #ifdef _MSC_VER
 #define strdup _strdup
 #endif
 
-enum AtomType {
-	AtomType_Nil,
-	AtomType_Pair,
-	AtomType_Symbol,
-	AtomType_Integer,
-	AtomType_Builtin,
-	AtomType_Closure,
-	AtomType_Macro
-};
-
-typedef enum {
-	Error_OK = 0, Error_Syntax, Error_Unbound, Error_Args, Error_Type
-} Error;
-
-typedef struct Atom Atom;
-typedef Error(*Builtin)(Atom args, Atom *result);
+#if !defined(_MSC_VER) && !defined(TOYLISP_NO_THREADS)
+#include <pthread.h>
+#define SORT_THREADS
+#endif
 
-struct Atom {
-	enum AtomType type;
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <dlfcn.h>
+#include <unistd.h>
+#endif
 
-	union {		
-		long integer;
-		struct Pair *pair;
-		char *symbol;
-		Builtin builtin;
-	} value;
+#include "ToyLisp.h"
+
+/* Symbols.  A symbol atom points at the name in its struct Symbol, so
+ * symbols compare by pointer.  Interned symbols are kept in sym_buckets,
+ * which does not keep them alive: gc() frees those that nothing refers
+ * to, except permanent ones, which C code holds in static variables. */
+struct Symbol {
+	struct Symbol *next;  /* in the same bucket */
+	unsigned long hash;
+	int mark;
+	int permanent;
+	char name[1];
 };
 
-static Atom sym_table = { AtomType_Nil };
+static struct Symbol **sym_buckets = NULL;
+static unsigned long sym_nbuckets = 0, sym_count = 0;
 
-struct Pair {
-	struct Atom atom[2];
-};
+static Atom inline_deps = { AtomType_Nil };
 
 /* forward declarations */
-Error apply(Atom fn, Atom args, Atom *result);
-int listp(Atom expr);
+struct Memo;
+struct MapNode;
+struct Vector;
+struct Iterator;
+struct Omap;
+struct Bitvec;
+struct Pq;
+struct Port;
+struct Library;
+struct Foreign;
+struct Kv;
+struct Cell;
+struct CellLink;
+struct Promise;
+struct Record;
+struct WeakTable;
 char *slurp(const char *path);
 Atom list_get(Atom list, int k);
 void list_set(Atom list, int k, Atom value);
@@ -60,34 +75,266 @@ Atom make_frame(Atom parent, Atom env, Atom tail);
 Error eval_do_exec(Atom *stack, Atom *expr, Atom *env);
 Error eval_do_bind(Atom *stack, Atom *expr, Atom *env);
 Error eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result);
-Error eval_expr(Atom expr, Atom env, Atom *result);
+Error eval_loop(Atom expr, Atom env, Atom stack, Atom *result);
+Error checkpoint_write(Atom path, Atom stack);
+Error checkpoint_read(const char *path, Atom root[4]);
 void print_err(Error err);
+Atom env_flatten(Atom env, Atom args, Atom body);
+int memq(Atom sym, Atom list);
+int memo_lookup(struct Memo *m, Atom args, Atom *result);
+void memo_store(struct Memo *m, Atom key, Atom value);
+void memo_mark(struct Memo *m);
+void memo_free(struct Memo *m);
+void map_mark(struct MapNode *node);
+void vector_mark(struct Vector *v);
+void vector_free(struct Vector *v);
+Atom vector_get(struct Vector *v, long i);
+void iterator_mark(struct Iterator *it);
+void omap_mark(struct Omap *m);
+void omap_free(struct Omap *m);
+void bitvec_free(struct Bitvec *bv);
+int bitvec_equalp(struct Bitvec *a, struct Bitvec *b);
+unsigned long bitvec_hash(struct Bitvec *bv);
+void pq_mark(struct Pq *q);
+void pq_free(struct Pq *q);
+void port_free(struct Port *p);
+void library_free(struct Library *lib);
+void foreign_mark(struct Foreign *f);
+Error ffi_call(struct Foreign *f, Atom args, Atom *result);
+void kv_free(struct Kv *kv);
+Atom make_cell(Atom value, Atom thunk);
+void cell_link(struct CellLink **list, struct Cell *cell);
+void cell_mark(struct Cell *c);
+void cell_free(struct Cell *c);
+void cells_prune(void);
+void promise_mark(struct Promise *p);
+Atom make_promise_thunk(Atom thunk);
+Error make_promise(Atom env, Atom body, Atom *result);
+Atom make_record(Atom tag, long length);
+struct Record *record_of(Atom a);
+void record_mark(struct Record *r);
+struct Symbol *symbol_of(Atom a);
+void symbols_sweep(void);
+int atom_marked(Atom a);
+void weak_tables_trace(void);
+void weak_table_free(struct WeakTable *t);
+Error port_read(struct Port *p, Atom *result);
+Error builtin_add(Atom args, Atom *result);
+Error builtin_subtract(Atom args, Atom *result);
+Error builtin_multiply(Atom args, Atom *result);
+Error builtin_numeq(Atom args, Atom *result);
+Error builtin_less(Atom args, Atom *result);
 
-#define car(p) ((p).value.pair->atom[0])
-#define cdr(p) ((p).value.pair->atom[1])
-#define nilp(atom) ((atom).type == AtomType_Nil)
-
-static const Atom nil = { AtomType_Nil };
 /* symbols for faster comparison */
 static Atom sym_t, sym_quote, sym_define, sym_lambda, sym_if, sym_defmacro, sym_apply;
+static Atom sym_checkpoint, sym_delay;
+/* uninterned symbols of forms generated by the optimizer */
+static Atom sym_fixnum, sym_fixnum_guard, sym_memo, sym_values;
+/* returned by input functions at the end of input */
+static Atom sym_eof;
 
 struct Allocation {
 	struct Pair pair;
 	int mark : 1;
+	int analyzed : 1; /* closure: noescape is valid */
+	int noescape : 1; /* closure: environment never outlives a call */
+	int release : 1;  /* frame: only waiting to release its environment */
+	int captured : 1; /* environment: referenced by a closure */
+	int owned : 1;    /* call expression built by the evaluator */
+	int applied : 1;  /* call expression whose arguments are values */
+	int proper : 1;   /* pair: the list starting here is proper */
+	int open : 1;     /* closure: body may define names; environment:
+	                   * may gain bindings after it is made */
 	struct Allocation *next;
 };
 
 struct Allocation *global_allocations = NULL;
 
+/* Native objects, referenced by atoms of their own types and swept by
+ * gc() along with the pairs */
+struct Object {
+	enum AtomType type;
+	int mark;
+	struct Object *next;
+};
+
+struct Object *global_objects = NULL;
+
+struct MemoEntry {
+	Atom key, value;
+	unsigned long hash;
+	struct MemoEntry *chain;       /* next in the bucket */
+	struct MemoEntry *prev, *next; /* most recently used first */
+};
+
+struct Memo {
+	struct Object object;
+	Atom fn;
+	int eq;     /* compare arguments with eq? instead of equal? */
+	long size;  /* maximum number of entries, 0 if unbounded */
+	long count;
+	unsigned long nbuckets;
+	struct MemoEntry **buckets;
+	struct MemoEntry *first, *last;
+};
+
+struct String {
+	struct Object object;
+	long length;
+	char chars[1];  /* NUL-terminated */
+};
+
+enum PortKind {
+	PortKind_FileIn, PortKind_FileOut, PortKind_StringIn, PortKind_StringOut
+};
+
+struct Port {
+	struct Object object;
+	enum PortKind kind;
+	FILE *file;
+	int closed;
+	int owned;      /* buf is freed with the port */
+	char *buf;
+	size_t pos;     /* input: next character */
+	size_t len;     /* input: end of data; output: characters pending */
+	size_t cap;
+	struct Port *next_output;  /* open file output ports, for exit */
+};
+
+/* Vectors: fixed-length arrays of atoms.  (vector x ...) and
+ * (make-vector n [fill]) create them; they print as #(x ...).  Typed
+ * vectors, made by read-csv, hold unboxed integers or reals instead. */
+enum VectorKind { VectorKind_Atoms, VectorKind_Ints, VectorKind_Reals };
+
+struct Vector {
+	struct Object object;
+	enum VectorKind kind;
+	long length;
+	Atom *items;    /* VectorKind_Atoms */
+	long *ints;     /* VectorKind_Ints */
+	double *reals;  /* VectorKind_Reals */
+};
+
+/* Records: a type tag and a fixed number of slots, made by define-record.
+ * They print as #<tag x ...>. */
+struct Record {
+	struct Object object;
+	Atom tag;
+	long length;
+	Atom slots[1];
+};
+
+/* Reactive cells, made by cell and computed */
+struct CellLink {
+	struct Cell *cell;
+	struct CellLink *next;
+};
+
+struct Cell {
+	struct Object object;
+	Atom value;
+	Atom thunk;            /* nil for input cells */
+	int dirty;
+	int computing;
+	struct CellLink *deps;        /* cells read by the last computation */
+	struct CellLink *dependents;  /* computed cells that read this one */
+	struct Cell *prev, *next;     /* all_cells */
+};
+
+/* Promises, made by delay */
+struct Promise {
+	struct Object object;
+	Atom value;
+	Atom thunk;  /* nil once forced */
+	int forced;
+};
+
+/* Cells handed back by the evaluator, reused before calling malloc.
+ * They stay on global_allocations and are unreachable, so gc() simply
+ * sweeps them and starts a new free list. */
+struct Allocation *free_allocations = NULL;
+
+struct Root *gc_roots = NULL;
+
+/* Standard output, as a port; created on first use */
+static Atom stdout_port = { AtomType_Nil };
+
+/* The global environment, and the forms left on the REPL's line */
+static Atom toplevel_env = { AtomType_Nil };
+static Atom toplevel_rest = { AtomType_Nil };
+
+/* Counts bindings of macros, which change what a body refers to */
+static long macro_generation = 0;
+
+/* Free names of lambda expressions, by body; see env_flatten */
+#define FREE_VARS_CACHE_SIZE 1024
+
+struct FreeVars {
+	struct Pair *body;
+	Atom args;
+	Atom syms;
+	int whole;
+	long generation;
+};
+
+static struct FreeVars free_vars_cache[FREE_VARS_CACHE_SIZE];
+
+/* Nesting of eval_expr; 1 while evaluating a top-level form */
+static int eval_depth = 0;
+
+/* The results of the last (values ...) call with other than one value */
+#define VALUES_MAX 16
+static Atom value_regs[VALUES_MAX];
+static int value_count = 0;
+static long value_generation = 0;
+
+/* Nonzero while C code holds unrooted atoms across evaluation */
+int gc_inhibit = 0;
+
+void gc_protect(struct Root *root, Atom *atom)
+{
+	root->atom = atom;
+	root->prev = gc_roots;
+	gc_roots = root;
+}
+
+void gc_unprotect(struct Root *root)
+{
+	gc_roots = root->prev;
+}
+
+struct Allocation *allocation_of(Atom p)
+{
+	return (struct Allocation *)
+		((char *)p.value.pair
+		- offsetof(struct Allocation, pair));
+}
+
 Atom cons(Atom car_val, Atom cdr_val)
 {
 	struct Allocation *a;
 	Atom p;
 
-	a = (struct Allocation *)malloc(sizeof(struct Allocation));
+	if (free_allocations != NULL) {
+		a = free_allocations;
+		free_allocations = (struct Allocation *)a->pair.atom[0].value.pair;
+	}
+	else {
+		a = (struct Allocation *)malloc(sizeof(struct Allocation));
+		a->next = global_allocations;
+		global_allocations = a;
+	}
 	a->mark = 0;
-	a->next = global_allocations;
-	global_allocations = a;
+	a->analyzed = 0;
+	a->noescape = 0;
+	a->release = 0;
+	a->captured = 0;
+	a->owned = 0;
+	a->applied = 0;
+	a->open = 0;
+	/* Lists built by consing onto a proper list never need checking */
+	a->proper = nilp(cdr_val) || (cdr_val.type == AtomType_Pair
+		&& allocation_of(cdr_val)->proper);
 
 	p.type = AtomType_Pair;
 	p.value.pair = &a->pair;
@@ -98,18 +345,157 @@ Atom cons(Atom car_val, Atom cdr_val)
 	return p;
 }
 
+/* Return a cell that is known to be unreferenced */
+void release(Atom p)
+{
+	struct Allocation *a = allocation_of(p);
+
+	a->pair.atom[0].type = AtomType_Nil;
+	a->pair.atom[0].value.pair = (struct Pair *)free_allocations;
+	a->pair.atom[1] = nil;
+	free_allocations = a;
+}
+
+void release_list(Atom list)
+{
+	while (!nilp(list)) {
+		Atom next = cdr(list);
+		release(list);
+		list = next;
+	}
+}
+
+void object_mark(struct Object *obj)
+{
+	if (obj->mark)
+		return;
+
+	obj->mark = 1;
+
+	switch (obj->type) {
+	case AtomType_Memo:
+		memo_mark((struct Memo *)obj);
+		break;
+	case AtomType_Map:
+		map_mark((struct MapNode *)obj);
+		break;
+	case AtomType_Vector:
+		vector_mark((struct Vector *)obj);
+		break;
+	case AtomType_Iterator:
+		iterator_mark((struct Iterator *)obj);
+		break;
+	case AtomType_Omap:
+		omap_mark((struct Omap *)obj);
+		break;
+	case AtomType_Pq:
+		pq_mark((struct Pq *)obj);
+		break;
+	case AtomType_Foreign:
+		foreign_mark((struct Foreign *)obj);
+		break;
+	case AtomType_Cell:
+		cell_mark((struct Cell *)obj);
+		break;
+	case AtomType_Promise:
+		promise_mark((struct Promise *)obj);
+		break;
+	case AtomType_Record:
+		record_mark((struct Record *)obj);
+		break;
+	default:
+		break;
+	}
+}
+
+void object_free(struct Object *obj)
+{
+	switch (obj->type) {
+	case AtomType_Memo:
+		memo_free((struct Memo *)obj);
+		break;
+	case AtomType_Vector:
+		vector_free((struct Vector *)obj);
+		break;
+	case AtomType_Omap:
+		omap_free((struct Omap *)obj);
+		break;
+	case AtomType_Bitvec:
+		bitvec_free((struct Bitvec *)obj);
+		break;
+	case AtomType_Pq:
+		pq_free((struct Pq *)obj);
+		break;
+	case AtomType_Port:
+		port_free((struct Port *)obj);
+		break;
+	case AtomType_Library:
+		library_free((struct Library *)obj);
+		break;
+	case AtomType_Kv:
+		kv_free((struct Kv *)obj);
+		break;
+	case AtomType_Cell:
+		cell_free((struct Cell *)obj);
+		break;
+	case AtomType_WeakTable:
+		weak_table_free((struct WeakTable *)obj);
+		break;
+	default:
+		free(obj);
+		break;
+	}
+}
+
+Atom make_object(struct Object *obj, enum AtomType type)
+{
+	Atom a;
+
+	obj->type = type;
+	obj->mark = 0;
+	obj->next = global_objects;
+	global_objects = obj;
+
+	a.type = type;
+	a.value.object = obj;
+	return a;
+}
+
 void gc_mark(Atom root)
 {
 	struct Allocation *a;
 
-	if (!(root.type == AtomType_Pair
-		|| root.type == AtomType_Closure
-		|| root.type == AtomType_Macro))
+	switch (root.type) {
+	case AtomType_Pair:
+	case AtomType_Closure:
+	case AtomType_Macro:
+		break;
+	case AtomType_Memo:
+	case AtomType_Map:
+	case AtomType_Vector:
+	case AtomType_Iterator:
+	case AtomType_Omap:
+	case AtomType_Bitvec:
+	case AtomType_Pq:
+	case AtomType_String:
+	case AtomType_Port:
+	case AtomType_Library:
+	case AtomType_Foreign:
+	case AtomType_Kv:
+	case AtomType_Cell:
+	case AtomType_Promise:
+	case AtomType_Record:
+	case AtomType_WeakTable:
+		object_mark(root.value.object);
+		return;
+	case AtomType_Symbol:
+		symbol_of(root)->mark = 1;
 		return;
+	default:
+		return;
+	}
 
-	a = (struct Allocation *)
-		((char *)root.value.pair
-		- offsetof(struct Allocation, pair));
+	a = allocation_of(root);
 
 	if (a->mark)
 		return;
@@ -120,12 +506,59 @@ void gc_mark(Atom root)
 	gc_mark(cdr(root));
 }
 
+/* Has gc_mark reached a? */
+int atom_marked(Atom a)
+{
+	switch (a.type) {
+	case AtomType_Pair:
+	case AtomType_Closure:
+	case AtomType_Macro:
+		return allocation_of(a)->mark;
+	case AtomType_Symbol:
+		return symbol_of(a)->mark || symbol_of(a)->permanent;
+	case AtomType_Memo:
+	case AtomType_Map:
+	case AtomType_Vector:
+	case AtomType_Iterator:
+	case AtomType_Omap:
+	case AtomType_Bitvec:
+	case AtomType_Pq:
+	case AtomType_String:
+	case AtomType_Port:
+	case AtomType_Library:
+	case AtomType_Foreign:
+	case AtomType_Kv:
+	case AtomType_Cell:
+	case AtomType_Promise:
+	case AtomType_Record:
+	case AtomType_WeakTable:
+		return a.value.object->mark;
+	default:
+		return 1;
+	}
+}
+
 void gc()
 {
 	struct Allocation *a, **p;
-	gc_mark(sym_table);
+	struct Object **o;
+	struct Root *r;
+	int i;
+
+	/* The cached lists go with the sweep */
+	memset(free_vars_cache, 0, sizeof(free_vars_cache));
+
+	gc_mark(inline_deps);
+	gc_mark(stdout_port);
+	gc_mark(toplevel_rest);
+	for (i = 0; i < value_count; i++)
+		gc_mark(value_regs[i]);
+	for (r = gc_roots; r != NULL; r = r->prev)
+		gc_mark(*r->atom);
+	weak_tables_trace();
 
 	/* Free unmarked allocations */
+	free_allocations = NULL;
 	p = &global_allocations;
 	while (*p != NULL) {
 		a = *p;
@@ -144,6 +577,23 @@ void gc()
 		a->mark = 0;
 		a = a->next;
 	}
+
+	symbols_sweep();
+
+	/* Free unmarked objects and clear the marks of the others */
+	cells_prune();
+	o = &global_objects;
+	while (*o != NULL) {
+		if (!(*o)->mark) {
+			struct Object *dead = *o;
+			*o = dead->next;
+			object_free(dead);
+		}
+		else {
+			(*o)->mark = 0;
+			o = &(*o)->next;
+		}
+	}
 }
 
 
@@ -155,25 +605,141 @@ Atom make_int(long x)
 	return a;
 }
 
+Atom make_real(double x)
+{
+	Atom a;
+	a.type = AtomType_Real;
+	a.value.real = x;
+	return a;
+}
+
+struct Symbol *symbol_of(Atom a)
+{
+	return (struct Symbol *)(a.value.symbol - offsetof(struct Symbol, name));
+}
+
+Atom symbol_atom(struct Symbol *sym)
+{
+	Atom a;
+	a.type = AtomType_Symbol;
+	a.value.symbol = sym->name;
+	return a;
+}
+
+struct Symbol *symbol_new(const char *s, unsigned long hash)
+{
+	size_t len = strlen(s);
+	struct Symbol *sym = (struct Symbol *)malloc(sizeof(struct Symbol) + len);
+
+	memcpy(sym->name, s, len + 1);
+	sym->hash = hash;
+	sym->mark = 0;
+	sym->permanent = 0;
+	sym->next = NULL;
+	return sym;
+}
+
+void symbols_grow(void)
+{
+	struct Symbol **old = sym_buckets, *sym, *next;
+	unsigned long i, n = sym_nbuckets;
+
+	sym_nbuckets = n ? n * 2 : 256;
+	sym_buckets = (struct Symbol **)calloc(sym_nbuckets, sizeof(struct Symbol *));
+	for (i = 0; i < n; i++) {
+		for (sym = old[i]; sym != NULL; sym = next) {
+			next = sym->next;
+			sym->next = sym_buckets[sym->hash % sym_nbuckets];
+			sym_buckets[sym->hash % sym_nbuckets] = sym;
+		}
+	}
+	free(old);
+}
+
 Atom make_sym(const char *s)
 {
-	Atom a, p;
+	unsigned long h = 5381;
+	const char *c;
+	struct Symbol *sym;
 
-	p = sym_table;
-	while (!nilp(p)) {
-		a = car(p);
-		if (strcmp(a.value.symbol, s) == 0)
-			return a;
-		p = cdr(p);
+	for (c = s; *c; c++)
+		h = h * 33 + (unsigned char)*c;
+
+	if (sym_nbuckets) {
+		for (sym = sym_buckets[h % sym_nbuckets]; sym != NULL; sym = sym->next)
+			if (sym->hash == h && strcmp(sym->name, s) == 0)
+				return symbol_atom(sym);
 	}
 
-	a.type = AtomType_Symbol;
-	a.value.symbol = (char*)strdup(s);
-	sym_table = cons(a, sym_table);
+	if (sym_count >= sym_nbuckets)
+		symbols_grow();
+	sym = symbol_new(s, h);
+	sym->next = sym_buckets[h % sym_nbuckets];
+	sym_buckets[h % sym_nbuckets] = sym;
+	sym_count++;
+	return symbol_atom(sym);
+}
 
+/* A symbol that is never collected, for C code to keep in a static */
+Atom make_permanent_sym(const char *s)
+{
+	Atom a = make_sym(s);
+	symbol_of(a)->permanent = 1;
 	return a;
 }
 
+/* A permanent symbol that read never returns */
+Atom make_uninterned_sym(const char *s)
+{
+	struct Symbol *sym = symbol_new(s, 0);
+	sym->permanent = 1;
+	return symbol_atom(sym);
+}
+
+/* make_sym behind a small direct-mapped cache, for readers that see
+ * the same few names over and over (JSON keys, CSV symbol columns) */
+#define SYM_CACHE_SIZE 1024
+
+static Atom sym_cache[SYM_CACHE_SIZE];
+
+Atom make_sym_cached(const char *s, long len)
+{
+	unsigned long h = 5381;
+	long i;
+	Atom *slot;
+
+	for (i = 0; i < len; i++)
+		h = h * 33 + (unsigned char)s[i];
+	slot = &sym_cache[h % SYM_CACHE_SIZE];
+	if (slot->type != AtomType_Symbol || strcmp(slot->value.symbol, s) != 0)
+		*slot = make_sym(s);
+	return *slot;
+}
+
+/* Free the symbols gc_mark did not reach and clear the marks of the rest */
+void symbols_sweep(void)
+{
+	struct Symbol **p, *sym;
+	unsigned long i;
+
+	memset(sym_cache, 0, sizeof(sym_cache));
+	for (i = 0; i < sym_nbuckets; i++) {
+		p = &sym_buckets[i];
+		while (*p != NULL) {
+			sym = *p;
+			if (!sym->mark && !sym->permanent) {
+				*p = sym->next;
+				free(sym);
+				sym_count--;
+			}
+			else {
+				sym->mark = 0;
+				p = &sym->next;
+			}
+		}
+	}
+}
+
 Atom make_builtin(Builtin fn)
 {
 	Atom a;
@@ -182,6 +748,19 @@ Atom make_builtin(Builtin fn)
 	return a;
 }
 
+/* Environments referenced by a closure, and their parents, must never be
+ * released when the call that created them returns */
+void env_capture(Atom env)
+{
+	while (!nilp(env) && !allocation_of(env)->captured) {
+		allocation_of(env)->captured = 1;
+		env = car(env);
+	}
+}
+
+/* A closure is ((env . code) args . body).  body is the source, which
+ * is what prints and what specialize reads; code is the body that runs,
+ * the same list until optimize_closure rewrites it. */
 Error make_closure(Atom env, Atom args, Atom body, Atom *result)
 {
 	Atom p;
@@ -200,7 +779,10 @@ Error make_closure(Atom env, Atom args, Atom body, Atom *result)
 		p = cdr(p);
 	}
 
-	*result = cons(env, cons(args, body));
+	env_capture(env);
+	if (!nilp(car(env)))
+		env = env_flatten(env, args, body);
+	*result = cons(cons(env, body), cons(args, body));
 	result->type = AtomType_Closure;
 
 	return Error_OK;
@@ -208,188 +790,642 @@ Error make_closure(Atom env, Atom args, Atom body, Atom *result)
 
 
 
-void print_expr(Atom atom)
+/* Ports: buffered input and output on files and strings.  Characters go
+ * through a large user-space buffer, so stdio is only entered once per
+ * buffer.  Output ports are flushed when the buffer fills, by
+ * flush-output, by close-port, when they are collected and at exit. */
+#define PORT_BUFFER_SIZE 65536
+
+static struct Port *output_ports = NULL;
+
+struct Port *port_of(Atom a)
 {
-	switch (atom.type) {
-	case AtomType_Nil:
-		printf("nil");
-		break;
-	case AtomType_Pair:
-		putchar('(');
-		print_expr(car(atom));
-		atom = cdr(atom);
-		while (!nilp(atom)) {
-			if (atom.type == AtomType_Pair) {
-				putchar(' ');
-				print_expr(car(atom));
-				atom = cdr(atom);
-			}
-			else {
-				printf(" . ");
-				print_expr(atom);
-				break;
-			}
-		}
-		putchar(')');
-		break;
-	case AtomType_Symbol:
-		printf("%s", atom.value.symbol);
-		break;
-	case AtomType_Integer:
-		printf("%ld", atom.value.integer);
-		break;
-	case AtomType_Builtin:
-		printf("#<BUILTIN:%p>", atom.value.builtin);
-		break;
-	case AtomType_Closure:
-		print_expr(cdr(atom));
-		break;
-	default:
-		printf("unknown type");
-		break;
-	}
+	return (struct Port *)a.value.object;
 }
 
-Error lex(const char *str, const char **start, const char **end)
+int port_outputp(struct Port *p)
 {
-	const char *ws = " \t\r\n";
-	const char *delim = "() \t\r\n";
-	const char *prefix = "()'`";
-
-	str += strspn(str, ws);
+	return p->kind == PortKind_FileOut || p->kind == PortKind_StringOut;
+}
 
-	if (str[0] == '\0') {
-		*start = *end = NULL;
-		return Error_Syntax;
+Atom make_port(enum PortKind kind, FILE *file, char *buf, size_t len, size_t cap)
+{
+	struct Port *p = (struct Port *)malloc(sizeof(struct Port));
+
+	p->kind = kind;
+	p->file = file;
+	p->closed = 0;
+	p->owned = 1;
+	p->buf = buf;
+	p->pos = 0;
+	p->len = len;
+	p->cap = cap;
+	if (kind == PortKind_FileOut) {
+		p->next_output = output_ports;
+		output_ports = p;
 	}
+	return make_object(&p->object, AtomType_Port);
+}
 
-	*start = str;
-
-	if (strchr(prefix, str[0]) != NULL)
-		*end = str + 1;
-	else if (str[0] == ',')
-		*end = str + (str[1] == '@' ? 2 : 1);
-	else
-		*end = str + strcspn(str, delim);
-
-	return Error_OK;
+/* Set up an unregistered input port reading text in place */
+void port_open_text(struct Port *p, const char *text)
+{
+	p->kind = PortKind_StringIn;
+	p->file = NULL;
+	p->closed = 0;
+	p->owned = 0;
+	p->buf = (char *)text;
+	p->pos = 0;
+	p->len = p->cap = strlen(text);
 }
 
-Error read_expr(const char *input, const char **end, Atom *result);
+void port_flush(struct Port *p)
+{
+	if (p->kind != PortKind_FileOut || p->closed)
+		return;
+	if (p->len > 0)
+		fwrite(p->buf, 1, p->len, p->file);
+	p->len = 0;
+	fflush(p->file);
+}
 
-Error parse_simple(const char *start, const char *end, Atom *result)
+void port_write(struct Port *p, const char *s, size_t n)
 {
-	char *buf, *p;
+	if (p->closed)
+		return;
 
-	/* Is it an integer? */
-	long val = strtol(start, &p, 10);
-	if (p == end) {
-		result->type = AtomType_Integer;
-		result->value.integer = val;
-		return Error_OK;
+	if (p->len + n > p->cap) {
+		if (p->kind == PortKind_StringOut) {
+			while (p->len + n > p->cap)
+				p->cap *= 2;
+			p->buf = (char *)realloc(p->buf, p->cap);
+		}
+		else {
+			fwrite(p->buf, 1, p->len, p->file);
+			p->len = 0;
+			if (n >= p->cap) {
+				fwrite(s, 1, n, p->file);
+				return;
+			}
+		}
 	}
+	memcpy(p->buf + p->len, s, n);
+	p->len += n;
+}
 
-	/* NIL or symbol */
-	buf = (char*)malloc(end - start + 1);
-	p = buf;
-	while (start != end)
-		/* *p++ = toupper(*start), ++start; */
-		*p++ = *start, ++start;
-	*p = '\0';
+void port_putc(struct Port *p, int c)
+{
+	char ch = (char)c;
 
-	if (strcmp(buf, "nil") == 0)
-		*result = nil;
+	if (p->len < p->cap && !p->closed)
+		p->buf[p->len++] = ch;
 	else
-		*result = make_sym(buf);
-
-	free(buf);
+		port_write(p, &ch, 1);
+}
 
-	return Error_OK;
+void port_puts(struct Port *p, const char *s)
+{
+	port_write(p, s, strlen(s));
 }
 
-Error read_list(const char *start, const char **end, Atom *result)
+/* Refill an input buffer; zero at the end of input */
+int port_fill(struct Port *p)
 {
-	Atom p;
+	if (p->kind != PortKind_FileIn || p->closed)
+		return 0;
+	p->pos = 0;
+	p->len = fread(p->buf, 1, p->cap, p->file);
+	return p->len > 0;
+}
 
-	*end = start;
-	p = *result = nil;
+int port_getc(struct Port *p)
+{
+	if (p->pos == p->len && !port_fill(p))
+		return EOF;
+	return (unsigned char)p->buf[p->pos++];
+}
+
+int port_peekc(struct Port *p)
+{
+	if (p->pos == p->len && !port_fill(p))
+		return EOF;
+	return (unsigned char)p->buf[p->pos];
+}
+
+void port_close(struct Port *p)
+{
+	struct Port **q;
+
+	if (p->closed)
+		return;
+	port_flush(p);
+	if (p->kind == PortKind_FileOut) {
+		for (q = &output_ports; *q != NULL; q = &(*q)->next_output) {
+			if (*q == p) {
+				*q = p->next_output;
+				break;
+			}
+		}
+	}
+	if (p->file != NULL && p->file != stdin && p->file != stdout)
+		fclose(p->file);
+	p->closed = 1;
+}
+
+void port_free(struct Port *p)
+{
+	port_close(p);
+	if (p->owned)
+		free(p->buf);
+	free(p);
+}
+
+struct Port *port_stdout()
+{
+	if (nilp(stdout_port))
+		stdout_port = make_port(PortKind_FileOut, stdout,
+			(char *)malloc(PORT_BUFFER_SIZE), 0, PORT_BUFFER_SIZE);
+	return port_of(stdout_port);
+}
+
+void ports_flush_all()
+{
+	struct Port *p;
+
+	for (p = output_ports; p != NULL; p = p->next_output)
+		port_flush(p);
+}
+
+Atom make_string(const char *s, long length)
+{
+	struct String *str = (struct String *)malloc(offsetof(struct String, chars) + length + 1);
+
+	str->length = length;
+	if (s)
+		memcpy(str->chars, s, length);
+	else
+		memset(str->chars, 0, length);
+	str->chars[length] = '\0';
+	return make_object(&str->object, AtomType_String);
+}
+
+struct String *string_of(Atom a)
+{
+	return (struct String *)a.value.object;
+}
+
+/* Shortest of %.15g and %.17g that reads back as x, always with a
+ * decimal point or an exponent */
+void format_real(char *buf, double x)
+{
+	sprintf(buf, "%.15g", x);
+	if (strtod(buf, NULL) != x)
+		sprintf(buf, "%.17g", x);
+	if (strspn(buf, "-0123456789") == strlen(buf))
+		strcat(buf, ".0");
+}
+
+void port_printf(struct Port *p, const char *fmt, ...)
+{
+	char buf[64];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	port_puts(p, buf);
+}
+
+/* Print atom on port; write quotes and escapes strings, display does not */
+void print_atom(struct Port *port, Atom atom, int write)
+{
+	switch (atom.type) {
+	case AtomType_Nil:
+		port_puts(port, "nil");
+		break;
+	case AtomType_Pair:
+		port_putc(port, '(');
+		print_atom(port, car(atom), write);
+		atom = cdr(atom);
+		while (!nilp(atom)) {
+			if (atom.type == AtomType_Pair) {
+				port_putc(port, ' ');
+				print_atom(port, car(atom), write);
+				atom = cdr(atom);
+			}
+			else {
+				port_puts(port, " . ");
+				print_atom(port, atom, write);
+				break;
+			}
+		}
+		port_putc(port, ')');
+		break;
+	case AtomType_Symbol:
+		port_puts(port, atom.value.symbol);
+		break;
+	case AtomType_Integer:
+		port_printf(port, "%ld", atom.value.integer);
+		break;
+	case AtomType_Real: {
+		char buf[32];
+		format_real(buf, atom.value.real);
+		port_puts(port, buf);
+		break;
+	}
+	case AtomType_Values: {
+		int i;
+		if (atom.value.integer != value_generation) {
+			port_puts(port, "#<VALUES>");
+			break;
+		}
+		for (i = 0; i < value_count; i++) {
+			if (i > 0)
+				port_putc(port, ' ');
+			print_atom(port, value_regs[i], write);
+		}
+		break;
+	}
+	case AtomType_Builtin:
+		port_printf(port, "#<BUILTIN:%p>", atom.value.builtin);
+		break;
+	case AtomType_Closure:
+		print_atom(port, cdr(atom), write);
+		break;
+	case AtomType_Memo:
+		port_printf(port, "#<MEMO:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Map:
+		port_printf(port, "#<MAP:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Iterator:
+		port_printf(port, "#<ITERATOR:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Omap:
+		port_printf(port, "#<OMAP:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Bitvec:
+		port_printf(port, "#<BITVEC:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Pq:
+		port_printf(port, "#<PQ:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Port:
+		port_printf(port, "#<PORT:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Library:
+		port_printf(port, "#<LIBRARY:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Foreign:
+		port_printf(port, "#<FOREIGN:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Kv:
+		port_printf(port, "#<KV:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Cell:
+		port_printf(port, "#<CELL:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Promise:
+		port_printf(port, "#<PROMISE:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_WeakTable:
+		port_printf(port, "#<WEAK-TABLE:%p>", (void *)atom.value.object);
+		break;
+	case AtomType_Record: {
+		struct Record *r = (struct Record *)atom.value.object;
+		long i;
+		port_puts(port, "#<");
+		print_atom(port, r->tag, write);
+		for (i = 0; i < r->length; i++) {
+			port_putc(port, ' ');
+			print_atom(port, r->slots[i], write);
+		}
+		port_putc(port, '>');
+		break;
+	}
+	case AtomType_Vector: {
+		struct Vector *v = (struct Vector *)atom.value.object;
+		long i;
+		port_puts(port, "#(");
+		for (i = 0; i < v->length; i++) {
+			if (i > 0)
+				port_putc(port, ' ');
+			print_atom(port, vector_get(v, i), write);
+		}
+		port_putc(port, ')');
+		break;
+	}
+	case AtomType_String: {
+		struct String *s = string_of(atom);
+		long i;
+		if (!write) {
+			port_write(port, s->chars, s->length);
+			break;
+		}
+		port_putc(port, '"');
+		for (i = 0; i < s->length; i++) {
+			switch (s->chars[i]) {
+			case '"':
+				port_puts(port, "\\\"");
+				break;
+			case '\\':
+				port_puts(port, "\\\\");
+				break;
+			case '\n':
+				port_puts(port, "\\n");
+				break;
+			case '\t':
+				port_puts(port, "\\t");
+				break;
+			case '\r':
+				port_puts(port, "\\r");
+				break;
+			default:
+				port_putc(port, s->chars[i]);
+				break;
+			}
+		}
+		port_putc(port, '"');
+		break;
+	}
+	default:
+		port_puts(port, "unknown type");
+		break;
+	}
+}
+
+void print_expr(Atom atom)
+{
+	print_atom(port_stdout(), atom, 1);
+	port_flush(port_stdout());
+}
+
+/* Decimal real syntax: [sign] digits [. digits] [e [sign] digits], with
+ * a digit on one side of the point.  Anything else strtod would take,
+ * such as 0x10, inf or nan, stays a symbol. */
+int real_syntaxp(const char *s, const char *end)
+{
+	int digits = 0;
+
+	if (s < end && (*s == '-' || *s == '+'))
+		s++;
+	for (; s < end && *s >= '0' && *s <= '9'; s++)
+		digits++;
+	if (s < end && *s == '.')
+		for (s++; s < end && *s >= '0' && *s <= '9'; s++)
+			digits++;
+	if (!digits)
+		return 0;
+	if (s < end && (*s == 'e' || *s == 'E')) {
+		s++;
+		if (s < end && (*s == '-' || *s == '+'))
+			s++;
+		if (s == end || *s < '0' || *s > '9')
+			return 0;
+		while (s < end && *s >= '0' && *s <= '9')
+			s++;
+	}
+	return s == end;
+}
+
+Error parse_simple(const char *start, const char *end, Atom *result)
+{
+	char *buf, *p;
+
+	/* Is it an integer? */
+	long val = strtol(start, &p, 10);
+	if (p == end) {
+		result->type = AtomType_Integer;
+		result->value.integer = val;
+		return Error_OK;
+	}
+
+	/* A real */
+	if (real_syntaxp(start, end)) {
+		*result = make_real(strtod(start, NULL));
+		return Error_OK;
+	}
+
+	/* NIL or symbol */
+	buf = (char*)malloc(end - start + 1);
+	p = buf;
+	while (start != end)
+		/* *p++ = toupper(*start), ++start; */
+		*p++ = *start, ++start;
+	*p = '\0';
+
+	if (strcmp(buf, "nil") == 0)
+		*result = nil;
+	else
+		*result = make_sym(buf);
+
+	free(buf);
+
+	return Error_OK;
+}
+
+struct Token {
+	int kind;    /* ( ) ' ` , @ for ,@ " for a string, a for an atom */
+	char *text;  /* of strings and atoms, freed by port_read_token */
+	long len;
+};
+
+int port_delimp(int c)
+{
+	return c == EOF || strchr("() \t\r\n", c) != NULL;
+}
+
+void port_skip_space(struct Port *p)
+{
+	int c;
+
+	while ((c = port_peekc(p)) != EOF && strchr(" \t\r\n", c) != NULL)
+		p->pos++;
+}
+
+/* Append c to a token buffer of capacity *cap */
+void token_append(struct Token *t, long *cap, int c)
+{
+	if (t->len + 1 >= *cap) {
+		*cap *= 2;
+		t->text = (char *)realloc(t->text, *cap);
+	}
+	t->text[t->len++] = (char)c;
+	t->text[t->len] = '\0';
+}
+
+Error port_lex(struct Port *p, struct Token *t)
+{
+	long cap = 32;
+	int c;
+
+	port_skip_space(p);
+	c = port_getc(p);
+	t->text = NULL;
+	t->len = 0;
+	t->kind = c;
+
+	switch (c) {
+	case EOF:
+		t->kind = 0;
+		return Error_Syntax;
+	case '(':
+	case ')':
+	case '\'':
+	case '`':
+		return Error_OK;
+	case ',':
+		if (port_peekc(p) == '@') {
+			p->pos++;
+			t->kind = '@';
+		}
+		return Error_OK;
+	case '"':
+		t->text = (char *)malloc(cap);
+		t->text[0] = '\0';
+		while ((c = port_getc(p)) != '"') {
+			if (c == '\\') {
+				c = port_getc(p);
+				if (c == 'n')
+					c = '\n';
+				else if (c == 't')
+					c = '\t';
+				else if (c == 'r')
+					c = '\r';
+			}
+			if (c == EOF) {
+				free(t->text);
+				return Error_Syntax;
+			}
+			token_append(t, &cap, c);
+		}
+		return Error_OK;
+	default:
+		t->kind = 'a';
+		t->text = (char *)malloc(cap);
+		token_append(t, &cap, c);
+		while (!port_delimp(port_peekc(p)))
+			token_append(t, &cap, port_getc(p));
+		return Error_OK;
+	}
+}
+
+Error port_read_list(struct Port *p, Atom *result);
+
+/* Read the datum starting with token t */
+Error port_read_token(struct Port *p, struct Token *t, Atom *result)
+{
+	Error err = Error_OK;
+
+	switch (t->kind) {
+	case '(':
+		return port_read_list(p, result);
+	case ')':
+		return Error_Syntax;
+	case '\'':
+		*result = cons(sym_quote, cons(nil, nil));
+		return port_read(p, &car(cdr(*result)));
+	case '`':
+		*result = cons(make_sym("quasiquote"), cons(nil, nil));
+		return port_read(p, &car(cdr(*result)));
+	case ',':
+	case '@':
+		*result = cons(make_sym(
+			t->kind == '@' ? "unquote-splicing" : "unquote"),
+			cons(nil, nil));
+		return port_read(p, &car(cdr(*result)));
+	case '"':
+		*result = make_string(t->text, t->len);
+		break;
+	default:
+		err = parse_simple(t->text, t->text + t->len, result);
+		break;
+	}
+	free(t->text);
+	return err;
+}
+
+Error port_read(struct Port *p, Atom *result)
+{
+	struct Token t;
+	Error err;
+
+	err = port_lex(p, &t);
+	if (err)
+		return err;
+	return port_read_token(p, &t, result);
+}
+
+Error port_read_list(struct Port *p, Atom *result)
+{
+	Atom last;
+
+	last = *result = nil;
 
 	for (;;) {
-		const char *token;
+		struct Token t;
 		Atom item;
 		Error err;
 
-		err = lex(*end, &token, end);
+		err = port_lex(p, &t);
 		if (err)
 			return err;
 
-		if (token[0] == ')')
+		if (t.kind == ')')
 			return Error_OK;
 
-		if (token[0] == '.' && *end - token == 1) {
+		if (t.kind == 'a' && t.len == 1 && t.text[0] == '.') {
 			/* Improper list */
-			if (nilp(p))
+			free(t.text);
+			if (nilp(last))
 				return Error_Syntax;
 
-			err = read_expr(*end, end, &item);
+			err = port_read(p, &item);
 			if (err)
 				return err;
 
-			cdr(p) = item;
+			cdr(last) = item;
+			if (!listp(item)) {
+				for (last = *result; last.type == AtomType_Pair; last = cdr(last))
+					allocation_of(last)->proper = 0;
+			}
 
 			/* Read the closing ')' */
-			err = lex(*end, &token, end);
-			if (!err && token[0] != ')')
+			err = port_lex(p, &t);
+			if (!err && t.kind != ')') {
+				free(t.text);
 				err = Error_Syntax;
+			}
 
 			return err;
 		}
 
-		err = read_expr(token, end, &item);
+		err = port_read_token(p, &t, &item);
 		if (err)
 			return err;
 
-		if (nilp(p)) {
+		if (nilp(last)) {
 			/* First item */
 			*result = cons(item, nil);
-			p = *result;
+			last = *result;
 		}
 		else {
-			cdr(p) = cons(item, nil);
-			p = cdr(p);
+			cdr(last) = cons(item, nil);
+			last = cdr(last);
 		}
 	}
 }
 
+/* Read one expression from text, setting *end after it */
 Error read_expr(const char *input, const char **end, Atom *result)
 {
-	const char *token;
+	struct Port port;
 	Error err;
 
-	err = lex(input, &token, end);
-	if (err)
-		return err;
-
-	if (token[0] == '(')
-		return read_list(*end, end, result);
-	else if (token[0] == ')')
-		return Error_Syntax;
-	else if (token[0] == '\'') {
-		*result = cons(make_sym("quote"), cons(nil, nil));
-		return read_expr(*end, end, &car(cdr(*result)));
-	}
-	else if (token[0] == '`') {
-		*result = cons(make_sym("quasiquote"), cons(nil, nil));
-		return read_expr(*end, end, &car(cdr(*result)));
-	}
-	else if (token[0] == ',') {
-		*result = cons(make_sym(
-			token[1] == '@' ? "unquote-splicing" : "unquote"),
-			cons(nil, nil));
-		return read_expr(*end, end, &car(cdr(*result)));
-	}
-	else
-		return parse_simple(token, *end, result);
+	port_open_text(&port, input);
+	err = port_read(&port, result);
+	*end = input + port.pos;
+	return err;
 }
 
 char *readline(char *prompt) {
@@ -430,10 +1466,14 @@ Error env_set(Atom env, Atom symbol, Atom value)
 	Atom bs = cdr(env);
 	Atom b = nil;
 
+	if (value.type == AtomType_Macro)
+		macro_generation++;
+
 	while (!nilp(bs)) {
 		b = car(bs);
 		if (car(b).value.symbol == symbol.value.symbol) {
 			cdr(b) = value;
+			allocation_of(b)->proper = 0;
 			return Error_OK;
 		}
 		bs = cdr(bs);
@@ -445,13 +1485,137 @@ Error env_set(Atom env, Atom symbol, Atom value)
 	return Error_OK;
 }
 
+/* Flat closures.  A closure made in a local environment does not keep
+ * the enclosing frames: its environment is a single frame over the global
+ * one holding just the bindings its body may refer to.  Those are the
+ * (symbol . value) cells of the enclosing frames themselves, so they act
+ * as boxes and assignments made through either side stay visible.
+ *
+ * A body calling a macro may refer to whatever the expansion does, and
+ * one containing define may bind names later, so closures over it keep
+ * the whole environment instead; so does any closure made in a frame
+ * that may still gain bindings (see closure_defines).  The free names
+ * of a lambda expression are found once and kept in a direct-mapped
+ * cache keyed by its body; binding a macro anywhere invalidates the
+ * entries, and gc() empties the cache. */
+
+void closure_free_vars(Atom env, Atom expr, Atom bound, Atom *syms, int *whole)
+{
+	Atom p, value;
+
+	if (expr.type == AtomType_Symbol) {
+		for (p = bound; p.type == AtomType_Pair; p = cdr(p))
+			if (car(p).value.symbol == expr.value.symbol)
+				return;
+		for (p = *syms; !nilp(p); p = cdr(p))
+			if (car(p).value.symbol == expr.value.symbol)
+				return;
+		*syms = cons(expr, *syms);
+		return;
+	}
+	if (expr.type != AtomType_Pair)
+		return;
+
+	if (car(expr).type == AtomType_Symbol) {
+		if (car(expr).value.symbol == sym_quote.value.symbol)
+			return;
+		if (car(expr).value.symbol == sym_lambda.value.symbol
+			&& cdr(expr).type == AtomType_Pair) {
+			for (p = car(cdr(expr)); p.type == AtomType_Pair; p = cdr(p))
+				bound = cons(car(p), bound);
+			if (p.type == AtomType_Symbol)
+				bound = cons(p, bound);
+			expr = cdr(cdr(expr));
+		}
+		else if (car(expr).value.symbol == sym_define.value.symbol
+			|| car(expr).value.symbol == sym_defmacro.value.symbol)
+			*whole = 1;
+		else if (!memq(car(expr), bound) && !env_get(env, car(expr), &value)
+			&& value.type == AtomType_Macro)
+			*whole = 1;
+	}
+
+	for (; expr.type == AtomType_Pair; expr = cdr(expr))
+		closure_free_vars(env, car(expr), bound, syms, whole);
+}
+
+/* Binding cell of symbol in the local frames of env, or nil */
+Atom env_binding(Atom env, Atom symbol)
+{
+	for (; !nilp(car(env)); env = car(env)) {
+		Atom bs;
+		for (bs = cdr(env); !nilp(bs); bs = cdr(bs))
+			if (car(car(bs)).value.symbol == symbol.value.symbol)
+				return car(bs);
+	}
+	return nil;
+}
+
+/* Environment for a closure with parameters args and body made in env */
+Atom env_flatten(Atom env, Atom args, Atom body)
+{
+	Atom genv, frame, bound = nil, p, b;
+	struct FreeVars *f;
+
+	for (p = env; !nilp(car(p)); p = car(p))
+		if (allocation_of(p)->open)
+			return env;
+
+	f = &free_vars_cache[((unsigned long)body.value.pair >> 4)
+		% FREE_VARS_CACHE_SIZE];
+	if (f->body != body.value.pair || f->generation != macro_generation
+		|| f->args.type != args.type
+		|| f->args.value.pair != args.value.pair) {
+		if (f->body != NULL)
+			release_list(f->syms);
+		f->body = body.value.pair;
+		f->args = args;
+		f->syms = nil;
+		f->whole = 0;
+		f->generation = macro_generation;
+		for (p = args; p.type == AtomType_Pair; p = cdr(p))
+			bound = cons(car(p), bound);
+		if (p.type == AtomType_Symbol)
+			bound = cons(p, bound);
+		closure_free_vars(env, body, bound, &f->syms, &f->whole);
+		release_list(bound);
+	}
+	if (f->whole)
+		return env;
+
+	genv = env;
+	while (!nilp(car(genv)))
+		genv = car(genv);
+
+	frame = genv;
+	for (p = f->syms; !nilp(p); p = cdr(p)) {
+		b = env_binding(env, car(p));
+		if (!nilp(b)) {
+			if (nilp(car(frame)))
+				frame = env_create(genv);
+			cdr(frame) = cons(b, cdr(frame));
+		}
+	}
+
+	return frame;
+}
+
+/* Cells whose list is known to be proper carry the proper flag; a cdr
+ * may only be replaced by something other than a proper list after
+ * clearing the flags of the cells leading to it. */
 int listp(Atom expr)
 {
-	while (!nilp(expr)) {
-		if (expr.type != AtomType_Pair)
+	Atom p;
+
+	for (p = expr; !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair)
 			return 0;
-		expr = cdr(expr);
+		if (allocation_of(p)->proper)
+			break;
 	}
+
+	for (; expr.type == AtomType_Pair && !allocation_of(expr)->proper; expr = cdr(expr))
+		allocation_of(expr)->proper = 1;
 	return 1;
 }
 
@@ -475,258 +1639,7410 @@ Atom copy_list(Atom list)
 	return a;
 }
 
-Error apply(Atom fn, Atom args, Atom *result)
-{
-	Atom env, arg_names, body;
-
-	if (fn.type == AtomType_Builtin)
-		return (*fn.value.builtin)(args, result);
-	else if (fn.type != AtomType_Closure)
-		return Error_Type;
+Atom fixnum_generic(Atom expr);
 
-	env = env_create(car(fn));
-	arg_names = car(cdr(fn));
-	body = cdr(cdr(fn));
+/* Inlining of small non-recursive global closures.  The callee's code is
+ * substituted into the caller's code; the source bodies are left alone.
+ * inline_deps holds entries (callee . (caller . original-body)), one per
+ * global symbol whose closure body was substituted into a caller. */
+#define INLINE_MAX_NODES 16
 
-	/* Bind the arguments */
-	while (!nilp(arg_names)) {
-		if (arg_names.type == AtomType_Symbol) {
+int memq(Atom sym, Atom list)
+{
+	while (list.type == AtomType_Pair) {
+		if (car(list).type == AtomType_Symbol
+			&& car(list).value.symbol == sym.value.symbol)
+			return 1;
+		list = cdr(list);
+	}
+	return 0;
+}
+
+int fixed_argsp(Atom arg_names)
+{
+	while (arg_names.type == AtomType_Pair)
+		arg_names = cdr(arg_names);
+	return nilp(arg_names);
+}
+
+int global_envp(Atom env)
+{
+	return nilp(car(env));
+}
+
+Atom global_env_of(Atom env)
+{
+	while (!nilp(car(env)))
+		env = car(env);
+	return env;
+}
+
+int inline_count_nodes(Atom expr)
+{
+	int n = 1;
+	while (expr.type == AtomType_Pair) {
+		n += inline_count_nodes(car(expr));
+		expr = cdr(expr);
+	}
+	return n;
+}
+
+/* Number of evaluated occurrences of sym in expr */
+int inline_count_refs(Atom expr, Atom sym)
+{
+	int n = 0;
+
+	if (expr.type == AtomType_Symbol)
+		return expr.value.symbol == sym.value.symbol;
+	if (expr.type != AtomType_Pair)
+		return 0;
+	if (car(expr).type == AtomType_Symbol
+		&& car(expr).value.symbol == sym_quote.value.symbol)
+		return 0;
+	while (expr.type == AtomType_Pair) {
+		n += inline_count_refs(car(expr), sym);
+		expr = cdr(expr);
+	}
+	return n;
+}
+
+/* Does any evaluated symbol of expr, other than those in skip, appear in list? */
+int inline_captures(Atom expr, Atom skip, Atom list)
+{
+	if (expr.type == AtomType_Symbol)
+		return !memq(expr, skip) && memq(expr, list);
+	if (expr.type != AtomType_Pair)
+		return 0;
+	if (car(expr).type == AtomType_Symbol
+		&& car(expr).value.symbol == sym_quote.value.symbol)
+		return 0;
+	while (expr.type == AtomType_Pair) {
+		if (inline_captures(car(expr), skip, list))
+			return 1;
+		expr = cdr(expr);
+	}
+	return 0;
+}
+
+/* Body may only contain calls, if and quote; no binding forms or macros */
+int inline_simple_body(Atom expr, Atom genv)
+{
+	Atom op, value;
+
+	if (expr.type != AtomType_Pair)
+		return 1;
+	if (!listp(expr))
+		return 0;
+
+	op = car(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_quote.value.symbol)
+			return 1;
+		if (op.value.symbol == sym_lambda.value.symbol
+			|| op.value.symbol == sym_define.value.symbol
+			|| op.value.symbol == sym_defmacro.value.symbol
+			|| op.value.symbol == sym_delay.value.symbol)
+			return 0;
+		if (!env_get(genv, op, &value) && value.type == AtomType_Macro)
+			return 0;
+	}
+
+	while (!nilp(expr)) {
+		if (!inline_simple_body(car(expr), genv))
+			return 0;
+		expr = cdr(expr);
+	}
+	return 1;
+}
+
+/* Return the closure bound to sym if it may be inlined, otherwise nil */
+Atom inline_candidate(Atom genv, Atom sym)
+{
+	Atom fn, p, body;
+
+	if (env_get(genv, sym, &fn) || fn.type != AtomType_Closure)
+		return nil;
+	if (!global_envp(car(car(fn))))
+		return nil;
+
+	/* Fixed argument list only */
+	p = car(cdr(fn));
+	while (!nilp(p)) {
+		if (p.type != AtomType_Pair)
+			return nil;
+		p = cdr(p);
+	}
+
+	body = cdr(car(fn));
+	if (nilp(body) || !nilp(cdr(body)))
+		return nil;
+	body = fixnum_generic(car(body));
+	if (inline_count_nodes(body) > INLINE_MAX_NODES
+		|| inline_count_refs(body, sym) > 0
+		|| !inline_simple_body(body, genv))
+		return nil;
+
+	return fn;
+}
+
+Atom inline_subst(Atom expr, Atom params, Atom args)
+{
+	Atom head, p;
+
+	if (expr.type == AtomType_Symbol) {
+		while (!nilp(params)) {
+			if (car(params).value.symbol == expr.value.symbol)
+				return car(args);
+			params = cdr(params);
+			args = cdr(args);
+		}
+		return expr;
+	}
+	if (expr.type != AtomType_Pair)
+		return expr;
+	if (car(expr).type == AtomType_Symbol
+		&& car(expr).value.symbol == sym_quote.value.symbol)
+		return expr;
+
+	head = p = cons(inline_subst(car(expr), params, args), nil);
+	expr = cdr(expr);
+	while (!nilp(expr)) {
+		cdr(p) = cons(inline_subst(car(expr), params, args), nil);
+		p = cdr(p);
+		expr = cdr(expr);
+	}
+	return head;
+}
+
+int inline_trivialp(Atom expr)
+{
+	if (expr.type != AtomType_Pair)
+		return 1;
+	return car(expr).type == AtomType_Symbol
+		&& car(expr).value.symbol == sym_quote.value.symbol;
+}
+
+/* Is sym the first thing evaluating expr reaches, before any call? */
+int inline_leadingp(Atom expr, Atom sym)
+{
+	if (inline_trivialp(expr))
+		return expr.type == AtomType_Symbol
+			&& expr.value.symbol == sym.value.symbol;
+	for (; expr.type == AtomType_Pair; expr = cdr(expr)) {
+		if (!inline_trivialp(car(expr)))
+			return inline_leadingp(car(expr), sym);
+		if (car(expr).type == AtomType_Symbol
+			&& car(expr).value.symbol == sym.value.symbol)
+			return 1;
+	}
+	return 0;
+}
+
+void inline_add_dep(Atom callee, Atom caller, Atom orig)
+{
+	inline_deps = cons(cons(callee, cons(caller, orig)), inline_deps);
+}
+
+/* Try to expand the call expr = (sym . args) with the body of sym */
+int inline_call(Atom genv, Atom expr, Atom bound, Atom caller, Atom orig,
+	Atom *result)
+{
+	Atom fn, params, args, body, p, q, param = nil, arg = nil;
+	int nontrivial = 0;
+
+	fn = inline_candidate(genv, car(expr));
+	if (nilp(fn))
+		return 0;
+
+	params = car(cdr(fn));
+	body = fixnum_generic(car(cdr(car(fn))));
+	args = cdr(expr);
+
+	/* Arity must match exactly; mismatches keep the call to report errors */
+	p = params;
+	q = args;
+	while (!nilp(p) && !nilp(q)) {
+		if (!inline_trivialp(car(q))) {
+			/* At most one, evaluated exactly once */
+			if (++nontrivial > 1
+				|| inline_count_refs(body, car(p)) != 1
+				|| inline_count_refs(body, sym_if) > 0)
+				return 0;
+			param = car(p);
+			arg = car(q);
+		}
+		p = cdr(p);
+		q = cdr(q);
+	}
+	if (!nilp(p) || !nilp(q))
+		return 0;
+
+	/* Free variables of the callee must not be shadowed at the call site */
+	if (inline_captures(body, params, bound))
+		return 0;
+
+	if (nontrivial && !inline_leadingp(body, param)) {
+		/* Substituted in place it would run after calls made before it;
+		 * bind it first, as the call did */
+		Atom ps = nil, as = nil;
+
+		for (p = params, q = args; !nilp(p); p = cdr(p), q = cdr(q)) {
+			if (car(p).value.symbol == param.value.symbol)
+				continue;
+			if (car(q).type == AtomType_Symbol
+				&& car(q).value.symbol == param.value.symbol)
+				return 0;
+			ps = cons(car(p), ps);
+			as = cons(car(q), as);
+		}
+		body = inline_subst(body, ps, as);
+		*result = cons(cons(sym_lambda, cons(cons(param, nil),
+			cons(body, nil))), cons(arg, nil));
+	}
+	else
+		*result = inline_subst(body, params, args);
+
+	/* Depend on the callee and on everything inlined into it */
+	inline_add_dep(car(expr), caller, orig);
+	for (p = inline_deps; !nilp(p); p = cdr(p)) {
+		Atom e = car(p);
+		if (car(cdr(e)).value.pair == fn.value.pair)
+			inline_add_dep(car(e), caller, orig);
+	}
+
+	return 1;
+}
+
+Atom inline_expr(Atom genv, Atom expr, Atom bound, Atom caller, Atom orig);
+
+Atom inline_list(Atom genv, Atom list, Atom bound, Atom caller, Atom orig)
+{
+	Atom head, tail, p, x;
+	int changed = 0;
+
+	head = tail = nil;
+	for (p = list; p.type == AtomType_Pair; p = cdr(p)) {
+		x = inline_expr(genv, car(p), bound, caller, orig);
+		if (x.type != car(p).type || x.value.pair != car(p).value.pair)
+			changed = 1;
+		if (nilp(head))
+			head = tail = cons(x, nil);
+		else {
+			cdr(tail) = cons(x, nil);
+			tail = cdr(tail);
+		}
+	}
+
+	return changed ? head : list;
+}
+
+Atom inline_expr(Atom genv, Atom expr, Atom bound, Atom caller, Atom orig)
+{
+	Atom op, args, value, result;
+
+	if (expr.type != AtomType_Pair || !listp(expr))
+		return expr;
+
+	op = car(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_quote.value.symbol)
+			return expr;
+		if (op.value.symbol == sym_lambda.value.symbol) {
+			Atom body;
+
+			if (nilp(cdr(expr)))
+				return expr;
+			/* Parameters shadow globals inside the lambda */
+			for (args = car(cdr(expr)); args.type == AtomType_Pair; args = cdr(args))
+				bound = cons(car(args), bound);
+			if (args.type == AtomType_Symbol)
+				bound = cons(args, bound);
+
+			body = inline_list(genv, cdr(cdr(expr)), bound, caller, orig);
+			if (body.value.pair == cdr(cdr(expr)).value.pair)
+				return expr;
+			return cons(op, cons(car(cdr(expr)), body));
+		}
+		if (!memq(op, bound)) {
+			if (!env_get(genv, op, &value) && value.type == AtomType_Macro)
+				return expr;
+
+			args = inline_list(genv, cdr(expr), bound, caller, orig);
+			if (args.value.pair != cdr(expr).value.pair)
+				expr = cons(op, args);
+			if (inline_call(genv, expr, bound, caller, orig, &result))
+				return result;
+			return expr;
+		}
+	}
+
+	return inline_list(genv, expr, bound, caller, orig);
+}
+
+/* Inline small global closures into the body of the closure fn */
+void inline_closure(Atom genv, Atom fn)
+{
+	Atom args, bound, body, orig;
+
+	orig = cdr(cdr(fn));
+	if (inline_count_refs(orig, sym_define) > 0
+		|| inline_count_refs(orig, sym_defmacro) > 0)
+		return;
+
+	bound = nil;
+	for (args = car(cdr(fn)); args.type == AtomType_Pair; args = cdr(args))
+		bound = cons(car(args), bound);
+	if (args.type == AtomType_Symbol)
+		bound = cons(args, bound);
+
+	body = inline_list(genv, orig, bound, fn, orig);
+	cdr(car(fn)) = body;
+}
+
+/* Fixnum specialization.  A global closure whose fixed parameters are
+ * used as operands of the integer builtins gets the body
+ *
+ *   (#fixnum-guard (params...) specialized generic)
+ *
+ * which checks once, on entry, that those parameters are integers.  In
+ * the specialized expression, arithmetic over integer literals and these
+ * parameters is (#fixnum builtin a b), evaluated directly by fixnum_eval
+ * without frames, argument lists or type checks. */
+
+/* Builtin bound to op if it is one fixnum_eval implements */
+Builtin fixnum_builtin(Atom genv, Atom op, Atom params)
+{
+	Atom value;
+
+	if (op.type != AtomType_Symbol || memq(op, params)
+		|| env_get(genv, op, &value) || value.type != AtomType_Builtin)
+		return NULL;
+
+	if (value.value.builtin == builtin_add
+		|| value.value.builtin == builtin_subtract
+		|| value.value.builtin == builtin_multiply
+		|| value.value.builtin == builtin_numeq
+		|| value.value.builtin == builtin_less)
+		return value.value.builtin;
+	return NULL;
+}
+
+/* Quoted data, lambdas and macro calls are left alone: their bodies may
+ * rebind a parameter or not be code at all */
+int fixnum_opaquep(Atom genv, Atom op, Atom params)
+{
+	Atom value;
+
+	if (op.type != AtomType_Symbol)
+		return 0;
+	if (op.value.symbol == sym_quote.value.symbol
+		|| op.value.symbol == sym_lambda.value.symbol)
+		return 1;
+	return !memq(op, params) && !env_get(genv, op, &value)
+		&& value.type == AtomType_Macro;
+}
+
+int fixnum_binaryp(Atom expr)
+{
+	return expr.type == AtomType_Pair && listp(expr)
+		&& !nilp(cdr(expr)) && !nilp(cdr(cdr(expr)))
+		&& nilp(cdr(cdr(cdr(expr))));
+}
+
+/* Collect parameters used directly as operands of fixnum builtins */
+void fixnum_collect(Atom genv, Atom expr, Atom params, Atom *used)
+{
+	Atom op;
+
+	if (expr.type != AtomType_Pair || !listp(expr))
+		return;
+
+	op = car(expr);
+	if (fixnum_opaquep(genv, op, params))
+		return;
+
+	if (fixnum_binaryp(expr) && fixnum_builtin(genv, op, params)) {
+		Atom p;
+		for (p = cdr(expr); !nilp(p); p = cdr(p))
+			if (car(p).type == AtomType_Symbol && memq(car(p), params)
+				&& !memq(car(p), *used))
+				*used = cons(car(p), *used);
+	}
+
+	for (; !nilp(expr); expr = cdr(expr))
+		fixnum_collect(genv, car(expr), params, used);
+}
+
+int fixnum_typedp(Atom genv, Atom expr, Atom params, Atom fixnums)
+{
+	Builtin fn;
+
+	if (expr.type == AtomType_Integer)
+		return 1;
+	if (expr.type == AtomType_Symbol)
+		return memq(expr, fixnums);
+	if (!fixnum_binaryp(expr))
+		return 0;
+
+	fn = fixnum_builtin(genv, car(expr), params);
+	return (fn == builtin_add || fn == builtin_subtract || fn == builtin_multiply)
+		&& fixnum_typedp(genv, car(cdr(expr)), params, fixnums)
+		&& fixnum_typedp(genv, car(cdr(cdr(expr))), params, fixnums);
+}
+
+Atom fixnum_node(Atom genv, Atom expr, Atom params, Atom fn, Atom orig)
+{
+	Atom value;
+
+	if (expr.type != AtomType_Pair)
+		return expr;
+
+	inline_add_dep(car(expr), fn, orig);
+	env_get(genv, car(expr), &value);
+	return cons(sym_fixnum, cons(value,
+		cons(fixnum_node(genv, car(cdr(expr)), params, fn, orig),
+		cons(fixnum_node(genv, car(cdr(cdr(expr))), params, fn, orig),
+		nil))));
+}
+
+Atom fixnum_expr(Atom genv, Atom expr, Atom params, Atom fixnums,
+	Atom fn, Atom orig)
+{
+	Atom op, head, tail, p;
+	int changed = 0;
+
+	if (expr.type != AtomType_Pair || !listp(expr))
+		return expr;
+
+	op = car(expr);
+	if (fixnum_opaquep(genv, op, params))
+		return expr;
+
+	if (fixnum_binaryp(expr) && fixnum_builtin(genv, op, params)
+		&& fixnum_typedp(genv, car(cdr(expr)), params, fixnums)
+		&& fixnum_typedp(genv, car(cdr(cdr(expr))), params, fixnums))
+		return fixnum_node(genv, expr, params, fn, orig);
+
+	head = tail = nil;
+	for (p = expr; !nilp(p); p = cdr(p)) {
+		Atom x = fixnum_expr(genv, car(p), params, fixnums, fn, orig);
+		if (x.type != car(p).type || x.value.pair != car(p).value.pair)
+			changed = 1;
+		if (nilp(head))
+			head = tail = cons(x, nil);
+		else {
+			cdr(tail) = cons(x, nil);
+			tail = cdr(tail);
+		}
+	}
+
+	return changed ? head : expr;
+}
+
+void fixnum_closure(Atom genv, Atom fn, Atom orig)
+{
+	Atom params, body, fixnums = nil, spec;
+
+	params = car(cdr(fn));
+	body = cdr(car(fn));
+	if (!fixed_argsp(params) || nilp(body) || !nilp(cdr(body))
+		|| inline_count_refs(body, sym_define) > 0)
+		return;
+
+	fixnum_collect(genv, car(body), params, &fixnums);
+	if (nilp(fixnums))
+		return;
+
+	spec = fixnum_expr(genv, car(body), params, fixnums, fn, orig);
+	if (spec.value.pair == car(body).value.pair)
+		return;
+
+	cdr(car(fn)) = cons(cons(sym_fixnum_guard,
+		cons(fixnums, cons(spec, cons(car(body), nil)))), nil);
+}
+
+/* The unspecialized expression of a possibly guarded body expression */
+Atom fixnum_generic(Atom expr)
+{
+	if (expr.type == AtomType_Pair
+		&& car(expr).type == AtomType_Symbol
+		&& car(expr).value.symbol == sym_fixnum_guard.value.symbol)
+		return car(cdr(cdr(cdr(expr))));
+	return expr;
+}
+
+long fixnum_value(Atom expr, Atom env)
+{
+	Atom a;
+	Builtin fn;
+	long x, y;
+
+	if (expr.type == AtomType_Integer)
+		return expr.value.integer;
+	if (expr.type == AtomType_Symbol) {
+		env_get(env, expr, &a);
+		return a.value.integer;
+	}
+
+	fn = list_get(expr, 1).value.builtin;
+	x = fixnum_value(list_get(expr, 2), env);
+	y = fixnum_value(list_get(expr, 3), env);
+	if (fn == builtin_add)
+		return x + y;
+	if (fn == builtin_subtract)
+		return x - y;
+	if (fn == builtin_multiply)
+		return x * y;
+	if (fn == builtin_numeq)
+		return x == y;
+	return x < y;
+}
+
+Atom fixnum_eval(Atom expr, Atom env)
+{
+	Builtin fn = list_get(expr, 1).value.builtin;
+	long x = fixnum_value(expr, env);
+
+	if (fn == builtin_numeq || fn == builtin_less)
+		return x ? sym_t : nil;
+	return make_int(x);
+}
+
+/* Inline callees, then specialize for fixnum parameters */
+void optimize_closure(Atom genv, Atom fn)
+{
+	Atom orig = cdr(cdr(fn));
+
+	inline_closure(genv, fn);
+	fixnum_closure(genv, fn, orig);
+}
+
+int inline_memberp(Atom fn, Atom list)
+{
+	for (; !nilp(list); list = cdr(list))
+		if (car(list).value.pair == fn.value.pair)
+			return 1;
+	return 0;
+}
+
+/* Drop the dependency entries of every caller in list */
+void inline_forget(Atom list)
+{
+	Atom *pp = &inline_deps;
+
+	while (!nilp(*pp)) {
+		if (inline_memberp(car(cdr(car(*pp))), list))
+			*pp = cdr(*pp);
+		else
+			pp = &cdr(*pp);
+	}
+}
+
+/* Bind sym in env, keeping inlined copies of global closures up to date */
+Error env_define(Atom env, Atom symbol, Atom value)
+{
+	Atom old, p, stale = nil;
+
+	if (!global_envp(env))
+		return env_set(env, symbol, value);
+
+	if (!env_get(env, symbol, &old) && old.type == AtomType_Closure)
+		inline_forget(cons(old, nil));
+	(void)env_set(env, symbol, value);
+
+	/* Restore the original bodies of closures that inlined symbol */
+	for (p = inline_deps; !nilp(p); p = cdr(p)) {
+		Atom e = car(p);
+		if (car(e).value.symbol == symbol.value.symbol
+			&& !inline_memberp(car(cdr(e)), stale)) {
+			cdr(car(car(cdr(e)))) = cdr(cdr(e));
+			stale = cons(car(cdr(e)), stale);
+		}
+	}
+	inline_forget(stale);
+
+	for (p = stale; !nilp(p); p = cdr(p))
+		optimize_closure(env, car(p));
+
+	if (value.type == AtomType_Closure && global_envp(car(car(value))))
+		optimize_closure(env, value);
+
+	return Error_OK;
+}
+
+/* Escape analysis: a closure whose body creates no closures (lambda,
+ * define, defmacro, delay or a call to a known macro) gets its environment and
+ * frame recycled when the call returns.  Calls through parameters are
+ * trusted here; env_capture still catches capture at run time. */
+int escape_scan(Atom expr, Atom genv)
+{
+	Atom op, value;
+
+	if (expr.type != AtomType_Pair)
+		return 0;
+
+	op = car(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_quote.value.symbol)
+			return 0;
+		if (op.value.symbol == sym_lambda.value.symbol
+			|| op.value.symbol == sym_define.value.symbol
+			|| op.value.symbol == sym_defmacro.value.symbol
+			|| op.value.symbol == sym_delay.value.symbol)
+			return 1;
+		if (!env_get(genv, op, &value) && value.type == AtomType_Macro)
+			return 1;
+	}
+
+	while (expr.type == AtomType_Pair) {
+		if (escape_scan(car(expr), genv))
+			return 1;
+		expr = cdr(expr);
+	}
+	return 0;
+}
+
+/* Whether expr may bind names in the frame it runs in: it contains a
+ * define or defmacro, or a call to a known macro */
+int define_scan(Atom expr, Atom genv)
+{
+	Atom op, value;
+
+	if (expr.type != AtomType_Pair)
+		return 0;
+
+	op = car(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_quote.value.symbol)
+			return 0;
+		if (op.value.symbol == sym_define.value.symbol
+			|| op.value.symbol == sym_defmacro.value.symbol)
+			return 1;
+		if (!env_get(genv, op, &value) && value.type == AtomType_Macro)
+			return 1;
+	}
+
+	while (expr.type == AtomType_Pair) {
+		if (define_scan(car(expr), genv))
+			return 1;
+		expr = cdr(expr);
+	}
+	return 0;
+}
+
+int closure_noescape(Atom fn)
+{
+	struct Allocation *a = allocation_of(fn);
+
+	if (!a->analyzed) {
+		Atom genv = global_env_of(car(car(fn)));
+
+		a->noescape = !escape_scan(cdr(car(fn)), genv);
+		a->open = !a->noescape && define_scan(cdr(car(fn)), genv);
+		a->analyzed = 1;
+	}
+	return a->noescape;
+}
+
+/* A frame of a closure whose body may define names is marked open, and
+ * closures made in it keep the whole environment, so that they see
+ * definitions made after they were created */
+int closure_defines(Atom fn)
+{
+	return !closure_noescape(fn) && allocation_of(fn)->open;
+}
+
+/* Recycle the bindings of an environment nothing else refers to */
+void env_release(Atom env)
+{
+	Atom bs;
+
+	if (allocation_of(env)->captured)
+		return;
+
+	bs = cdr(env);
+	while (!nilp(bs)) {
+		Atom next = cdr(bs);
+		release(car(bs));
+		release(bs);
+		bs = next;
+	}
+	release(env);
+}
+
+Error apply(Atom fn, Atom args, Atom *result)
+{
+	Atom env, arg_names, body;
+	struct Root *roots, r[2];
+
+	if (fn.type == AtomType_Builtin)
+		return (*fn.value.builtin)(args, result);
+	else if (fn.type == AtomType_Foreign)
+		return ffi_call((struct Foreign *)fn.value.object, args, result);
+	else if (fn.type == AtomType_Memo) {
+		struct Memo *m = (struct Memo *)fn.value.object;
+		struct Root *roots = gc_roots, r[2];
+		Error err;
+
+		if (memo_lookup(m, args, result))
+			return Error_OK;
+
+		gc_protect(&r[0], &fn);
+		gc_protect(&r[1], &args);
+		err = apply(m->fn, args, result);
+		gc_roots = roots;
+		if (!err)
+			memo_store(m, copy_list(args), *result);
+		return err;
+	}
+	else if (fn.type != AtomType_Closure)
+		return Error_Type;
+
+	env = env_create(car(car(fn)));
+	arg_names = car(cdr(fn));
+	body = cdr(car(fn));
+
+	/* Bind the arguments */
+	while (!nilp(arg_names)) {
+		if (arg_names.type == AtomType_Symbol) {
 			env_set(env, arg_names, args);
 			args = nil;
 			break;
 		}
 
-		if (nilp(args))
-			return Error_Args;
-		env_set(env, car(arg_names), car(args));
-		arg_names = cdr(arg_names);
-		args = cdr(args);
+		if (nilp(args))
+			return Error_Args;
+		env_set(env, car(arg_names), car(args));
+		arg_names = cdr(arg_names);
+		args = cdr(args);
+	}
+	if (!nilp(args))
+		return Error_Args;
+
+	if (closure_defines(fn))
+		allocation_of(env)->open = 1;
+
+	/* Evaluate the body; a tail call in it leaves env unreachable from
+	 * the evaluator, so keep it alive until it is released */
+	roots = gc_roots;
+	gc_protect(&r[0], &fn);
+	gc_protect(&r[1], &env);
+	while (!nilp(body)) {
+		Error err = eval_expr(car(body), env, result);
+		if (err) {
+			gc_roots = roots;
+			return err;
+		}
+		body = cdr(body);
+	}
+	gc_roots = roots;
+
+	if (closure_noescape(fn))
+		env_release(env);
+
+	return Error_OK;
+
+}
+
+Error builtin_car(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (nilp(car(args)))
+		*result = nil;
+	else if (car(args).type != AtomType_Pair)
+		return Error_Type;
+	else
+		*result = car(car(args));
+
+	return Error_OK;
+}
+
+Error builtin_cdr(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (nilp(car(args)))
+		*result = nil;
+	else if (car(args).type != AtomType_Pair)
+		return Error_Type;
+	else
+		*result = cdr(car(args));
+
+	return Error_OK;
+}
+
+Error builtin_cons(Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	*result = cons(car(args), car(cdr(args)));
+
+	return Error_OK;
+}
+
+/* Arithmetic on two integers stays exact; if either is a real, both are
+ * converted */
+int real_args(Atom a, Atom b, double *x, double *y)
+{
+	if ((a.type != AtomType_Integer && a.type != AtomType_Real)
+		|| (b.type != AtomType_Integer && b.type != AtomType_Real))
+		return 0;
+	*x = a.type == AtomType_Real ? a.value.real : (double)a.value.integer;
+	*y = b.type == AtomType_Real ? b.value.real : (double)b.value.integer;
+	return 1;
+}
+
+Error builtin_add(Atom args, Atom *result)
+{
+	Atom a, b;
+	double x, y;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+
+	if (a.type == AtomType_Integer && b.type == AtomType_Integer)
+		*result = make_int(a.value.integer + b.value.integer);
+	else if (real_args(a, b, &x, &y))
+		*result = make_real(x + y);
+	else
+		return Error_Type;
+
+	return Error_OK;
+}
+
+Error builtin_subtract(Atom args, Atom *result)
+{
+	Atom a, b;
+	double x, y;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+
+	if (a.type == AtomType_Integer && b.type == AtomType_Integer)
+		*result = make_int(a.value.integer - b.value.integer);
+	else if (real_args(a, b, &x, &y))
+		*result = make_real(x - y);
+	else
+		return Error_Type;
+
+	return Error_OK;
+}
+
+Error builtin_multiply(Atom args, Atom *result)
+{
+	Atom a, b;
+	double x, y;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+
+	if (a.type == AtomType_Integer && b.type == AtomType_Integer)
+		*result = make_int(a.value.integer * b.value.integer);
+	else if (real_args(a, b, &x, &y))
+		*result = make_real(x * y);
+	else
+		return Error_Type;
+
+	return Error_OK;
+}
+
+Error builtin_divide(Atom args, Atom *result)
+{
+	Atom a, b;
+	double x, y;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+
+	if (a.type == AtomType_Integer && b.type == AtomType_Integer)
+		*result = make_int(a.value.integer / b.value.integer);
+	else if (real_args(a, b, &x, &y))
+		*result = make_real(x / y);
+	else
+		return Error_Type;
+
+	return Error_OK;
+}
+
+Error builtin_numeq(Atom args, Atom *result)
+{
+	Atom a, b;
+	double x, y;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+
+	if (a.type == AtomType_Integer && b.type == AtomType_Integer)
+		*result = (a.value.integer == b.value.integer) ? sym_t : nil;
+	else if (real_args(a, b, &x, &y))
+		*result = (x == y) ? sym_t : nil;
+	else
+		return Error_Type;
+
+	return Error_OK;
+}
+
+Error builtin_less(Atom args, Atom *result)
+{
+	Atom a, b;
+	double x, y;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	a = car(args);
+	b = car(cdr(args));
+
+	if (a.type == AtomType_Integer && b.type == AtomType_Integer)
+		*result = (a.value.integer < b.value.integer) ? sym_t : nil;
+	else if (real_args(a, b, &x, &y))
+		*result = (x < y) ? sym_t : nil;
+	else
+		return Error_Type;
+
+	return Error_OK;
+}
+
+Error builtin_apply(Atom args, Atom *result)
+{
+	Atom fn;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	fn = car(args);
+	args = car(cdr(args));
+
+	if (!listp(args))
+		return Error_Syntax;
+
+	return apply(fn, args, result);
+}
+
+int eqp(Atom a, Atom b)
+{
+	int eq = 0;
+
+	if (a.type == b.type) {
+		switch (a.type) {
+		case AtomType_Nil:
+			eq = 1;
+			break;
+		case AtomType_Pair:
+		case AtomType_Closure:
+		case AtomType_Macro:
+			eq = (a.value.pair == b.value.pair);
+			break;
+		case AtomType_Symbol:
+			eq = (a.value.symbol == b.value.symbol);
+			break;
+		case AtomType_Integer:
+		case AtomType_Values:
+			eq = (a.value.integer == b.value.integer);
+			break;
+		case AtomType_Real:
+			eq = (a.value.real == b.value.real);
+			break;
+		case AtomType_Builtin:
+			eq = (a.value.builtin == b.value.builtin);
+			break;
+		case AtomType_Memo:
+		case AtomType_Map:
+		case AtomType_Vector:
+		case AtomType_Iterator:
+		case AtomType_Omap:
+		case AtomType_Bitvec:
+		case AtomType_Pq:
+		case AtomType_String:
+		case AtomType_Port:
+		case AtomType_Library:
+		case AtomType_Foreign:
+		case AtomType_Kv:
+		case AtomType_Cell:
+		case AtomType_Promise:
+		case AtomType_Record:
+		case AtomType_WeakTable:
+			eq = (a.value.object == b.value.object);
+			break;
+		default:
+			/* impossible */
+			break;
+		}
+	}
+
+	return eq;
+}
+
+int equalp(Atom a, Atom b)
+{
+	while (a.type == AtomType_Pair && b.type == AtomType_Pair) {
+		if (!equalp(car(a), car(b)))
+			return 0;
+		a = cdr(a);
+		b = cdr(b);
+	}
+	if (a.type == AtomType_Vector && b.type == AtomType_Vector) {
+		struct Vector *va = (struct Vector *)a.value.object;
+		struct Vector *vb = (struct Vector *)b.value.object;
+		long i;
+
+		if (va->length != vb->length)
+			return 0;
+		for (i = 0; i < va->length; i++)
+			if (!equalp(vector_get(va, i), vector_get(vb, i)))
+				return 0;
+		return 1;
+	}
+	if (a.type == AtomType_String && b.type == AtomType_String) {
+		struct String *sa = (struct String *)a.value.object;
+		struct String *sb = (struct String *)b.value.object;
+
+		return sa->length == sb->length
+			&& memcmp(sa->chars, sb->chars, sa->length) == 0;
+	}
+	if (a.type == AtomType_Record && b.type == AtomType_Record) {
+		struct Record *ra = (struct Record *)a.value.object;
+		struct Record *rb = (struct Record *)b.value.object;
+		long i;
+
+		if (ra->length != rb->length || !equalp(ra->tag, rb->tag))
+			return 0;
+		for (i = 0; i < ra->length; i++)
+			if (!equalp(ra->slots[i], rb->slots[i]))
+				return 0;
+		return 1;
+	}
+	if (a.type == AtomType_Bitvec && b.type == AtomType_Bitvec)
+		return bitvec_equalp((struct Bitvec *)a.value.object,
+			(struct Bitvec *)b.value.object);
+	return eqp(a, b);
+}
+
+Error builtin_eq(Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	*result = eqp(car(args), car(cdr(args))) ? sym_t : nil;
+	return Error_OK;
+}
+
+Error builtin_equal(Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	*result = equalp(car(args), car(cdr(args))) ? sym_t : nil;
+	return Error_OK;
+}
+
+Error builtin_pairp(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = (car(args).type == AtomType_Pair) ? sym_t : nil;
+	return Error_OK;
+}
+
+/* Partial evaluation.  (specialize f a...) binds the first parameters of
+ * the closure f to the constants a... and returns a closure over the
+ * remaining parameters whose body has been simplified: parameters and
+ * variables of enclosing local environments become constants, ifs with a
+ * constant test are decided, pure builtins applied to constants are folded,
+ * macros are expanded, and lambda applications and calls of closures with
+ * a constant argument are unfolded.  Global functions are taken as they
+ * are currently defined.
+ *
+ * A recursive call is only unfolded again if one of its constant arguments
+ * is a proper tail, or an integer of smaller magnitude, than in the
+ * enclosing unfolding of the same closure, so unfolding always stops. */
+#define SPECIALIZE_MAX_UNFOLDS 1024
+
+struct Specializer {
+	Atom genv;
+	Atom bound;     /* names bound where the residual code runs */
+	Atom unfolding; /* (closure . args) of the calls being unfolded */
+	int unfolds;    /* remaining unfold budget */
+	int holes;      /* placeholders handed out */
+	int failed;     /* the expression could not be specialized */
+};
+
+int spec_constp(Atom x)
+{
+	if (x.type == AtomType_Symbol)
+		return 0;
+	if (x.type != AtomType_Pair)
+		return 1;
+	return car(x).type == AtomType_Symbol
+		&& car(x).value.symbol == sym_quote.value.symbol
+		&& cdr(x).type == AtomType_Pair && nilp(cdr(cdr(x)));
+}
+
+Atom spec_value(Atom x)
+{
+	return x.type == AtomType_Pair ? car(cdr(x)) : x;
+}
+
+Atom spec_const(Atom value)
+{
+	if (nilp(value) || value.type == AtomType_Integer)
+		return value;
+	return cons(sym_quote, cons(value, nil));
+}
+
+int spec_lookup(Atom vars, Atom sym, Atom *result)
+{
+	for (; !nilp(vars); vars = cdr(vars)) {
+		if (car(car(vars)).value.symbol == sym.value.symbol) {
+			*result = cdr(car(vars));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Value of sym if it is bound in a local frame of env */
+int spec_local(Atom env, Atom sym, Atom *result)
+{
+	for (; !nilp(car(env)); env = car(env))
+		if (spec_lookup(cdr(env), sym, result))
+			return 1;
+	return 0;
+}
+
+Builtin spec_pure(Atom fn)
+{
+	if (fn.type != AtomType_Builtin)
+		return NULL;
+
+	if (fn.value.builtin == builtin_car
+		|| fn.value.builtin == builtin_cdr
+		|| fn.value.builtin == builtin_add
+		|| fn.value.builtin == builtin_subtract
+		|| fn.value.builtin == builtin_multiply
+		|| fn.value.builtin == builtin_numeq
+		|| fn.value.builtin == builtin_less
+		|| fn.value.builtin == builtin_eq
+		|| fn.value.builtin == builtin_pairp)
+		return fn.value.builtin;
+	return NULL;
+}
+
+/* Residual expression made of variables, constants and pure builtins */
+int spec_pure_expr(struct Specializer *s, Atom expr)
+{
+	Atom fn;
+
+	if (expr.type != AtomType_Pair || spec_constp(expr))
+		return 1;
+	if (car(expr).type != AtomType_Symbol || memq(car(expr), s->bound)
+		|| env_get(s->genv, car(expr), &fn) || !spec_pure(fn))
+		return 0;
+	for (expr = cdr(expr); !nilp(expr); expr = cdr(expr))
+		if (!spec_pure_expr(s, car(expr)))
+			return 0;
+	return 1;
+}
+
+/* Number of times sym is evaluated by expr; 2 if it might be more than
+ * once or not at all */
+int spec_uses(Atom expr, Atom sym)
+{
+	Atom op;
+	int n = 0;
+
+	if (expr.type == AtomType_Symbol)
+		return expr.value.symbol == sym.value.symbol;
+	if (expr.type != AtomType_Pair || spec_constp(expr))
+		return 0;
+
+	op = car(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_lambda.value.symbol)
+			return inline_count_refs(cdr(cdr(expr)), sym) ? 2 : 0;
+		if (op.value.symbol == sym_if.value.symbol) {
+			n = spec_uses(car(cdr(expr)), sym);
+			if (inline_count_refs(cdr(cdr(expr)), sym))
+				n = 2;
+			return n;
+		}
+	}
+
+	for (; !nilp(expr); expr = cdr(expr))
+		n += spec_uses(car(expr), sym);
+	return n > 2 ? 2 : n;
+}
+
+/* Uninterned symbol standing for a residual argument while the body it is
+ * passed to is specialized; never left in residual code */
+Atom spec_hole(struct Specializer *s)
+{
+	static Atom *names = NULL;
+	static int count = 0;
+
+	if (s->holes == count) {
+		names = (Atom *)realloc(names, (count + 1) * sizeof(Atom));
+		names[count++] = make_uninterned_sym("#arg");
+	}
+
+	return names[s->holes++];
+}
+
+/* May fn be unfolded again with constant arguments args? */
+int spec_descends(struct Specializer *s, Atom fn, Atom args)
+{
+	Atom p, q, old, new_;
+
+	for (p = s->unfolding; !nilp(p); p = cdr(p))
+		if (car(car(p)).value.pair == fn.value.pair)
+			break;
+	if (nilp(p))
+		return 1;
+
+	for (p = cdr(car(p)), q = args; !nilp(p) && !nilp(q); p = cdr(p), q = cdr(q)) {
+		if (!spec_constp(car(p)) || !spec_constp(car(q)))
+			continue;
+		old = spec_value(car(p));
+		new_ = spec_value(car(q));
+		if (old.type == AtomType_Integer && new_.type == AtomType_Integer
+			&& labs(new_.value.integer) < labs(old.value.integer))
+			return 1;
+		if (old.type == AtomType_Pair
+			&& (nilp(new_) || new_.type == AtomType_Pair)) {
+			for (old = cdr(old); old.type == AtomType_Pair; old = cdr(old))
+				if (old.value.pair == new_.value.pair)
+					return 1;
+			if (nilp(new_))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+Atom spec_expr(struct Specializer *s, Atom expr, Atom env, Atom vars);
+
+Atom spec_list(struct Specializer *s, Atom list, Atom env, Atom vars)
+{
+	Atom head = nil, tail = nil;
+
+	for (; !nilp(list); list = cdr(list)) {
+		Atom x = spec_expr(s, car(list), env, vars);
+		if (nilp(head))
+			head = tail = cons(x, nil);
+		else {
+			cdr(tail) = cons(x, nil);
+			tail = cdr(tail);
+		}
+	}
+	return head;
+}
+
+/* Specialize body with params bound to the residual arguments args.
+ * fn is the closure being unfolded, or nil for a lambda application whose
+ * body shares the scope env and the variables vars of the call. */
+int spec_apply(struct Specializer *s, Atom fn, Atom params, Atom body,
+	Atom args, Atom env, Atom vars, Atom *result)
+{
+	Atom holes = nil, values = nil, p, q, x;
+	int consts = 0, failed, ok;
+
+	if (s->unfolds <= 0 || nilp(body) || !nilp(cdr(body)))
+		return 0;
+
+	for (p = params, q = args; p.type == AtomType_Pair; p = cdr(p), q = cdr(q)) {
+		if (nilp(q))
+			return 0;
+		x = car(q);
+		if (spec_constp(x)) {
+			consts++;
+		}
+		else if (x.type != AtomType_Symbol) {
+			/* Substituted afterwards if evaluated exactly once */
+			values = cons(x, values);
+			x = spec_hole(s);
+			holes = cons(x, holes);
+		}
+		vars = cons(cons(car(p), x), vars);
+	}
+	if (p.type == AtomType_Symbol) {
+		Atom rest = nil, tail = nil;
+
+		for (; !nilp(q); q = cdr(q)) {
+			if (!spec_constp(car(q)))
+				return 0;
+			x = cons(spec_value(car(q)), nil);
+			if (nilp(rest))
+				rest = tail = x;
+			else {
+				cdr(tail) = x;
+				tail = x;
+			}
+		}
+		vars = cons(cons(p, spec_const(rest)), vars);
+		consts++;
+	}
+	else if (!nilp(q)) {
+		return 0;
+	}
+
+	if (!nilp(fn) && (consts == 0 || !spec_descends(s, fn, args)))
+		return 0;
+
+	s->unfolds--;
+	if (!nilp(fn))
+		s->unfolding = cons(cons(fn, args), s->unfolding);
+	failed = s->failed;
+	s->failed = 0;
+
+	x = spec_expr(s, car(body), env, vars);
+	ok = !s->failed;
+	for (p = holes, q = values; ok && !nilp(p); p = cdr(p), q = cdr(q)) {
+		int n = spec_uses(x, car(p));
+		if (n > 1 || (n == 0 && !spec_pure_expr(s, car(q))))
+			ok = 0;
+	}
+	if (ok)
+		*result = nilp(holes) ? x : inline_subst(x, holes, values);
+
+	s->failed = failed;
+	if (!nilp(fn))
+		s->unfolding = cdr(s->unfolding);
+
+	return ok;
+}
+
+Atom spec_call(struct Specializer *s, Atom expr, Atom env, Atom vars)
+{
+	Atom op, fn, p, values = nil, tail = nil, result;
+	int known = 0, consts = 1;
+
+	/* ((lambda params body) args...) */
+	op = car(expr);
+	if (op.type == AtomType_Pair && car(op).type == AtomType_Symbol
+		&& car(op).value.symbol == sym_lambda.value.symbol
+		&& cdr(op).type == AtomType_Pair) {
+		Atom args = spec_list(s, cdr(expr), env, vars);
+
+		if (spec_apply(s, nil, car(cdr(op)), cdr(cdr(op)), args, env, vars,
+			&result))
+			return result;
+		return cons(spec_expr(s, op, env, vars), args);
+	}
+
+	expr = spec_list(s, expr, env, vars);
+
+	if (spec_constp(car(expr))) {
+		fn = spec_value(car(expr));
+		known = 1;
+	}
+	else if (car(expr).type == AtomType_Symbol && !memq(car(expr), s->bound)) {
+		known = !env_get(s->genv, car(expr), &fn);
+	}
+	if (!known)
+		return expr;
+
+	for (p = cdr(expr); !nilp(p); p = cdr(p))
+		consts = consts && spec_constp(car(p));
+
+	if (consts && spec_pure(fn)) {
+		for (p = cdr(expr); !nilp(p); p = cdr(p)) {
+			Atom x = cons(spec_value(car(p)), nil);
+			if (nilp(values))
+				values = tail = x;
+			else {
+				cdr(tail) = x;
+				tail = x;
+			}
+		}
+		/* Errors are left for run time */
+		if (!(*fn.value.builtin)(values, &result))
+			return spec_const(result);
+	}
+	else if (fn.type == AtomType_Closure
+		&& spec_apply(s, fn, car(cdr(fn)), cdr(cdr(fn)), cdr(expr), car(car(fn)),
+		nil, &result)) {
+		return result;
+	}
+
+	return expr;
+}
+
+Atom spec_expr(struct Specializer *s, Atom expr, Atom env, Atom vars)
+{
+	Atom op, args, value, p, q;
+
+	if (expr.type == AtomType_Symbol) {
+		if (spec_lookup(vars, expr, &value))
+			return value;
+		if (spec_local(env, expr, &value))
+			return spec_const(value);
+		/* A global that the residual code would see shadowed */
+		if (memq(expr, s->bound))
+			s->failed = 1;
+		return expr;
+	}
+	if (expr.type != AtomType_Pair)
+		return expr;
+	if (!listp(expr)) {
+		s->failed = 1;
+		return expr;
+	}
+
+	op = car(expr);
+	args = cdr(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_quote.value.symbol)
+			return expr;
+		if (op.value.symbol == sym_define.value.symbol
+			|| op.value.symbol == sym_defmacro.value.symbol) {
+			s->failed = 1;
+			return expr;
+		}
+		if (op.value.symbol == sym_if.value.symbol) {
+			Atom test;
+
+			if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+				|| !nilp(cdr(cdr(cdr(args))))) {
+				s->failed = 1;
+				return expr;
+			}
+			test = spec_expr(s, car(args), env, vars);
+			if (spec_constp(test))
+				return spec_expr(s, nilp(spec_value(test))
+					? car(cdr(cdr(args))) : car(cdr(args)), env, vars);
+			return cons(op, cons(test, spec_list(s, cdr(args), env, vars)));
+		}
+		if (op.value.symbol == sym_lambda.value.symbol) {
+			Atom bound = s->bound, body;
+
+			if (nilp(args)) {
+				s->failed = 1;
+				return expr;
+			}
+			for (p = car(args); !nilp(p); p = cdr(p)) {
+				Atom param = p.type == AtomType_Pair ? car(p) : p;
+
+				/* Would capture a variable substituted from a caller */
+				for (q = vars; !nilp(q); q = cdr(q))
+					if (eqp(cdr(car(q)), param) && !eqp(car(car(q)), param))
+						s->failed = 1;
+				vars = cons(cons(param, param), vars);
+				s->bound = cons(param, s->bound);
+				if (p.type != AtomType_Pair)
+					break;
+			}
+			body = spec_list(s, cdr(args), env, vars);
+			s->bound = bound;
+			return cons(op, cons(car(args), body));
+		}
+		if (op.value.symbol != sym_apply.value.symbol
+			&& !spec_lookup(vars, op, &value)
+			&& !env_get(env, op, &value) && value.type == AtomType_Macro) {
+			value.type = AtomType_Closure;
+			if (apply(value, args, &expr)) {
+				s->failed = 1;
+				return expr;
+			}
+			return spec_expr(s, expr, env, vars);
+		}
+	}
+
+	return spec_call(s, expr, env, vars);
+}
+
+Error builtin_specialize(Atom args, Atom *result)
+{
+	struct Specializer s;
+	Atom fn, params, env, body, vars = nil, rest, p, q;
+
+	if (nilp(args))
+		return Error_Args;
+
+	fn = car(args);
+	if (fn.type != AtomType_Closure)
+		return Error_Type;
+
+	s.genv = global_env_of(car(car(fn)));
+	s.bound = nil;
+	s.unfolding = nil;
+	s.unfolds = SPECIALIZE_MAX_UNFOLDS;
+	s.holes = 0;
+	s.failed = 0;
+
+	/* Bind the known arguments; params is left at the residual ones, and
+	 * rest at the known arguments that go into a rest parameter */
+	params = car(cdr(fn));
+	for (q = cdr(args); !nilp(q); q = cdr(q)) {
+		if (params.type == AtomType_Symbol)
+			break;
+		if (params.type != AtomType_Pair)
+			return Error_Args;
+		vars = cons(cons(car(params), spec_const(car(q))), vars);
+		params = cdr(params);
+	}
+	rest = q;
+	for (p = params; p.type == AtomType_Pair; p = cdr(p))
+		vars = cons(cons(car(p), car(p)), vars);
+	if (p.type == AtomType_Symbol)
+		vars = cons(cons(p, p), vars);
+
+	for (p = vars; !nilp(p); p = cdr(p))
+		s.bound = cons(car(car(p)), s.bound);
+	for (env = car(car(fn)); !nilp(car(env)); env = car(env))
+		for (p = cdr(env); !nilp(p); p = cdr(p))
+			s.bound = cons(car(car(p)), s.bound);
+
+	/* Macro expanders may run the evaluator */
+	gc_inhibit++;
+	body = spec_list(&s, cdr(cdr(fn)), car(car(fn)), vars);
+	gc_inhibit--;
+
+	env = car(car(fn));
+	if (s.failed) {
+		/* Keep the original body, with the known arguments bound */
+		env = env_create(env);
+		for (p = car(cdr(fn)), q = cdr(args); p.type == AtomType_Pair && !nilp(q);
+			p = cdr(p), q = cdr(q))
+			env_set(env, car(p), car(q));
+		body = cdr(cdr(fn));
+	}
+
+	if (!nilp(rest)) {
+		/* The rest parameter starts with the known arguments:
+		 * (lambda xs ((lambda (xs) body...) (cons 'a (cons 'b xs)))) */
+		Atom known = nil, list = params;
+
+		for (q = rest; !nilp(q); q = cdr(q))
+			known = cons(car(q), known);
+		for (q = known; !nilp(q); q = cdr(q))
+			list = cons(make_builtin(builtin_cons),
+				cons(spec_const(car(q)), cons(list, nil)));
+		body = cons(cons(cons(sym_lambda, cons(cons(params, nil), body)),
+			cons(list, nil)), nil);
+	}
+
+	return make_closure(env, params, body, result);
+}
+
+/* Memoization.  (memoize f [size [test]]) returns a function caching the
+ * results of f in a hash table keyed on the argument list.  test is
+ * 'equal? (the default: arguments are hashed structurally) or 'eq?.  With
+ * a size, the least recently used entry is dropped when it is exceeded. */
+#define MEMO_MIN_BUCKETS 16
+
+unsigned long hash_atom(Atom a, int eq)
+{
+	unsigned long h;
+
+	switch (a.type) {
+	case AtomType_Nil:
+		return 0;
+	case AtomType_Integer:
+	case AtomType_Values:
+		return (unsigned long)a.value.integer;
+	case AtomType_Real: {
+		unsigned long long bits;
+		double x = a.value.real == 0 ? 0 : a.value.real;  /* -0.0 == 0.0 */
+		memcpy(&bits, &x, sizeof(bits));
+		return (unsigned long)(bits ^ (bits >> 32));
+	}
+	case AtomType_Symbol:
+		return (unsigned long)(size_t)a.value.symbol;
+	case AtomType_Builtin:
+		return (unsigned long)(size_t)a.value.builtin;
+	case AtomType_Memo:
+	case AtomType_Map:
+	case AtomType_Iterator:
+	case AtomType_Omap:
+	case AtomType_Pq:
+	case AtomType_Port:
+	case AtomType_Library:
+	case AtomType_Foreign:
+	case AtomType_Kv:
+	case AtomType_Cell:
+	case AtomType_Promise:
+	case AtomType_WeakTable:
+		return (unsigned long)(size_t)a.value.object;
+	case AtomType_String:
+		if (!eq) {
+			struct String *s = (struct String *)a.value.object;
+			long i;
+			h = 5381;
+			for (i = 0; i < s->length; i++)
+				h = h * 33 + (unsigned char)s->chars[i];
+			return h;
+		}
+		return (unsigned long)(size_t)a.value.object;
+	case AtomType_Pair:
+		if (!eq) {
+			h = 1;
+			for (; a.type == AtomType_Pair; a = cdr(a))
+				h = h * 31 + hash_atom(car(a), 0);
+			return h * 31 + hash_atom(a, 0);
+		}
+		return (unsigned long)(size_t)a.value.pair;
+	case AtomType_Vector:
+		if (!eq) {
+			struct Vector *v = (struct Vector *)a.value.object;
+			long i;
+			h = 2;
+			for (i = 0; i < v->length; i++)
+				h = h * 31 + hash_atom(vector_get(v, i), 0);
+			return h;
+		}
+		return (unsigned long)(size_t)a.value.object;
+	case AtomType_Record:
+		if (!eq) {
+			struct Record *r = (struct Record *)a.value.object;
+			long i;
+			h = hash_atom(r->tag, 0);
+			for (i = 0; i < r->length; i++)
+				h = h * 31 + hash_atom(r->slots[i], 0);
+			return h;
+		}
+		return (unsigned long)(size_t)a.value.object;
+	case AtomType_Bitvec:
+		if (!eq)
+			return bitvec_hash((struct Bitvec *)a.value.object);
+		return (unsigned long)(size_t)a.value.object;
+	default:
+		return (unsigned long)(size_t)a.value.pair;
+	}
+}
+
+unsigned long memo_hash(struct Memo *m, Atom args)
+{
+	unsigned long h = 0;
+
+	for (; !nilp(args); args = cdr(args))
+		h = h * 31 + hash_atom(car(args), m->eq);
+	return h * 2654435761UL;
+}
+
+int memo_same(struct Memo *m, Atom a, Atom b)
+{
+	while (!nilp(a) && !nilp(b)) {
+		if (m->eq ? !eqp(car(a), car(b)) : !equalp(car(a), car(b)))
+			return 0;
+		a = cdr(a);
+		b = cdr(b);
+	}
+	return nilp(a) && nilp(b);
+}
+
+struct MemoEntry *memo_find(struct Memo *m, Atom args, unsigned long hash)
+{
+	struct MemoEntry *e;
+
+	for (e = m->buckets[hash & (m->nbuckets - 1)]; e != NULL; e = e->chain)
+		if (e->hash == hash && memo_same(m, e->key, args))
+			return e;
+	return NULL;
+}
+
+void memo_unlink(struct Memo *m, struct MemoEntry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		m->first = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		m->last = e->prev;
+}
+
+void memo_push(struct Memo *m, struct MemoEntry *e)
+{
+	e->prev = NULL;
+	e->next = m->first;
+	if (m->first)
+		m->first->prev = e;
+	else
+		m->last = e;
+	m->first = e;
+}
+
+int memo_lookup(struct Memo *m, Atom args, Atom *result)
+{
+	struct MemoEntry *e = memo_find(m, args, memo_hash(m, args));
+
+	if (e == NULL)
+		return 0;
+
+	if (e != m->first) {
+		memo_unlink(m, e);
+		memo_push(m, e);
+	}
+	*result = e->value;
+	return 1;
+}
+
+void memo_evict(struct Memo *m, struct MemoEntry *e)
+{
+	struct MemoEntry **pe = &m->buckets[e->hash & (m->nbuckets - 1)];
+
+	while (*pe != e)
+		pe = &(*pe)->chain;
+	*pe = e->chain;
+	memo_unlink(m, e);
+	free(e);
+	m->count--;
+}
+
+void memo_grow(struct Memo *m)
+{
+	unsigned long n = m->nbuckets * 2;
+	struct MemoEntry **buckets, *e;
+
+	buckets = (struct MemoEntry **)calloc(n, sizeof(struct MemoEntry *));
+	if (!buckets)
+		return;
+
+	for (e = m->first; e != NULL; e = e->next) {
+		e->chain = buckets[e->hash & (n - 1)];
+		buckets[e->hash & (n - 1)] = e;
+	}
+	free(m->buckets);
+	m->buckets = buckets;
+	m->nbuckets = n;
+}
+
+/* Cache value for the argument list key, which the table keeps */
+void memo_store(struct Memo *m, Atom key, Atom value)
+{
+	unsigned long hash = memo_hash(m, key);
+	struct MemoEntry *e = memo_find(m, key, hash);
+
+	if (e != NULL) {
+		e->value = value;
+		return;
+	}
+
+	e = (struct MemoEntry *)malloc(sizeof(struct MemoEntry));
+	e->key = key;
+	e->value = value;
+	e->hash = hash;
+	e->chain = m->buckets[hash & (m->nbuckets - 1)];
+	m->buckets[hash & (m->nbuckets - 1)] = e;
+	memo_push(m, e);
+	m->count++;
+
+	if (m->size > 0 && m->count > m->size)
+		memo_evict(m, m->last);
+	if ((unsigned long)m->count > m->nbuckets)
+		memo_grow(m);
+}
+
+void memo_mark(struct Memo *m)
+{
+	struct MemoEntry *e;
+
+	gc_mark(m->fn);
+	for (e = m->first; e != NULL; e = e->next) {
+		gc_mark(e->key);
+		gc_mark(e->value);
+	}
+}
+
+void memo_free(struct Memo *m)
+{
+	while (m->first != NULL) {
+		struct MemoEntry *e = m->first;
+		m->first = e->next;
+		free(e);
+	}
+	free(m->buckets);
+	free(m);
+}
+
+Atom make_memo(Atom fn, int eq, long size)
+{
+	struct Memo *m = (struct Memo *)malloc(sizeof(struct Memo));
+
+	m->fn = fn;
+	m->eq = eq;
+	m->size = size;
+	m->count = 0;
+	m->nbuckets = MEMO_MIN_BUCKETS;
+	m->buckets = (struct MemoEntry **)calloc(m->nbuckets, sizeof(struct MemoEntry *));
+	m->first = m->last = NULL;
+	return make_object(&m->object, AtomType_Memo);
+}
+
+Error builtin_memoize(Atom args, Atom *result)
+{
+	Atom fn, size = nil, test = nil;
+
+	if (nilp(args))
+		return Error_Args;
+
+	fn = car(args);
+	args = cdr(args);
+	if (!nilp(args)) {
+		size = car(args);
+		args = cdr(args);
+	}
+	if (!nilp(args)) {
+		test = car(args);
+		args = cdr(args);
+	}
+	if (!nilp(args))
+		return Error_Args;
+
+	if (fn.type != AtomType_Builtin && fn.type != AtomType_Closure)
+		return Error_Type;
+	if (!nilp(size) && (size.type != AtomType_Integer || size.value.integer < 0))
+		return Error_Type;
+	if (!nilp(test) && (test.type != AtomType_Symbol
+		|| (strcmp(test.value.symbol, "eq?") != 0
+		&& strcmp(test.value.symbol, "equal?") != 0)))
+		return Error_Type;
+
+	*result = make_memo(fn, !nilp(test) && strcmp(test.value.symbol, "eq?") == 0,
+		nilp(size) ? 0 : size.value.integer);
+	return Error_OK;
+}
+
+/* Persistent maps: hash array mapped tries.  Each node holds up to 32
+ * slots, selected by 5 bits of the key's hash and packed by a bitmap; a
+ * slot is an entry or a child node.  Updates copy the path from the root
+ * and share everything else, so old versions stay valid.  Keys that still
+ * collide when the hash is used up share a collision node.  nil is the
+ * empty map. */
+#define MAP_BITS 5
+#define MAP_HASH_BITS ((int)sizeof(unsigned long) * 8)
+
+struct MapSlot {
+	struct MapNode *child; /* or NULL for an entry */
+	unsigned long hash;
+	Atom key, value;
+};
+
+struct MapNode {
+	struct Object object;
+	unsigned int bitmap;   /* 0 in collision nodes */
+	long count;            /* entries in this subtree */
+	int n;
+	struct MapSlot slot[1];
+};
+
+int bit_count(unsigned int x)
+{
+#if defined(__GNUC__)
+	return __builtin_popcount(x);
+#else
+	x = x - ((x >> 1) & 0x55555555);
+	x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+	x = (x + (x >> 4)) & 0x0F0F0F0F;
+	return (int)((x * 0x01010101) >> 24);
+#endif
+}
+
+unsigned long map_hash(Atom key)
+{
+	unsigned long h = hash_atom(key, 0);
+
+	/* Spread every input bit over the bits the trie uses */
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	h *= 0x45d9f3bUL;
+	h ^= h >> 16;
+	return h;
+}
+
+struct MapNode *map_node(int n)
+{
+	struct MapNode *node;
+
+	node = (struct MapNode *)malloc(offsetof(struct MapNode, slot)
+		+ (n > 0 ? n : 1) * sizeof(struct MapSlot));
+	(void)make_object(&node->object, AtomType_Map);
+	node->bitmap = 0;
+	node->count = 0;
+	node->n = n;
+	return node;
+}
+
+struct MapNode *map_copy(struct MapNode *node)
+{
+	struct MapNode *copy = map_node(node->n);
+
+	copy->bitmap = node->bitmap;
+	copy->count = node->count;
+	memcpy(copy->slot, node->slot, node->n * sizeof(struct MapSlot));
+	return copy;
+}
+
+/* Copy of node with a slot inserted at index i (or removed, if remove) */
+struct MapNode *map_splice(struct MapNode *node, int i, int remove)
+{
+	struct MapNode *copy = map_node(node->n + (remove ? -1 : 1));
+
+	copy->bitmap = node->bitmap;
+	copy->count = node->count;
+	memcpy(copy->slot, node->slot, i * sizeof(struct MapSlot));
+	if (remove)
+		memcpy(copy->slot + i, node->slot + i + 1,
+			(node->n - i - 1) * sizeof(struct MapSlot));
+	else
+		memcpy(copy->slot + i + 1, node->slot + i,
+			(node->n - i) * sizeof(struct MapSlot));
+	return copy;
+}
+
+int map_index(unsigned long hash, int shift)
+{
+	return (int)((hash >> shift) & ((1 << MAP_BITS) - 1));
+}
+
+/* Node holding two entries whose hashes agree below shift */
+struct MapNode *map_pair(int shift, struct MapSlot *a, struct MapSlot *b)
+{
+	struct MapNode *node;
+	int i, j;
+
+	if (shift >= MAP_HASH_BITS) {
+		node = map_node(2);
+		node->slot[0] = *a;
+		node->slot[1] = *b;
+		node->count = 2;
+		return node;
+	}
+
+	i = map_index(a->hash, shift);
+	j = map_index(b->hash, shift);
+	if (i == j) {
+		node = map_node(1);
+		node->slot[0].child = map_pair(shift + MAP_BITS, a, b);
+		node->bitmap = 1u << i;
+	}
+	else {
+		node = map_node(2);
+		node->slot[i < j ? 0 : 1] = *a;
+		node->slot[i < j ? 1 : 0] = *b;
+		node->bitmap = (1u << i) | (1u << j);
+	}
+	node->count = 2;
+	return node;
+}
+
+struct MapNode *map_assoc(struct MapNode *node, int shift, struct MapSlot *e)
+{
+	struct MapNode *copy;
+	unsigned int bit;
+	int i;
+
+	if (shift >= MAP_HASH_BITS) {
+		/* Collision node */
+		for (i = 0; i < node->n; i++) {
+			if (equalp(node->slot[i].key, e->key)) {
+				copy = map_copy(node);
+				copy->slot[i].value = e->value;
+				return copy;
+			}
+		}
+		copy = map_splice(node, node->n, 0);
+		copy->slot[node->n] = *e;
+		copy->count++;
+		return copy;
+	}
+
+	bit = 1u << map_index(e->hash, shift);
+	i = bit_count(node->bitmap & (bit - 1));
+
+	if (!(node->bitmap & bit)) {
+		copy = map_splice(node, i, 0);
+		copy->slot[i] = *e;
+		copy->bitmap |= bit;
+		copy->count++;
+		return copy;
+	}
+
+	copy = map_copy(node);
+	if (node->slot[i].child) {
+		copy->slot[i].child = map_assoc(node->slot[i].child, shift + MAP_BITS, e);
+		copy->count += copy->slot[i].child->count - node->slot[i].child->count;
+	}
+	else if (node->slot[i].hash == e->hash && equalp(node->slot[i].key, e->key)) {
+		copy->slot[i].value = e->value;
+	}
+	else {
+		copy->slot[i].child = map_pair(shift + MAP_BITS, &node->slot[i], e);
+		copy->count++;
+	}
+	return copy;
+}
+
+/* node without key, or node itself if it has no such key */
+struct MapNode *map_dissoc(struct MapNode *node, int shift,
+	unsigned long hash, Atom key)
+{
+	struct MapNode *copy, *child;
+	unsigned int bit;
+	int i;
+
+	if (shift >= MAP_HASH_BITS) {
+		for (i = 0; i < node->n; i++) {
+			if (equalp(node->slot[i].key, key)) {
+				copy = map_splice(node, i, 1);
+				copy->count--;
+				return copy;
+			}
+		}
+		return node;
+	}
+
+	bit = 1u << map_index(hash, shift);
+	if (!(node->bitmap & bit))
+		return node;
+	i = bit_count(node->bitmap & (bit - 1));
+
+	if (!node->slot[i].child) {
+		if (node->slot[i].hash != hash || !equalp(node->slot[i].key, key))
+			return node;
+		copy = map_splice(node, i, 1);
+		copy->bitmap &= ~bit;
+		copy->count--;
+		return copy;
+	}
+
+	child = map_dissoc(node->slot[i].child, shift + MAP_BITS, hash, key);
+	if (child == node->slot[i].child)
+		return node;
+
+	copy = map_copy(node);
+	copy->count--;
+	if (child->n == 1 && !child->slot[0].child)
+		copy->slot[i] = child->slot[0]; /* pull a lone entry up */
+	else
+		copy->slot[i].child = child;
+	return copy;
+}
+
+struct MapSlot *map_find(struct MapNode *node, unsigned long hash, Atom key)
+{
+	int shift, i;
+
+	for (shift = 0; shift < MAP_HASH_BITS; shift += MAP_BITS) {
+		unsigned int bit = 1u << map_index(hash, shift);
+
+		if (!(node->bitmap & bit))
+			return NULL;
+		i = bit_count(node->bitmap & (bit - 1));
+		if (!node->slot[i].child) {
+			if (node->slot[i].hash == hash && equalp(node->slot[i].key, key))
+				return &node->slot[i];
+			return NULL;
+		}
+		node = node->slot[i].child;
+	}
+
+	for (i = 0; i < node->n; i++)
+		if (equalp(node->slot[i].key, key))
+			return &node->slot[i];
+	return NULL;
+}
+
+void map_mark(struct MapNode *node)
+{
+	int i;
+
+	for (i = 0; i < node->n; i++) {
+		if (node->slot[i].child) {
+			object_mark(&node->slot[i].child->object);
+		}
+		else {
+			gc_mark(node->slot[i].key);
+			gc_mark(node->slot[i].value);
+		}
+	}
+}
+
+Atom map_atom(struct MapNode *node)
+{
+	Atom a;
+
+	if (node->count == 0)
+		return nil;
+	a.type = AtomType_Map;
+	a.value.object = &node->object;
+	return a;
+}
+
+Error builtin_map_assoc(Atom args, Atom *result)
+{
+	struct MapNode *root;
+	struct MapSlot e;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+
+	if (nilp(car(args)))
+		root = map_node(0);
+	else if (car(args).type == AtomType_Map)
+		root = (struct MapNode *)car(args).value.object;
+	else
+		return Error_Type;
+
+	e.child = NULL;
+	e.key = car(cdr(args));
+	e.value = car(cdr(cdr(args)));
+	e.hash = map_hash(e.key);
+	*result = map_atom(map_assoc(root, 0, &e));
+	return Error_OK;
+}
+
+Error builtin_map_dissoc(Atom args, Atom *result)
+{
+	struct MapNode *root;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+
+	if (nilp(car(args))) {
+		*result = nil;
+		return Error_OK;
+	}
+	if (car(args).type != AtomType_Map)
+		return Error_Type;
+
+	root = (struct MapNode *)car(args).value.object;
+	*result = map_atom(map_dissoc(root, 0, map_hash(car(cdr(args))), car(cdr(args))));
+	return Error_OK;
+}
+
+/* (map-get map key [default]) */
+Error builtin_map_get(Atom args, Atom *result)
+{
+	struct MapSlot *e;
+	Atom fallback = nil;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	if (!nilp(cdr(cdr(args)))) {
+		if (!nilp(cdr(cdr(cdr(args)))))
+			return Error_Args;
+		fallback = car(cdr(cdr(args)));
+	}
+
+	if (nilp(car(args))) {
+		*result = fallback;
+		return Error_OK;
+	}
+	if (car(args).type != AtomType_Map)
+		return Error_Type;
+
+	e = map_find((struct MapNode *)car(args).value.object,
+		map_hash(car(cdr(args))), car(cdr(args)));
+	*result = e ? e->value : fallback;
+	return Error_OK;
+}
+
+Error builtin_map_count(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (nilp(car(args)))
+		*result = make_int(0);
+	else if (car(args).type != AtomType_Map)
+		return Error_Type;
+	else
+		*result = make_int(((struct MapNode *)car(args).value.object)->count);
+	return Error_OK;
+}
+
+Atom make_vector(long n, Atom fill)
+{
+	struct Vector *v = (struct Vector *)malloc(sizeof(struct Vector));
+	long i;
+
+	v->kind = VectorKind_Atoms;
+	v->length = n;
+	v->items = (Atom *)malloc(sizeof(Atom) * (n > 0 ? n : 1));
+	v->ints = NULL;
+	v->reals = NULL;
+	for (i = 0; i < n; i++)
+		v->items[i] = fill;
+	return make_object(&v->object, AtomType_Vector);
+}
+
+/* A vector of n zeros of the given kind */
+Atom make_typed_vector(enum VectorKind kind, long n)
+{
+	struct Vector *v;
+
+	if (kind == VectorKind_Atoms)
+		return make_vector(n, nil);
+
+	v = (struct Vector *)malloc(sizeof(struct Vector));
+	v->kind = kind;
+	v->length = n;
+	v->items = NULL;
+	v->ints = kind == VectorKind_Ints ? (long *)calloc(n > 0 ? n : 1, sizeof(long)) : NULL;
+	v->reals = kind == VectorKind_Reals ? (double *)calloc(n > 0 ? n : 1, sizeof(double)) : NULL;
+	return make_object(&v->object, AtomType_Vector);
+}
+
+struct Vector *vector_of(Atom a)
+{
+	return (struct Vector *)a.value.object;
+}
+
+Atom vector_get(struct Vector *v, long i)
+{
+	switch (v->kind) {
+	case VectorKind_Ints:
+		return make_int(v->ints[i]);
+	case VectorKind_Reals:
+		return make_real(v->reals[i]);
+	default:
+		return v->items[i];
+	}
+}
+
+/* Store x at i; zero if a typed vector cannot hold it */
+int vector_put(struct Vector *v, long i, Atom x)
+{
+	switch (v->kind) {
+	case VectorKind_Ints:
+		if (x.type != AtomType_Integer)
+			return 0;
+		v->ints[i] = x.value.integer;
+		return 1;
+	case VectorKind_Reals:
+		if (x.type == AtomType_Integer)
+			v->reals[i] = (double)x.value.integer;
+		else if (x.type == AtomType_Real)
+			v->reals[i] = x.value.real;
+		else
+			return 0;
+		return 1;
+	default:
+		v->items[i] = x;
+		return 1;
+	}
+}
+
+void vector_mark(struct Vector *v)
+{
+	long i;
+
+	if (v->kind == VectorKind_Atoms)
+		for (i = 0; i < v->length; i++)
+			gc_mark(v->items[i]);
+}
+
+void vector_free(struct Vector *v)
+{
+	free(v->items);
+	free(v->ints);
+	free(v->reals);
+	free(v);
+}
+
+/* Check (vector index ...) arguments and return the index */
+Error vector_index(Atom args, long *index)
+{
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Vector
+		|| car(cdr(args)).type != AtomType_Integer)
+		return Error_Type;
+
+	*index = car(cdr(args)).value.integer;
+	if (*index < 0 || *index >= vector_of(car(args))->length)
+		return Error_Args;
+	return Error_OK;
+}
+
+Error builtin_vector(Atom args, Atom *result)
+{
+	struct Vector *v;
+	long n = 0;
+	Atom p;
+
+	if (!listp(args))
+		return Error_Args;
+
+	for (p = args; !nilp(p); p = cdr(p))
+		n++;
+	*result = make_vector(n, nil);
+	v = vector_of(*result);
+	for (n = 0; !nilp(args); args = cdr(args))
+		v->items[n++] = car(args);
+	return Error_OK;
+}
+
+/* (make-vector n [fill]) */
+Error builtin_make_vector(Atom args, Atom *result)
+{
+	Atom fill = nil;
+
+	if (nilp(args))
+		return Error_Args;
+	if (!nilp(cdr(args))) {
+		if (!nilp(cdr(cdr(args))))
+			return Error_Args;
+		fill = car(cdr(args));
+	}
+	if (car(args).type != AtomType_Integer)
+		return Error_Type;
+	if (car(args).value.integer < 0)
+		return Error_Args;
+
+	*result = make_vector(car(args).value.integer, fill);
+	return Error_OK;
+}
+
+Error builtin_vector_ref(Atom args, Atom *result)
+{
+	long i;
+	Error err;
+
+	if (!nilp(args) && !nilp(cdr(args)) && !nilp(cdr(cdr(args))))
+		return Error_Args;
+	err = vector_index(args, &i);
+	if (err)
+		return err;
+
+	*result = vector_get(vector_of(car(args)), i);
+	return Error_OK;
+}
+
+Error builtin_vector_set(Atom args, Atom *result)
+{
+	long i;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+	err = vector_index(args, &i);
+	if (err)
+		return err;
+
+	if (!vector_put(vector_of(car(args)), i, car(cdr(cdr(args)))))
+		return Error_Type;
+	*result = car(cdr(cdr(args)));
+	return Error_OK;
+}
+
+Error builtin_vector_length(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Vector)
+		return Error_Type;
+
+	*result = make_int(vector_of(car(args))->length);
+	return Error_OK;
+}
+
+Error builtin_vector_to_list(Atom args, Atom *result)
+{
+	struct Vector *v;
+	long i;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Vector)
+		return Error_Type;
+
+	v = vector_of(car(args));
+	*result = nil;
+	for (i = v->length - 1; i >= 0; i--)
+		*result = cons(vector_get(v, i), *result);
+	return Error_OK;
+}
+
+Error builtin_list_to_vector(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (!listp(car(args)))
+		return Error_Type;
+
+	return builtin_vector(car(args), result);
+}
+
+/* Sorting.  (sort seq less? [threads]) sorts a list or a vector in place
+ * with a stable merge sort and returns it; lists are sorted by relinking
+ * their cells, so the result must be used instead of the old head.  When
+ * less? is the builtin < and every key is an integer, keys are compared
+ * directly, and with threads > 1 a large sequence is split into runs
+ * sorted concurrently.  Other comparators are called through apply(),
+ * which may evaluate and collect garbage, so the work arrays are held in
+ * rooted vectors and the sequence is only changed once sorting is done. */
+#define SORT_RUN 16
+#define SORT_PARALLEL_MIN 8192
+#define SORT_MAX_THREADS 64
+
+struct Sorter {
+	Atom less;
+	Atom args;  /* reused argument list for builtin comparators */
+	int fast;   /* integer keys compared with < */
+	int cars;   /* the items are list cells keyed by their cars */
+	Error err;
+};
+
+int sort_less(struct Sorter *s, Atom a, Atom b)
+{
+	Atom r;
+
+	if (s->cars) {
+		a = car(a);
+		b = car(b);
+	}
+	if (s->fast)
+		return a.value.integer < b.value.integer;
+	if (s->err)
+		return 0;
+
+	if (s->less.type == AtomType_Builtin) {
+		/* Builtins never keep their argument cells */
+		car(s->args) = a;
+		car(cdr(s->args)) = b;
+		s->err = apply(s->less, s->args, &r);
+	}
+	else {
+		s->err = apply(s->less, cons(a, cons(b, nil)), &r);
+	}
+	return !s->err && !nilp(r);
+}
+
+/* Merge the sorted runs src[lo..mid) and src[mid..hi) into dst, taking
+ * from the left run on ties */
+void sort_merge(struct Sorter *s, const Atom *src, Atom *dst, long lo, long mid, long hi)
+{
+	long i = lo, j = mid, k;
+
+	for (k = lo; k < hi; k++) {
+		if (j < hi && (i >= mid || sort_less(s, src[j], src[i])))
+			dst[k] = src[j++];
+		else
+			dst[k] = src[i++];
+	}
+}
+
+/* Bottom-up merge sort of items[0..n), using tmp as scratch */
+void sort_items(struct Sorter *s, Atom *items, Atom *tmp, long n)
+{
+	Atom *src = items, *dst = tmp, *t;
+	long lo, i, j, width;
+
+	/* Insertion sort short runs first */
+	for (lo = 0; lo < n; lo += SORT_RUN) {
+		long hi = lo + SORT_RUN < n ? lo + SORT_RUN : n;
+		for (i = lo + 1; i < hi; i++) {
+			Atom x = items[i];
+			for (j = i; j > lo && sort_less(s, x, items[j - 1]); j--)
+				items[j] = items[j - 1];
+			items[j] = x;
+		}
+	}
+
+	for (width = SORT_RUN; width < n; width *= 2) {
+		for (lo = 0; lo < n; lo += 2 * width) {
+			long mid = lo + width < n ? lo + width : n;
+			long hi = lo + 2 * width < n ? lo + 2 * width : n;
+			sort_merge(s, src, dst, lo, mid, hi);
+		}
+		t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != items)
+		memcpy(items, src, sizeof(Atom) * n);
+}
+
+#ifdef SORT_THREADS
+struct SortTask {
+	struct Sorter *sorter;
+	Atom *items, *tmp;
+	long n;
+};
+
+void *sort_task(void *arg)
+{
+	struct SortTask *t = (struct SortTask *)arg;
+
+	sort_items(t->sorter, t->items, t->tmp, t->n);
+	return NULL;
+}
+
+/* Sort nthreads runs concurrently, then merge them pairwise.  Only used
+ * on the fast path, which never touches the heap. */
+void sort_parallel(struct Sorter *s, Atom *items, Atom *tmp, long n, int nthreads)
+{
+	pthread_t threads[SORT_MAX_THREADS];
+	struct SortTask tasks[SORT_MAX_THREADS];
+	long bounds[SORT_MAX_THREADS + 1];
+	Atom *src = items, *dst = tmp, *t;
+	int i, started, runs;
+
+	for (i = 0; i <= nthreads; i++)
+		bounds[i] = n * i / nthreads;
+
+	for (started = 0; started < nthreads; started++) {
+		tasks[started].sorter = s;
+		tasks[started].items = items + bounds[started];
+		tasks[started].tmp = tmp + bounds[started];
+		tasks[started].n = bounds[started + 1] - bounds[started];
+		if (pthread_create(&threads[started], NULL, sort_task, &tasks[started]) != 0)
+			break;
+	}
+	/* Sort whatever could not be given to a thread here */
+	for (i = started; i < nthreads; i++)
+		sort_task(&tasks[i]);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	for (runs = nthreads; runs > 1; runs = (runs + 1) / 2) {
+		for (i = 0; i + 1 < runs; i += 2)
+			sort_merge(s, src, dst, bounds[i], bounds[i + 1], bounds[i + 2]);
+		if (runs % 2)
+			memcpy(dst + bounds[runs - 1], src + bounds[runs - 1],
+				sizeof(Atom) * (bounds[runs] - bounds[runs - 1]));
+		for (i = 0; i < runs; i += 2)
+			bounds[i / 2] = bounds[i];
+		bounds[(runs + 1) / 2] = n;
+		t = src;
+		src = dst;
+		dst = t;
+	}
+
+	if (src != items)
+		memcpy(items, src, sizeof(Atom) * n);
+}
+#endif
+
+Error builtin_sort(Atom args, Atom *result)
+{
+	struct Root *roots = gc_roots, r[4];
+	struct Sorter s;
+	Atom seq, work, scratch, p;
+	Atom *items;
+	long n, i;
+#ifdef SORT_THREADS
+	int nthreads = 1;
+#endif
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	if (!nilp(cdr(cdr(args)))) {
+		if (!nilp(cdr(cdr(cdr(args)))))
+			return Error_Args;
+		if (car(cdr(cdr(args))).type != AtomType_Integer)
+			return Error_Type;
+#ifdef SORT_THREADS
+		i = car(cdr(cdr(args))).value.integer;
+		nthreads = i < 1 ? 1 : i > SORT_MAX_THREADS ? SORT_MAX_THREADS : (int)i;
+#endif
+	}
+
+	seq = car(args);
+	s.less = car(cdr(args));
+	s.args = nil;
+	s.cars = (seq.type != AtomType_Vector);
+	s.err = Error_OK;
+
+	/* Copy the items (list cells, or vector elements) to a work vector */
+	if (s.cars) {
+		if (!listp(seq))
+			return Error_Type;
+		n = 0;
+		for (p = seq; !nilp(p); p = cdr(p))
+			n++;
+		work = make_vector(n, nil);
+		items = vector_of(work)->items;
+		for (i = 0, p = seq; !nilp(p); p = cdr(p))
+			items[i++] = p;
+	}
+	else {
+		n = vector_of(seq)->length;
+		work = make_vector(n, nil);
+		items = vector_of(work)->items;
+		for (i = 0; i < n; i++)
+			items[i] = vector_get(vector_of(seq), i);
+	}
+
+	s.fast = (s.less.type == AtomType_Builtin && s.less.value.builtin == builtin_less);
+	for (i = 0; i < n && s.fast; i++)
+		s.fast = ((s.cars ? car(items[i]) : items[i]).type == AtomType_Integer);
+	if (!s.fast && s.less.type == AtomType_Builtin)
+		s.args = cons(nil, cons(nil, nil));
+
+	gc_protect(&r[0], &args);
+	gc_protect(&r[1], &work);
+	gc_protect(&r[2], &s.args);
+	scratch = make_vector(n, nil);
+	gc_protect(&r[3], &scratch);
+#ifdef SORT_THREADS
+	if (s.fast && nthreads > 1 && n >= SORT_PARALLEL_MIN)
+		sort_parallel(&s, items, vector_of(scratch)->items, n, nthreads);
+	else
+#endif
+		sort_items(&s, items, vector_of(scratch)->items, n);
+	gc_roots = roots;
+
+	if (s.err)
+		return s.err;
+
+	if (s.cars) {
+		*result = nil;
+		for (i = n - 1; i >= 0; i--) {
+			cdr(items[i]) = *result;
+			*result = items[i];
+		}
+	}
+	else {
+		for (i = 0; i < n; i++)
+			vector_put(vector_of(seq), i, items[i]);
+		*result = seq;
+	}
+	return Error_OK;
+}
+
+/* Iterators: lazy sequences stepped with (iter-next it), which returns the
+ * next item or nil when there are no more.  Each kind embeds struct
+ * Iterator and supplies functions to step and to mark what it refers to. */
+struct Iterator {
+	struct Object object;
+	Error (*next)(struct Iterator *it, Atom *result);
+	void (*mark)(struct Iterator *it);
+	int done;
+};
+
+Atom make_iterator(struct Iterator *it)
+{
+	it->done = 0;
+	return make_object(&it->object, AtomType_Iterator);
+}
+
+void iterator_mark(struct Iterator *it)
+{
+	it->mark(it);
+}
+
+Error builtin_iter_next(Atom args, Atom *result)
+{
+	struct Iterator *it;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Iterator)
+		return Error_Type;
+
+	it = (struct Iterator *)car(args).value.object;
+	*result = nil;
+	if (it->done)
+		return Error_OK;
+	err = it->next(it, result);
+	if (!err && nilp(*result))
+		it->done = 1;
+	return err;
+}
+
+/* Ordered maps: B-trees keyed on integers and symbols, which sort after
+ * all integers and among themselves by name.  Nodes hold up to
+ * 2 * OMAP_DEGREE - 1 keys in one array, searched with binary search,
+ * so a lookup touches a few wide nodes.  (make-omap) creates an empty map,
+ * which omap-put updates in place. */
+#define OMAP_DEGREE 16
+#define OMAP_MAX (2 * OMAP_DEGREE - 1)
+#define OMAP_MAX_DEPTH 32
+
+struct OmapNode {
+	int n;
+	int leaf;
+	Atom key[OMAP_MAX];
+	Atom value[OMAP_MAX];
+	struct OmapNode *child[OMAP_MAX + 1];
+};
+
+struct Omap {
+	struct Object object;
+	struct OmapNode *root;
+	long count;
+	long version;  /* changed by every omap-put, checked by iterators */
+};
+
+struct OmapNode *omap_node(int leaf)
+{
+	struct OmapNode *node = (struct OmapNode *)malloc(sizeof(struct OmapNode));
+
+	node->n = 0;
+	node->leaf = leaf;
+	return node;
+}
+
+void omap_node_mark(struct OmapNode *node)
+{
+	int i;
+
+	for (i = 0; i < node->n; i++) {
+		gc_mark(node->key[i]);
+		gc_mark(node->value[i]);
+	}
+	if (!node->leaf)
+		for (i = 0; i <= node->n; i++)
+			omap_node_mark(node->child[i]);
+}
+
+void omap_node_free(struct OmapNode *node)
+{
+	int i;
+
+	if (!node->leaf)
+		for (i = 0; i <= node->n; i++)
+			omap_node_free(node->child[i]);
+	free(node);
+}
+
+void omap_mark(struct Omap *m)
+{
+	omap_node_mark(m->root);
+}
+
+void omap_free(struct Omap *m)
+{
+	omap_node_free(m->root);
+	free(m);
+}
+
+int omap_keyp(Atom key)
+{
+	return key.type == AtomType_Integer || key.type == AtomType_Symbol;
+}
+
+int omap_compare(Atom a, Atom b)
+{
+	if (a.type != b.type)
+		return a.type == AtomType_Integer ? -1 : 1;
+	if (a.type == AtomType_Integer)
+		return a.value.integer < b.value.integer ? -1
+			: a.value.integer > b.value.integer;
+	if (a.value.symbol == b.value.symbol)
+		return 0;
+	return strcmp(a.value.symbol, b.value.symbol);
+}
+
+/* Index of the first key in node not less than key, or greater than key
+ * if strict */
+int omap_search(struct OmapNode *node, Atom key, int strict)
+{
+	int lo = 0, hi = node->n;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		int c = omap_compare(node->key[mid], key);
+		if (c < 0 || (strict && c == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Split the full child i of node, moving its middle key up */
+void omap_split(struct OmapNode *node, int i)
+{
+	struct OmapNode *left = node->child[i];
+	struct OmapNode *right = omap_node(left->leaf);
+	int j;
+
+	right->n = OMAP_DEGREE - 1;
+	for (j = 0; j < OMAP_DEGREE - 1; j++) {
+		right->key[j] = left->key[j + OMAP_DEGREE];
+		right->value[j] = left->value[j + OMAP_DEGREE];
+	}
+	if (!left->leaf)
+		for (j = 0; j < OMAP_DEGREE; j++)
+			right->child[j] = left->child[j + OMAP_DEGREE];
+	left->n = OMAP_DEGREE - 1;
+
+	for (j = node->n; j > i; j--) {
+		node->key[j] = node->key[j - 1];
+		node->value[j] = node->value[j - 1];
+		node->child[j + 1] = node->child[j];
+	}
+	node->key[i] = left->key[OMAP_DEGREE - 1];
+	node->value[i] = left->value[OMAP_DEGREE - 1];
+	node->child[i + 1] = right;
+	node->n++;
+}
+
+void omap_put(struct Omap *m, Atom key, Atom value)
+{
+	struct OmapNode *node;
+	int i, j;
+
+	m->version++;
+
+	/* Splitting full nodes on the way down leaves room to insert */
+	if (m->root->n == OMAP_MAX) {
+		node = omap_node(0);
+		node->child[0] = m->root;
+		m->root = node;
+		omap_split(node, 0);
+	}
+
+	node = m->root;
+	for (;;) {
+		i = omap_search(node, key, 0);
+		if (i < node->n && omap_compare(node->key[i], key) == 0) {
+			node->value[i] = value;
+			return;
+		}
+		if (node->leaf)
+			break;
+		if (node->child[i]->n == OMAP_MAX) {
+			omap_split(node, i);
+			continue;
+		}
+		node = node->child[i];
+	}
+
+	for (j = node->n; j > i; j--) {
+		node->key[j] = node->key[j - 1];
+		node->value[j] = node->value[j - 1];
+	}
+	node->key[i] = key;
+	node->value[i] = value;
+	node->n++;
+	m->count++;
+}
+
+Atom *omap_find(struct Omap *m, Atom key)
+{
+	struct OmapNode *node = m->root;
+
+	for (;;) {
+		int i = omap_search(node, key, 0);
+		if (i < node->n && omap_compare(node->key[i], key) == 0)
+			return &node->value[i];
+		if (node->leaf)
+			return NULL;
+		node = node->child[i];
+	}
+}
+
+struct OmapIterator {
+	struct Iterator iterator;
+	Atom map, hi, last;
+	int started;     /* last holds the last key returned */
+	long version;
+	int depth;
+	/* Each level resumes at key index[k] of node[k] once the subtrees
+	 * below it are done */
+	struct OmapNode *node[OMAP_MAX_DEPTH];
+	int index[OMAP_MAX_DEPTH];
+};
+
+/* Position the iterator at the first key not less than key, or greater
+ * than key if strict */
+void omap_seek(struct OmapIterator *it, Atom key, int strict)
+{
+	struct Omap *m = (struct Omap *)it->map.value.object;
+	struct OmapNode *node = m->root;
+
+	it->depth = 0;
+	it->version = m->version;
+	for (;;) {
+		int i = omap_search(node, key, strict);
+		it->node[it->depth] = node;
+		it->index[it->depth] = i;
+		it->depth++;
+		if (node->leaf || (i < node->n && omap_compare(node->key[i], key) == 0))
+			return;
+		node = node->child[i];
+	}
+}
+
+Error omap_iterator_next(struct Iterator *iterator, Atom *result)
+{
+	struct OmapIterator *it = (struct OmapIterator *)iterator;
+	struct Omap *m = (struct Omap *)it->map.value.object;
+	struct OmapNode *node;
+	int i;
+
+	/* Insertions may have moved keys between nodes */
+	if (it->version != m->version)
+		omap_seek(it, it->last, it->started);
+
+	while (it->depth > 0) {
+		node = it->node[it->depth - 1];
+		i = it->index[it->depth - 1];
+		if (i >= node->n) {
+			it->depth--;
+			continue;
+		}
+
+		if (omap_compare(node->key[i], it->hi) > 0)
+			break;
+		it->last = node->key[i];
+		it->started = 1;
+		*result = cons(node->key[i], node->value[i]);
+
+		it->index[it->depth - 1] = i + 1;
+		if (!node->leaf) {
+			node = node->child[i + 1];
+			for (;;) {
+				it->node[it->depth] = node;
+				it->index[it->depth] = 0;
+				it->depth++;
+				if (node->leaf)
+					break;
+				node = node->child[0];
+			}
+		}
+		return Error_OK;
+	}
+
+	it->depth = 0;
+	*result = nil;
+	return Error_OK;
+}
+
+void omap_iterator_mark(struct Iterator *iterator)
+{
+	struct OmapIterator *it = (struct OmapIterator *)iterator;
+
+	gc_mark(it->map);
+	gc_mark(it->hi);
+	gc_mark(it->last);
+}
+
+Error builtin_make_omap(Atom args, Atom *result)
+{
+	struct Omap *m;
+
+	if (!nilp(args))
+		return Error_Args;
+
+	m = (struct Omap *)malloc(sizeof(struct Omap));
+	m->root = omap_node(1);
+	m->count = 0;
+	m->version = 0;
+	*result = make_object(&m->object, AtomType_Omap);
+	return Error_OK;
+}
+
+/* (omap-put omap key value) returns omap */
+Error builtin_omap_put(Atom args, Atom *result)
+{
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+	if (car(args).type != AtomType_Omap || !omap_keyp(car(cdr(args))))
+		return Error_Type;
+
+	omap_put((struct Omap *)car(args).value.object,
+		car(cdr(args)), car(cdr(cdr(args))));
+	*result = car(args);
+	return Error_OK;
+}
+
+/* (omap-get omap key [default]) */
+Error builtin_omap_get(Atom args, Atom *result)
+{
+	Atom *value, fallback = nil;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	if (!nilp(cdr(cdr(args)))) {
+		if (!nilp(cdr(cdr(cdr(args)))))
+			return Error_Args;
+		fallback = car(cdr(cdr(args)));
+	}
+	if (car(args).type != AtomType_Omap || !omap_keyp(car(cdr(args))))
+		return Error_Type;
+
+	value = omap_find((struct Omap *)car(args).value.object, car(cdr(args)));
+	*result = value ? *value : fallback;
+	return Error_OK;
+}
+
+/* (omap-range omap lo hi) iterates over the entries with lo <= key <= hi
+ * in order, as (key . value) pairs */
+Error builtin_omap_range(Atom args, Atom *result)
+{
+	struct OmapIterator *it;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+	if (car(args).type != AtomType_Omap || !omap_keyp(car(cdr(args)))
+		|| !omap_keyp(car(cdr(cdr(args)))))
+		return Error_Type;
+
+	it = (struct OmapIterator *)malloc(sizeof(struct OmapIterator));
+	it->iterator.next = omap_iterator_next;
+	it->iterator.mark = omap_iterator_mark;
+	it->map = car(args);
+	it->hi = car(cdr(cdr(args)));
+	it->last = car(cdr(args));
+	it->started = 0;
+	omap_seek(it, it->last, 0);
+	*result = make_iterator(&it->iterator);
+	return Error_OK;
+}
+
+/* Leftmost or rightmost entry as (key . value), or nil */
+Error omap_end(Atom args, Atom *result, int right)
+{
+	struct OmapNode *node;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Omap)
+		return Error_Type;
+
+	node = ((struct Omap *)car(args).value.object)->root;
+	if (node->n == 0) {
+		*result = nil;
+		return Error_OK;
+	}
+	while (!node->leaf)
+		node = node->child[right ? node->n : 0];
+	*result = right ? cons(node->key[node->n - 1], node->value[node->n - 1])
+		: cons(node->key[0], node->value[0]);
+	return Error_OK;
+}
+
+Error builtin_omap_min(Atom args, Atom *result)
+{
+	return omap_end(args, result, 0);
+}
+
+Error builtin_omap_max(Atom args, Atom *result)
+{
+	return omap_end(args, result, 1);
+}
+
+/* Bit vectors: sets of small non-negative integers, stored as 64-bit
+ * words.  (make-bitvec [n]) creates an empty set with room for n bits; it
+ * grows when a larger bit is set.  The set operations return new bit
+ * vectors and work a word at a time. */
+typedef unsigned long long BitWord;
+#define BITWORD_BITS 64
+
+struct Bitvec {
+	struct Object object;
+	long nwords;
+	BitWord *words;
+};
+
+/* Index of the lowest set bit of a nonzero word */
+int word_lowest(BitWord x)
+{
+#if defined(__GNUC__)
+	return __builtin_ctzll(x);
+#else
+	int i = 0;
+	while (!(x & 1)) {
+		x >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+struct Bitvec *bitvec_of(Atom a)
+{
+	return (struct Bitvec *)a.value.object;
+}
+
+Atom make_bitvec(long nwords)
+{
+	struct Bitvec *bv = (struct Bitvec *)malloc(sizeof(struct Bitvec));
+
+	bv->nwords = nwords;
+	bv->words = (BitWord *)calloc(nwords > 0 ? nwords : 1, sizeof(BitWord));
+	return make_object(&bv->object, AtomType_Bitvec);
+}
+
+void bitvec_free(struct Bitvec *bv)
+{
+	free(bv->words);
+	free(bv);
+}
+
+void bitvec_grow(struct Bitvec *bv, long nwords)
+{
+	long n = bv->nwords > 0 ? bv->nwords : 1;
+
+	while (n < nwords)
+		n *= 2;
+	bv->words = (BitWord *)realloc(bv->words, sizeof(BitWord) * n);
+	memset(bv->words + bv->nwords, 0, sizeof(BitWord) * (n - bv->nwords));
+	bv->nwords = n;
+}
+
+int bitvec_equalp(struct Bitvec *a, struct Bitvec *b)
+{
+	long i, n = a->nwords > b->nwords ? a->nwords : b->nwords;
+
+	for (i = 0; i < n; i++) {
+		BitWord x = i < a->nwords ? a->words[i] : 0;
+		BitWord y = i < b->nwords ? b->words[i] : 0;
+		if (x != y)
+			return 0;
+	}
+	return 1;
+}
+
+unsigned long bitvec_hash(struct Bitvec *bv)
+{
+	unsigned long h = 3;
+	long n = bv->nwords;
+
+	/* Trailing zero words do not change the set */
+	while (n > 0 && bv->words[n - 1] == 0)
+		n--;
+	while (n-- > 0)
+		h = h * 31 + (unsigned long)(bv->words[n] ^ (bv->words[n] >> 32));
+	return h;
+}
+
+/* (make-bitvec [n]) */
+Error builtin_make_bitvec(Atom args, Atom *result)
+{
+	long n = 0;
+
+	if (!nilp(args)) {
+		if (!nilp(cdr(args)))
+			return Error_Args;
+		if (car(args).type != AtomType_Integer)
+			return Error_Type;
+		n = car(args).value.integer;
+		if (n < 0)
+			return Error_Args;
+	}
+
+	*result = make_bitvec((n + BITWORD_BITS - 1) / BITWORD_BITS);
+	return Error_OK;
+}
+
+/* (bitvec-set! bv i [value]) sets bit i, or clears it if value is nil */
+Error builtin_bitvec_set(Atom args, Atom *result)
+{
+	struct Bitvec *bv;
+	BitWord bit;
+	long i, w;
+	int value = 1;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	if (!nilp(cdr(cdr(args)))) {
+		if (!nilp(cdr(cdr(cdr(args)))))
+			return Error_Args;
+		value = !nilp(car(cdr(cdr(args))));
+	}
+	if (car(args).type != AtomType_Bitvec
+		|| car(cdr(args)).type != AtomType_Integer)
+		return Error_Type;
+	i = car(cdr(args)).value.integer;
+	if (i < 0)
+		return Error_Args;
+
+	bv = bitvec_of(car(args));
+	w = i / BITWORD_BITS;
+	bit = (BitWord)1 << (i % BITWORD_BITS);
+	if (value) {
+		if (w >= bv->nwords)
+			bitvec_grow(bv, w + 1);
+		bv->words[w] |= bit;
+	}
+	else if (w < bv->nwords) {
+		bv->words[w] &= ~bit;
+	}
+
+	*result = value ? sym_t : nil;
+	return Error_OK;
+}
+
+Error builtin_bitvec_ref(Atom args, Atom *result)
+{
+	struct Bitvec *bv;
+	long i;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+	if (car(args).type != AtomType_Bitvec
+		|| car(cdr(args)).type != AtomType_Integer)
+		return Error_Type;
+	i = car(cdr(args)).value.integer;
+	if (i < 0)
+		return Error_Args;
+
+	bv = bitvec_of(car(args));
+	*result = (i / BITWORD_BITS < bv->nwords
+		&& (bv->words[i / BITWORD_BITS] >> (i % BITWORD_BITS)) & 1) ? sym_t : nil;
+	return Error_OK;
+}
+
+Error builtin_bitvec_count(Atom args, Atom *result)
+{
+	struct Bitvec *bv;
+	long i, n = 0;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Bitvec)
+		return Error_Type;
+
+	bv = bitvec_of(car(args));
+	for (i = 0; i < bv->nwords; i++)
+		n += bit_count((unsigned int)bv->words[i])
+			+ bit_count((unsigned int)(bv->words[i] >> 32));
+	*result = make_int(n);
+	return Error_OK;
+}
+
+enum BitvecOp { BitvecOp_And, BitvecOp_Or, BitvecOp_Xor, BitvecOp_Andnot };
+
+Error bitvec_combine(Atom args, Atom *result, enum BitvecOp op)
+{
+	struct Bitvec *a, *b, *r;
+	long i, n;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+	if (car(args).type != AtomType_Bitvec
+		|| car(cdr(args)).type != AtomType_Bitvec)
+		return Error_Type;
+
+	a = bitvec_of(car(args));
+	b = bitvec_of(car(cdr(args)));
+	switch (op) {
+	case BitvecOp_And:
+		n = a->nwords < b->nwords ? a->nwords : b->nwords;
+		break;
+	case BitvecOp_Andnot:
+		n = a->nwords;
+		break;
+	default:
+		n = a->nwords > b->nwords ? a->nwords : b->nwords;
+		break;
+	}
+
+	*result = make_bitvec(n);
+	r = bitvec_of(*result);
+	for (i = 0; i < n; i++) {
+		BitWord x = i < a->nwords ? a->words[i] : 0;
+		BitWord y = i < b->nwords ? b->words[i] : 0;
+		switch (op) {
+		case BitvecOp_And:
+			r->words[i] = x & y;
+			break;
+		case BitvecOp_Or:
+			r->words[i] = x | y;
+			break;
+		case BitvecOp_Xor:
+			r->words[i] = x ^ y;
+			break;
+		case BitvecOp_Andnot:
+			r->words[i] = x & ~y;
+			break;
+		}
+	}
+	return Error_OK;
+}
+
+Error builtin_bitvec_and(Atom args, Atom *result)
+{
+	return bitvec_combine(args, result, BitvecOp_And);
+}
+
+Error builtin_bitvec_or(Atom args, Atom *result)
+{
+	return bitvec_combine(args, result, BitvecOp_Or);
+}
+
+Error builtin_bitvec_xor(Atom args, Atom *result)
+{
+	return bitvec_combine(args, result, BitvecOp_Xor);
+}
+
+Error builtin_bitvec_andnot(Atom args, Atom *result)
+{
+	return bitvec_combine(args, result, BitvecOp_Andnot);
+}
+
+struct BitvecIterator {
+	struct Iterator iterator;
+	Atom bitvec;
+	long next;  /* first bit not yet looked at */
+};
+
+Error bitvec_iterator_next(struct Iterator *iterator, Atom *result)
+{
+	struct BitvecIterator *it = (struct BitvecIterator *)iterator;
+	struct Bitvec *bv = bitvec_of(it->bitvec);
+	long w = it->next / BITWORD_BITS;
+	BitWord x;
+
+	if (w < bv->nwords) {
+		/* Skip the bits already returned from the first word */
+		x = bv->words[w] & (~(BitWord)0 << (it->next % BITWORD_BITS));
+		for (;;) {
+			if (x != 0) {
+				long i = w * BITWORD_BITS + word_lowest(x);
+				it->next = i + 1;
+				*result = make_int(i);
+				return Error_OK;
+			}
+			if (++w >= bv->nwords)
+				break;
+			x = bv->words[w];
+		}
+	}
+
+	*result = nil;
+	return Error_OK;
+}
+
+void bitvec_iterator_mark(struct Iterator *iterator)
+{
+	gc_mark(((struct BitvecIterator *)iterator)->bitvec);
+}
+
+/* (bitvec-iter bv) iterates over the set bits in increasing order */
+Error builtin_bitvec_iter(Atom args, Atom *result)
+{
+	struct BitvecIterator *it;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Bitvec)
+		return Error_Type;
+
+	it = (struct BitvecIterator *)malloc(sizeof(struct BitvecIterator));
+	it->iterator.next = bitvec_iterator_next;
+	it->iterator.mark = bitvec_iterator_mark;
+	it->bitvec = car(args);
+	it->next = 0;
+	*result = make_iterator(&it->iterator);
+	return Error_OK;
+}
+
+/* Priority queues: 4-ary min-heaps in one growable array.  (make-pq
+ * [less?]) orders priorities with less?, by default <.  (pq-push! q
+ * priority [value]) adds value, which defaults to the priority, and
+ * pq-peek and pq-pop! return the value with the least priority.  Integer
+ * priorities under < are compared without calling the function.  Other
+ * comparators may run arbitrary code, so entries are moved by swapping and
+ * positions are checked against the size after every call; an error
+ * leaves the queue in an unspecified order. */
+#define PQ_ARITY 4
+
+struct PqEntry {
+	Atom priority, value;
+};
+
+struct Pq {
+	struct Object object;
+	Atom less;
+	long count, capacity;
+	struct PqEntry *entries;
+};
+
+void pq_mark(struct Pq *q)
+{
+	long i;
+
+	gc_mark(q->less);
+	for (i = 0; i < q->count; i++) {
+		gc_mark(q->entries[i].priority);
+		gc_mark(q->entries[i].value);
+	}
+}
+
+void pq_free(struct Pq *q)
+{
+	free(q->entries);
+	free(q);
+}
+
+/* Whether entry i comes before entry j */
+int pq_less(struct Pq *q, long i, long j, Error *err)
+{
+	Atom a = q->entries[i].priority, b = q->entries[j].priority, args, r;
+
+	if (q->less.type == AtomType_Builtin && q->less.value.builtin == builtin_less
+		&& a.type == AtomType_Integer && b.type == AtomType_Integer)
+		return a.value.integer < b.value.integer;
+
+	args = cons(a, cons(b, nil));
+	*err = apply(q->less, args, &r);
+	if (q->less.type == AtomType_Builtin)
+		release_list(args);
+	return !*err && !nilp(r);
+}
+
+void pq_swap(struct Pq *q, long i, long j)
+{
+	struct PqEntry t = q->entries[i];
+
+	q->entries[i] = q->entries[j];
+	q->entries[j] = t;
+}
+
+Error pq_sift_up(struct Pq *q, long i)
+{
+	Error err = Error_OK;
+
+	while (i > 0 && i < q->count) {
+		long parent = (i - 1) / PQ_ARITY;
+		if (!pq_less(q, i, parent, &err))
+			break;
+		pq_swap(q, i, parent);
+		i = parent;
+	}
+	return err;
+}
+
+Error pq_sift_down(struct Pq *q, long i)
+{
+	Error err = Error_OK;
+
+	for (;;) {
+		long first = i * PQ_ARITY + 1, least = i, c;
+
+		for (c = first; c < first + PQ_ARITY && c < q->count; c++) {
+			if (pq_less(q, c, least, &err))
+				least = c;
+			if (err)
+				return err;
+		}
+		if (least == i || least >= q->count)
+			break;
+		pq_swap(q, i, least);
+		i = least;
+	}
+	return err;
+}
+
+/* (make-pq [less?]) */
+Error builtin_make_pq(Atom args, Atom *result)
+{
+	struct Pq *q;
+
+	if (!nilp(args) && !nilp(cdr(args)))
+		return Error_Args;
+
+	q = (struct Pq *)malloc(sizeof(struct Pq));
+	q->less = nilp(args) ? make_builtin(builtin_less) : car(args);
+	q->count = 0;
+	q->capacity = 16;
+	q->entries = (struct PqEntry *)malloc(sizeof(struct PqEntry) * q->capacity);
+	*result = make_object(&q->object, AtomType_Pq);
+	return Error_OK;
+}
+
+/* (pq-push! q priority [value]) returns q */
+Error builtin_pq_push(Atom args, Atom *result)
+{
+	struct Pq *q;
+	struct PqEntry e;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	e.priority = e.value = car(cdr(args));
+	if (!nilp(cdr(cdr(args)))) {
+		if (!nilp(cdr(cdr(cdr(args)))))
+			return Error_Args;
+		e.value = car(cdr(cdr(args)));
+	}
+	if (car(args).type != AtomType_Pq)
+		return Error_Type;
+
+	q = (struct Pq *)car(args).value.object;
+	if (q->count == q->capacity) {
+		q->capacity *= 2;
+		q->entries = (struct PqEntry *)realloc(q->entries,
+			sizeof(struct PqEntry) * q->capacity);
+	}
+	q->entries[q->count++] = e;
+
+	*result = car(args);
+	return pq_sift_up(q, q->count - 1);
+}
+
+Error builtin_pq_pop(Atom args, Atom *result)
+{
+	struct Root *roots = gc_roots, r;
+	struct Pq *q;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Pq)
+		return Error_Type;
+
+	q = (struct Pq *)car(args).value.object;
+	if (q->count == 0) {
+		*result = nil;
+		return Error_OK;
+	}
+
+	/* The value is no longer in the heap while comparing */
+	*result = q->entries[0].value;
+	gc_protect(&r, result);
+	q->entries[0] = q->entries[--q->count];
+	err = pq_sift_down(q, 0);
+	gc_roots = roots;
+	return err;
+}
+
+Error builtin_pq_peek(Atom args, Atom *result)
+{
+	struct Pq *q;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Pq)
+		return Error_Type;
+
+	q = (struct Pq *)car(args).value.object;
+	*result = q->count > 0 ? q->entries[0].value : nil;
+	return Error_OK;
+}
+
+Error builtin_pq_size(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Pq)
+		return Error_Type;
+
+	*result = make_int(((struct Pq *)car(args).value.object)->count);
+	return Error_OK;
+}
+
+/* Port and string builtins.  Input functions return the eof object at
+ * the end of input; read-char and peek-char return character codes. */
+Error port_arg(Atom a, int output, struct Port **port)
+{
+	if (a.type != AtomType_Port)
+		return Error_Type;
+	*port = port_of(a);
+	if ((*port)->closed || port_outputp(*port) != output)
+		return Error_Type;
+	return Error_OK;
+}
+
+Error string_arg(Atom args, const char **s)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+	*s = string_of(car(args))->chars;
+	return Error_OK;
+}
+
+/* (open-input-file path) returns nil if the file cannot be opened */
+Error builtin_open_input_file(Atom args, Atom *result)
+{
+	const char *path;
+	FILE *file;
+	Error err;
+
+	err = string_arg(args, &path);
+	if (err)
+		return err;
+
+	file = fopen(path, "rb");
+	*result = file ? make_port(PortKind_FileIn, file,
+		(char *)malloc(PORT_BUFFER_SIZE), 0, PORT_BUFFER_SIZE) : nil;
+	return Error_OK;
+}
+
+Error builtin_open_output_file(Atom args, Atom *result)
+{
+	const char *path;
+	FILE *file;
+	Error err;
+
+	err = string_arg(args, &path);
+	if (err)
+		return err;
+
+	file = fopen(path, "wb");
+	*result = file ? make_port(PortKind_FileOut, file,
+		(char *)malloc(PORT_BUFFER_SIZE), 0, PORT_BUFFER_SIZE) : nil;
+	return Error_OK;
+}
+
+Error builtin_open_input_string(Atom args, Atom *result)
+{
+	struct String *s;
+	char *buf;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+
+	s = string_of(car(args));
+	buf = (char *)malloc(s->length + 1);
+	memcpy(buf, s->chars, s->length);
+	*result = make_port(PortKind_StringIn, NULL, buf, s->length, s->length);
+	return Error_OK;
+}
+
+Error builtin_open_output_string(Atom args, Atom *result)
+{
+	if (!nilp(args))
+		return Error_Args;
+
+	*result = make_port(PortKind_StringOut, NULL, (char *)malloc(64), 0, 64);
+	return Error_OK;
+}
+
+Error builtin_get_output_string(Atom args, Atom *result)
+{
+	struct Port *p;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Port
+		|| port_of(car(args))->kind != PortKind_StringOut)
+		return Error_Type;
+
+	p = port_of(car(args));
+	*result = make_string(p->buf, (long)p->len);
+	return Error_OK;
+}
+
+Error char_input(Atom args, Atom *result, int peek)
+{
+	struct Port *p;
+	Error err;
+	int c;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = port_arg(car(args), 0, &p);
+	if (err)
+		return err;
+
+	c = peek ? port_peekc(p) : port_getc(p);
+	*result = c == EOF ? sym_eof : make_int(c);
+	return Error_OK;
+}
+
+Error builtin_read_char(Atom args, Atom *result)
+{
+	return char_input(args, result, 0);
+}
+
+Error builtin_peek_char(Atom args, Atom *result)
+{
+	return char_input(args, result, 1);
+}
+
+/* The line is returned without its line ending */
+Error builtin_read_line(Atom args, Atom *result)
+{
+	struct Port *p;
+	struct Token line;
+	long cap = 128;
+	Error err;
+	int c;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = port_arg(car(args), 0, &p);
+	if (err)
+		return err;
+
+	if (port_peekc(p) == EOF) {
+		*result = sym_eof;
+		return Error_OK;
+	}
+
+	line.text = (char *)malloc(cap);
+	line.len = 0;
+	while ((c = port_getc(p)) != EOF && c != '\n')
+		token_append(&line, &cap, c);
+	if (line.len > 0 && line.text[line.len - 1] == '\r')
+		line.len--;
+	*result = make_string(line.text, line.len);
+	free(line.text);
+	return Error_OK;
+}
+
+Error builtin_read(Atom args, Atom *result)
+{
+	struct Port *p;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = port_arg(car(args), 0, &p);
+	if (err)
+		return err;
+
+	port_skip_space(p);
+	if (port_peekc(p) == EOF) {
+		*result = sym_eof;
+		return Error_OK;
+	}
+	return port_read(p, result);
+}
+
+/* Optional output port argument, standard output by default */
+Error output_port(Atom args, struct Port **port)
+{
+	if (nilp(args)) {
+		*port = port_stdout();
+		return Error_OK;
+	}
+	if (!nilp(cdr(args)))
+		return Error_Args;
+	return port_arg(car(args), 1, port);
+}
+
+Error print_to_port(Atom args, Atom *result, int write)
+{
+	struct Port *p;
+	Error err;
+
+	if (nilp(args))
+		return Error_Args;
+	err = output_port(cdr(args), &p);
+	if (err)
+		return err;
+
+	print_atom(p, car(args), write);
+	*result = nil;
+	return Error_OK;
+}
+
+Error builtin_write(Atom args, Atom *result)
+{
+	return print_to_port(args, result, 1);
+}
+
+Error builtin_display(Atom args, Atom *result)
+{
+	return print_to_port(args, result, 0);
+}
+
+Error builtin_newline(Atom args, Atom *result)
+{
+	struct Port *p;
+	Error err;
+
+	err = output_port(args, &p);
+	if (err)
+		return err;
+
+	port_putc(p, '\n');
+	*result = nil;
+	return Error_OK;
+}
+
+Error builtin_flush_output(Atom args, Atom *result)
+{
+	struct Port *p;
+	Error err;
+
+	err = output_port(args, &p);
+	if (err)
+		return err;
+
+	port_flush(p);
+	*result = nil;
+	return Error_OK;
+}
+
+Error builtin_close_port(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Port)
+		return Error_Type;
+
+	port_close(port_of(car(args)));
+	*result = nil;
+	return Error_OK;
+}
+
+Error builtin_eof_objectp(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	*result = eqp(car(args), sym_eof) ? sym_t : nil;
+	return Error_OK;
+}
+
+Error builtin_string_length(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_String)
+		return Error_Type;
+
+	*result = make_int(string_of(car(args))->length);
+	return Error_OK;
+}
+
+/* (make-string n [code]) makes a string of n bytes, also usable as a
+ * buffer for foreign functions */
+Error builtin_make_string(Atom args, Atom *result)
+{
+	long n, code = 0;
+
+	if (nilp(args) || (!nilp(cdr(args)) && !nilp(cdr(cdr(args)))))
+		return Error_Args;
+	if (car(args).type != AtomType_Integer)
+		return Error_Type;
+	n = car(args).value.integer;
+	if (n < 0)
+		return Error_Args;
+	if (!nilp(cdr(args))) {
+		if (car(cdr(args)).type != AtomType_Integer)
+			return Error_Type;
+		code = car(cdr(args)).value.integer;
+	}
+
+	*result = make_string(NULL, n);
+	memset(string_of(*result)->chars, (int)code, n);
+	return Error_OK;
+}
+
+/* (string-ref s i) returns the code of byte i */
+Error builtin_string_ref(Atom args, Atom *result)
+{
+	struct String *s;
+	long i;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+	if (car(args).type != AtomType_String || car(cdr(args)).type != AtomType_Integer)
+		return Error_Type;
+	s = string_of(car(args));
+	i = car(cdr(args)).value.integer;
+	if (i < 0 || i >= s->length)
+		return Error_Args;
+
+	*result = make_int((unsigned char)s->chars[i]);
+	return Error_OK;
+}
+
+Error builtin_string_append(Atom args, Atom *result)
+{
+	struct Port out;
+	Atom p;
+
+	for (p = args; !nilp(p); p = cdr(p))
+		if (car(p).type != AtomType_String)
+			return Error_Type;
+
+	out.kind = PortKind_StringOut;
+	out.closed = 0;
+	out.buf = (char *)malloc(64);
+	out.len = 0;
+	out.cap = 64;
+	for (p = args; !nilp(p); p = cdr(p))
+		port_write(&out, string_of(car(p))->chars, string_of(car(p))->length);
+	*result = make_string(out.buf, (long)out.len);
+	free(out.buf);
+	return Error_OK;
+}
+
+Error builtin_symbol_to_string(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Symbol)
+		return Error_Type;
+
+	*result = make_string(car(args).value.symbol, (long)strlen(car(args).value.symbol));
+	return Error_OK;
+}
+
+Error builtin_string_to_symbol(Atom args, Atom *result)
+{
+	const char *s;
+	Error err;
+
+	err = string_arg(args, &s);
+	if (err)
+		return err;
+
+	*result = make_sym(s);
+	return Error_OK;
+}
+
+/* JSON.  (json-parse port-or-string) reads one value in a single pass:
+ * objects become alists keyed by symbols, arrays vectors, numbers integers
+ * or reals, true t, false nil and null the symbol null.  (json-write x
+ * [port]) does the reverse; a list whose elements are all pairs keyed by
+ * symbols or strings is written as an object, other lists as arrays.
+ * At the end of input json-parse returns the eof object, so a port can
+ * hold a sequence of values.  String bodies are scanned eight bytes at a time for quotes, backslashes
+ * and control characters, and keys go through a small cache in front of
+ * the symbol table. */
+#define JSON_MAX_DEPTH 512
+
+struct JsonParser {
+	struct Port *port;
+	struct Token text;  /* string being read */
+	long cap;
+	int depth;
+};
+
+/* Nonzero if any byte of w is '"', '\\' or below 0x20 */
+int json_special(BitWord w)
+{
+	const BitWord ones = 0x0101010101010101ULL, highs = 0x8080808080808080ULL;
+	BitWord q = w ^ (ones * '"'), b = w ^ (ones * '\\');
+
+	return ((((q - ones) & ~q) | ((b - ones) & ~b) | ((w - ones * 0x20) & ~w)) & highs) != 0;
+}
+
+void json_append(struct JsonParser *j, const char *s, long n)
+{
+	if (j->text.len + n + 1 > j->cap) {
+		while (j->text.len + n + 1 > j->cap)
+			j->cap *= 2;
+		j->text.text = (char *)realloc(j->text.text, j->cap);
+	}
+	memcpy(j->text.text + j->text.len, s, n);
+	j->text.len += n;
+	j->text.text[j->text.len] = '\0';
+}
+
+void json_append_utf8(struct JsonParser *j, unsigned long c)
+{
+	char buf[4];
+	int n;
+
+	if (c < 0x80) {
+		buf[0] = (char)c;
+		n = 1;
+	}
+	else if (c < 0x800) {
+		buf[0] = (char)(0xC0 | (c >> 6));
+		buf[1] = (char)(0x80 | (c & 0x3F));
+		n = 2;
+	}
+	else if (c < 0x10000) {
+		buf[0] = (char)(0xE0 | (c >> 12));
+		buf[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+		buf[2] = (char)(0x80 | (c & 0x3F));
+		n = 3;
+	}
+	else {
+		buf[0] = (char)(0xF0 | (c >> 18));
+		buf[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+		buf[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+		buf[3] = (char)(0x80 | (c & 0x3F));
+		n = 4;
+	}
+	json_append(j, buf, n);
+}
+
+int json_skip_space(struct Port *p)
+{
+	int c;
+
+	while ((c = port_peekc(p)) == ' ' || c == '\t' || c == '\n' || c == '\r')
+		p->pos++;
+	return c;
+}
+
+int json_hex4(struct Port *p, unsigned long *c)
+{
+	int i, d;
+
+	*c = 0;
+	for (i = 0; i < 4; i++) {
+		d = port_getc(p);
+		if (d >= '0' && d <= '9')
+			d -= '0';
+		else if (d >= 'a' && d <= 'f')
+			d -= 'a' - 10;
+		else if (d >= 'A' && d <= 'F')
+			d -= 'A' - 10;
+		else
+			return 0;
+		*c = *c * 16 + d;
+	}
+	return 1;
+}
+
+/* Read a string body, after the opening quote, into j->text */
+Error json_string(struct JsonParser *j)
+{
+	struct Port *p = j->port;
+	unsigned long c, low;
+
+	j->text.len = 0;
+	j->text.text[0] = '\0';
+	for (;;) {
+		size_t start = p->pos;
+		BitWord w;
+
+		/* Copy runs of plain characters a word at a time */
+		while (p->pos + sizeof(BitWord) <= p->len) {
+			memcpy(&w, p->buf + p->pos, sizeof(BitWord));
+			if (json_special(w))
+				break;
+			p->pos += sizeof(BitWord);
+		}
+		while (p->pos < p->len && p->buf[p->pos] != '"' && p->buf[p->pos] != '\\'
+			&& (unsigned char)p->buf[p->pos] >= 0x20)
+			p->pos++;
+		json_append(j, p->buf + start, (long)(p->pos - start));
+
+		if (p->pos == p->len) {
+			if (!port_fill(p))
+				return Error_Syntax;
+			continue;
+		}
+
+		switch (port_getc(p)) {
+		case '"':
+			return Error_OK;
+		case '\\':
+			switch (port_getc(p)) {
+			case '"': json_append(j, "\"", 1); break;
+			case '\\': json_append(j, "\\", 1); break;
+			case '/': json_append(j, "/", 1); break;
+			case 'b': json_append(j, "\b", 1); break;
+			case 'f': json_append(j, "\f", 1); break;
+			case 'n': json_append(j, "\n", 1); break;
+			case 'r': json_append(j, "\r", 1); break;
+			case 't': json_append(j, "\t", 1); break;
+			case 'u':
+				if (!json_hex4(p, &c))
+					return Error_Syntax;
+				/* Surrogate pair */
+				if (c >= 0xD800 && c < 0xDC00 && port_peekc(p) == '\\') {
+					p->pos++;
+					if (port_getc(p) != 'u' || !json_hex4(p, &low)
+						|| low < 0xDC00 || low >= 0xE000)
+						return Error_Syntax;
+					c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+				}
+				json_append_utf8(j, c);
+				break;
+			default:
+				return Error_Syntax;
+			}
+			break;
+		default:
+			/* Unescaped control character */
+			return Error_Syntax;
+		}
+	}
+}
+
+Error json_number(struct JsonParser *j, Atom *result)
+{
+	struct Port *p = j->port;
+	char buf[64], *end;
+	int n = 0, c, real = 0;
+	long x;
+
+	while ((c = port_peekc(p)) != EOF && (strchr("0123456789+-", c) != NULL
+		|| (c == '.' || c == 'e' || c == 'E'))) {
+		if (c == '.' || c == 'e' || c == 'E')
+			real = 1;
+		if (n == sizeof(buf) - 1)
+			return Error_Syntax;
+		buf[n++] = (char)c;
+		p->pos++;
+	}
+	buf[n] = '\0';
+
+	if (!real) {
+		errno = 0;
+		x = strtol(buf, &end, 10);
+		if (n > 0 && *end == '\0' && errno == 0) {
+			*result = make_int(x);
+			return Error_OK;
+		}
+	}
+	*result = make_real(strtod(buf, &end));
+	return n > 0 && *end == '\0' ? Error_OK : Error_Syntax;
+}
+
+int json_literal(struct Port *p, const char *word)
+{
+	for (; *word; word++)
+		if (port_getc(p) != *word)
+			return 0;
+	return 1;
+}
+
+Error json_value(struct JsonParser *j, Atom *result)
+{
+	struct Port *p = j->port;
+	Atom items = nil, last = nil, key, value;
+	Error err;
+	long n, i;
+	int c;
+
+	if (++j->depth > JSON_MAX_DEPTH)
+		return Error_Syntax;
+
+	c = json_skip_space(p);
+	switch (c) {
+	case '{':
+	case '[':
+		p->pos++;
+		if (json_skip_space(p) == (c == '{' ? '}' : ']')) {
+			p->pos++;
+			*result = c == '{' ? nil : make_vector(0, nil);
+			break;
+		}
+		for (n = 0;; n++) {
+			if (c == '{') {
+				if (json_skip_space(p) != '"')
+					return Error_Syntax;
+				p->pos++;
+				err = json_string(j);
+				if (err)
+					return err;
+				key = make_sym_cached(j->text.text, j->text.len);
+				if (json_skip_space(p) != ':')
+					return Error_Syntax;
+				p->pos++;
+			}
+			err = json_value(j, &value);
+			if (err)
+				return err;
+			value = c == '{' ? cons(key, value) : value;
+			if (nilp(last))
+				items = last = cons(value, nil);
+			else
+				last = cdr(last) = cons(value, nil);
+
+			if (json_skip_space(p) == ',') {
+				p->pos++;
+				continue;
+			}
+			if (port_getc(p) != (c == '{' ? '}' : ']'))
+				return Error_Syntax;
+			break;
+		}
+		if (c == '{') {
+			*result = items;
+			break;
+		}
+		*result = make_vector(n + 1, nil);
+		for (i = 0, last = items; !nilp(last); last = cdr(last))
+			vector_of(*result)->items[i++] = car(last);
+		release_list(items);
+		break;
+	case '"':
+		p->pos++;
+		err = json_string(j);
+		if (err)
+			return err;
+		*result = make_string(j->text.text, j->text.len);
+		break;
+	case 't':
+		if (!json_literal(p, "true"))
+			return Error_Syntax;
+		*result = sym_t;
+		break;
+	case 'f':
+		if (!json_literal(p, "false"))
+			return Error_Syntax;
+		*result = nil;
+		break;
+	case 'n':
+		if (!json_literal(p, "null"))
+			return Error_Syntax;
+		*result = make_sym_cached("null", 4);
+		break;
+	default:
+		err = json_number(j, result);
+		if (err)
+			return err;
+		break;
+	}
+
+	j->depth--;
+	return Error_OK;
+}
+
+Error builtin_json_parse(Atom args, Atom *result)
+{
+	struct JsonParser j;
+	struct Port text;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	if (car(args).type == AtomType_String) {
+		port_open_text(&text, string_of(car(args))->chars);
+		text.len = text.cap = string_of(car(args))->length;
+		j.port = &text;
+	}
+	else {
+		err = port_arg(car(args), 0, &j.port);
+		if (err)
+			return err;
+	}
+
+	/* Values may follow each other, as in JSON Lines */
+	if (json_skip_space(j.port) == EOF) {
+		*result = sym_eof;
+		return Error_OK;
+	}
+
+	j.cap = 64;
+	j.text.text = (char *)malloc(j.cap);
+	j.text.len = 0;
+	j.depth = 0;
+	err = json_value(&j, result);
+	free(j.text.text);
+	return err;
+}
+
+void json_write_string(struct Port *port, const char *s, long len)
+{
+	long i, start = 0;
+
+	port_putc(port, '"');
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)s[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		port_write(port, s + start, i - start);
+		start = i + 1;
+		switch (c) {
+		case '"': port_puts(port, "\\\""); break;
+		case '\\': port_puts(port, "\\\\"); break;
+		case '\n': port_puts(port, "\\n"); break;
+		case '\r': port_puts(port, "\\r"); break;
+		case '\t': port_puts(port, "\\t"); break;
+		default: port_printf(port, "\\u%04x", c); break;
+		}
+	}
+	port_write(port, s + start, len - start);
+	port_putc(port, '"');
+}
+
+int json_objectp(Atom list)
+{
+	for (; list.type == AtomType_Pair; list = cdr(list)) {
+		Atom e = car(list);
+		if (e.type != AtomType_Pair || (car(e).type != AtomType_Symbol
+			&& car(e).type != AtomType_String))
+			return 0;
+	}
+	return nilp(list);
+}
+
+Error json_write(struct Port *port, Atom x, int depth)
+{
+	Error err;
+	long i;
+
+	if (depth > JSON_MAX_DEPTH)
+		return Error_Type;
+
+	switch (x.type) {
+	case AtomType_Nil:
+		port_puts(port, "false");
+		return Error_OK;
+	case AtomType_Integer:
+		port_printf(port, "%ld", x.value.integer);
+		return Error_OK;
+	case AtomType_Real: {
+		char buf[32];
+		if (x.value.real != x.value.real || x.value.real - x.value.real != 0) {
+			/* NaN and infinities have no JSON form */
+			port_puts(port, "null");
+			return Error_OK;
+		}
+		format_real(buf, x.value.real);
+		port_puts(port, buf);
+		return Error_OK;
+	}
+	case AtomType_String:
+		json_write_string(port, string_of(x)->chars, string_of(x)->length);
+		return Error_OK;
+	case AtomType_Symbol:
+		if (eqp(x, sym_t))
+			port_puts(port, "true");
+		else if (strcmp(x.value.symbol, "null") == 0)
+			port_puts(port, "null");
+		else
+			json_write_string(port, x.value.symbol, (long)strlen(x.value.symbol));
+		return Error_OK;
+	case AtomType_Vector:
+		port_putc(port, '[');
+		for (i = 0; i < vector_of(x)->length; i++) {
+			if (i > 0)
+				port_putc(port, ',');
+			err = json_write(port, vector_get(vector_of(x), i), depth + 1);
+			if (err)
+				return err;
+		}
+		port_putc(port, ']');
+		return Error_OK;
+	case AtomType_Pair: {
+		int object = json_objectp(x);
+		if (!object && !listp(x))
+			return Error_Type;
+		port_putc(port, object ? '{' : '[');
+		for (i = 0; !nilp(x); x = cdr(x), i++) {
+			if (i > 0)
+				port_putc(port, ',');
+			if (object) {
+				Atom key = car(car(x));
+				if (key.type == AtomType_String)
+					json_write_string(port, string_of(key)->chars, string_of(key)->length);
+				else
+					json_write_string(port, key.value.symbol, (long)strlen(key.value.symbol));
+				port_putc(port, ':');
+			}
+			err = json_write(port, object ? cdr(car(x)) : car(x), depth + 1);
+			if (err)
+				return err;
+		}
+		port_putc(port, object ? '}' : ']');
+		return Error_OK;
+	}
+	default:
+		return Error_Type;
+	}
+}
+
+/* (json-write x [port]) */
+Error builtin_json_write(Atom args, Atom *result)
+{
+	struct Port *p;
+	Error err;
+
+	if (nilp(args))
+		return Error_Args;
+	err = output_port(cdr(args), &p);
+	if (err)
+		return err;
+
+	*result = nil;
+	return json_write(p, car(args), 0);
+}
+
+/* CSV and TSV readers.  (read-csv port schema [batch-size [callback]])
+ * reads up to batch-size rows (4096 by default) into one vector per
+ * column and returns them in a vector, or the eof object when no rows
+ * are left.  The schema lists one type per field: int and real columns
+ * are unboxed into typed vectors, string and symbol columns hold atoms,
+ * and skip drops the field.  Given a callback, the whole port is read
+ * one batch at a time, the callback is called on each batch and the row
+ * count is returned, so large files stream through bounded memory.
+ * Quoted fields follow RFC 4180; read-tsv splits on tabs and does not
+ * quote.  Blank lines are ignored, a header can be skipped with
+ * read-line, and a row with the wrong number of fields is an error. */
+#define CSV_BATCH_SIZE 4096
+
+enum CsvColumn { CsvColumn_Int, CsvColumn_Real, CsvColumn_String, CsvColumn_Symbol, CsvColumn_Skip };
+
+struct CsvReader {
+	struct Port *port;
+	int sep;
+	int quoting;
+	struct Token field;
+	long cap;
+};
+
+void csv_append(struct CsvReader *c, const char *s, long n)
+{
+	if (c->field.len + n + 1 > c->cap) {
+		while (c->field.len + n + 1 > c->cap)
+			c->cap *= 2;
+		c->field.text = (char *)realloc(c->field.text, c->cap);
+	}
+	memcpy(c->field.text + c->field.len, s, n);
+	c->field.len += n;
+	c->field.text[c->field.len] = '\0';
+}
+
+/* Read one field into c->field.  *term is set to what ended it: the
+ * separator, a newline or EOF. */
+Error csv_field(struct CsvReader *c, int *term)
+{
+	struct Port *p = c->port;
+	long start;
+
+	c->field.len = 0;
+	c->field.text[0] = '\0';
+
+	if (c->quoting && port_peekc(p) == '"') {
+		p->pos++;
+		for (;;) {
+			if (p->pos == p->len && !port_fill(p))
+				return Error_Syntax;
+			start = p->pos;
+			while (p->pos < p->len && p->buf[p->pos] != '"')
+				p->pos++;
+			csv_append(c, p->buf + start, p->pos - start);
+			if (p->pos == p->len)
+				continue;
+			p->pos++;
+			if (port_peekc(p) != '"')
+				break;
+			/* "" stands for one quote */
+			csv_append(c, "\"", 1);
+			p->pos++;
+		}
+		if (port_peekc(p) == '\r')
+			p->pos++;
+		*term = port_getc(p);
+		if (*term != c->sep && *term != '\n' && *term != EOF)
+			return Error_Syntax;
+		return Error_OK;
+	}
+
+	for (;;) {
+		if (p->pos == p->len && !port_fill(p)) {
+			*term = EOF;
+			break;
+		}
+		start = p->pos;
+		while (p->pos < p->len && p->buf[p->pos] != c->sep && p->buf[p->pos] != '\n')
+			p->pos++;
+		csv_append(c, p->buf + start, p->pos - start);
+		if (p->pos < p->len) {
+			*term = (unsigned char)p->buf[p->pos++];
+			break;
+		}
+	}
+	if (*term != c->sep && c->field.len > 0 && c->field.text[c->field.len - 1] == '\r')
+		c->field.text[--c->field.len] = '\0';
+	return Error_OK;
+}
+
+/* Convert the current field and store it in row i of column v */
+Error csv_store(struct CsvReader *c, enum CsvColumn kind, struct Vector *v, long i)
+{
+	const char *s = c->field.text;
+	char *end;
+
+	errno = 0;
+	switch (kind) {
+	case CsvColumn_Int:
+		v->ints[i] = strtol(s, &end, 10);
+		break;
+	case CsvColumn_Real:
+		v->reals[i] = strtod(s, &end);
+		break;
+	case CsvColumn_String:
+		v->items[i] = make_string(s, c->field.len);
+		return Error_OK;
+	case CsvColumn_Symbol:
+		v->items[i] = make_sym_cached(s, c->field.len);
+		return Error_OK;
+	default:
+		return Error_OK;
+	}
+	if (end == s || *end != '\0' || errno == ERANGE)
+		return Error_Type;
+	return Error_OK;
+}
+
+/* Read up to n rows into a new batch; *rows is set to the count */
+Error csv_batch(struct CsvReader *c, const enum CsvColumn *kinds, long ncols,
+		long nout, long n, Atom *result, long *rows)
+{
+	static const enum VectorKind vector_kinds[] = {
+		VectorKind_Ints, VectorKind_Reals, VectorKind_Atoms, VectorKind_Atoms
+	};
+	struct Vector *batch, *col;
+	long i, j, k;
+	int term;
+	Error err;
+
+	*result = make_vector(nout, nil);
+	batch = vector_of(*result);
+	for (j = k = 0; j < ncols; j++)
+		if (kinds[j] != CsvColumn_Skip)
+			batch->items[k++] = make_typed_vector(vector_kinds[kinds[j]], n);
+
+	for (i = 0; i < n; ) {
+		/* Skip blank lines */
+		while (port_peekc(c->port) == '\r' || port_peekc(c->port) == '\n')
+			c->port->pos++;
+		if (port_peekc(c->port) == EOF)
+			break;
+
+		term = c->sep;
+		for (j = k = 0; j < ncols; j++) {
+			if (term != c->sep)
+				return Error_Syntax;
+			err = csv_field(c, &term);
+			if (err)
+				return err;
+			if (kinds[j] == CsvColumn_Skip)
+				continue;
+			err = csv_store(c, kinds[j], vector_of(batch->items[k++]), i);
+			if (err)
+				return err;
+		}
+		if (term == c->sep)
+			return Error_Syntax;
+		i++;
+	}
+
+	for (k = 0; k < nout; k++) {
+		col = vector_of(batch->items[k]);
+		col->length = i;
+	}
+	*rows = i;
+	return Error_OK;
+}
+
+Error read_delimited(Atom args, int sep, int quoting, Atom *result)
+{
+	struct CsvReader c;
+	enum CsvColumn *kinds;
+	struct Root *roots = gc_roots, r[2];
+	Atom schema, callback = nil, batch = nil, p;
+	long ncols, nout, n = CSV_BATCH_SIZE, rows, total = 0;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)))
+		return Error_Args;
+	err = port_arg(car(args), 0, &c.port);
+	if (err)
+		return err;
+	schema = car(cdr(args));
+	if (!listp(schema))
+		return Error_Type;
+	p = cdr(cdr(args));
+	if (!nilp(p)) {
+		if (car(p).type != AtomType_Integer)
+			return Error_Type;
+		n = car(p).value.integer;
+		if (n < 1)
+			return Error_Args;
+		p = cdr(p);
+		if (!nilp(p)) {
+			if (!nilp(cdr(p)))
+				return Error_Args;
+			callback = car(p);
+		}
+	}
+
+	ncols = nout = 0;
+	for (p = schema; !nilp(p); p = cdr(p))
+		ncols++;
+	if (ncols == 0)
+		return Error_Args;
+	kinds = (enum CsvColumn *)malloc(sizeof(enum CsvColumn) * ncols);
+	for (ncols = 0, p = schema; !nilp(p); p = cdr(p), ncols++) {
+		const char *name = car(p).type == AtomType_Symbol ? car(p).value.symbol : "";
+
+		if (strcmp(name, "int") == 0)
+			kinds[ncols] = CsvColumn_Int;
+		else if (strcmp(name, "real") == 0)
+			kinds[ncols] = CsvColumn_Real;
+		else if (strcmp(name, "string") == 0)
+			kinds[ncols] = CsvColumn_String;
+		else if (strcmp(name, "symbol") == 0)
+			kinds[ncols] = CsvColumn_Symbol;
+		else if (strcmp(name, "skip") == 0)
+			kinds[ncols] = CsvColumn_Skip;
+		else {
+			free(kinds);
+			return Error_Type;
+		}
+		if (kinds[ncols] != CsvColumn_Skip)
+			nout++;
+	}
+
+	c.sep = sep;
+	c.quoting = quoting;
+	c.cap = 64;
+	c.field.text = (char *)malloc(c.cap);
+	c.field.len = 0;
+
+	gc_protect(&r[0], &args);
+	gc_protect(&r[1], &batch);
+	for (;;) {
+		err = csv_batch(&c, kinds, ncols, nout, n, &batch, &rows);
+		if (err || rows == 0 || nilp(callback))
+			break;
+		total += rows;
+		err = apply(callback, cons(batch, nil), result);
+		if (err || rows < n)
+			break;
+	}
+	gc_roots = roots;
+	free(c.field.text);
+	free(kinds);
+
+	if (err)
+		return err;
+	if (!nilp(callback))
+		*result = make_int(total);
+	else
+		*result = rows == 0 ? sym_eof : batch;
+	return Error_OK;
+}
+
+Error builtin_read_csv(Atom args, Atom *result)
+{
+	return read_delimited(args, ',', 1, result);
+}
+
+Error builtin_read_tsv(Atom args, Atom *result)
+{
+	return read_delimited(args, '\t', 0, result);
+}
+
+/* Foreign functions.  (ffi-open path) loads a shared library, or
+ * returns nil if it cannot be loaded, and (ffi-fn lib name arg-types
+ * ret-type) looks up a C function in it, or returns nil.  Argument types
+ * are int, long, double and pointer; a pointer is passed a string (as a
+ * writable byte buffer), an int or real vector from read-csv (as its
+ * array), an integer address or nil.  The return type may also be void,
+ * or string for a char * copied into a new string.  Without libffi,
+ * calls go through casts to a fixed set of signatures: up to
+ * FFI_MAX_ARGS arguments, each passed as a word or a double. */
+#define FFI_MAX_ARGS 4
+
+enum FfiType { FfiType_Int, FfiType_Long, FfiType_Double, FfiType_Pointer, FfiType_String, FfiType_Void };
+
+typedef intptr_t FfiWord;
+
+union FfiValue {
+	FfiWord w;
+	double d;
+};
+
+struct Library {
+	struct Object object;
+	void *handle;
+};
+
+struct Foreign {
+	struct Object object;
+	void *fn;
+	Atom library;  /* kept loaded while the function is reachable */
+	Builtin builtin;  /* extension builtins: called with min_args..max_args */
+	int min_args, max_args;
+	int nargs;
+	int sig;       /* index into FFI_DISPATCH */
+	enum FfiType args[FFI_MAX_ARGS];
+	enum FfiType ret;
+};
+
+void library_free(struct Library *lib)
+{
+#ifdef _WIN32
+	FreeLibrary((HMODULE)lib->handle);
+#else
+	dlclose(lib->handle);
+#endif
+	free(lib);
+}
+
+void foreign_mark(struct Foreign *f)
+{
+	gc_mark(f->library);
+}
+
+int ffi_type(Atom a, enum FfiType *type)
+{
+	static const char *names[] = { "int", "long", "double", "pointer", "string", "void" };
+	int i;
+
+	if (a.type != AtomType_Symbol)
+		return 0;
+	for (i = 0; i < 6; i++) {
+		if (strcmp(a.value.symbol, names[i]) == 0) {
+			*type = (enum FfiType)i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#define FFI_DISPATCH(R) \
+	switch (sig) { \
+	case 0: return ((R (*)(void))fn)(); \
+	case 1: return ((R (*)(FfiWord))fn)(v[0].w); \
+	case 2: return ((R (*)(double))fn)(v[0].d); \
+	case 3: return ((R (*)(FfiWord, FfiWord))fn)(v[0].w, v[1].w); \
+	case 4: return ((R (*)(double, FfiWord))fn)(v[0].d, v[1].w); \
+	case 5: return ((R (*)(FfiWord, double))fn)(v[0].w, v[1].d); \
+	case 6: return ((R (*)(double, double))fn)(v[0].d, v[1].d); \
+	case 7: return ((R (*)(FfiWord, FfiWord, FfiWord))fn)(v[0].w, v[1].w, v[2].w); \
+	case 8: return ((R (*)(double, FfiWord, FfiWord))fn)(v[0].d, v[1].w, v[2].w); \
+	case 9: return ((R (*)(FfiWord, double, FfiWord))fn)(v[0].w, v[1].d, v[2].w); \
+	case 10: return ((R (*)(double, double, FfiWord))fn)(v[0].d, v[1].d, v[2].w); \
+	case 11: return ((R (*)(FfiWord, FfiWord, double))fn)(v[0].w, v[1].w, v[2].d); \
+	case 12: return ((R (*)(double, FfiWord, double))fn)(v[0].d, v[1].w, v[2].d); \
+	case 13: return ((R (*)(FfiWord, double, double))fn)(v[0].w, v[1].d, v[2].d); \
+	case 14: return ((R (*)(double, double, double))fn)(v[0].d, v[1].d, v[2].d); \
+	case 15: return ((R (*)(FfiWord, FfiWord, FfiWord, FfiWord))fn)(v[0].w, v[1].w, v[2].w, v[3].w); \
+	case 16: return ((R (*)(double, FfiWord, FfiWord, FfiWord))fn)(v[0].d, v[1].w, v[2].w, v[3].w); \
+	case 17: return ((R (*)(FfiWord, double, FfiWord, FfiWord))fn)(v[0].w, v[1].d, v[2].w, v[3].w); \
+	case 18: return ((R (*)(double, double, FfiWord, FfiWord))fn)(v[0].d, v[1].d, v[2].w, v[3].w); \
+	case 19: return ((R (*)(FfiWord, FfiWord, double, FfiWord))fn)(v[0].w, v[1].w, v[2].d, v[3].w); \
+	case 20: return ((R (*)(double, FfiWord, double, FfiWord))fn)(v[0].d, v[1].w, v[2].d, v[3].w); \
+	case 21: return ((R (*)(FfiWord, double, double, FfiWord))fn)(v[0].w, v[1].d, v[2].d, v[3].w); \
+	case 22: return ((R (*)(double, double, double, FfiWord))fn)(v[0].d, v[1].d, v[2].d, v[3].w); \
+	case 23: return ((R (*)(FfiWord, FfiWord, FfiWord, double))fn)(v[0].w, v[1].w, v[2].w, v[3].d); \
+	case 24: return ((R (*)(double, FfiWord, FfiWord, double))fn)(v[0].d, v[1].w, v[2].w, v[3].d); \
+	case 25: return ((R (*)(FfiWord, double, FfiWord, double))fn)(v[0].w, v[1].d, v[2].w, v[3].d); \
+	case 26: return ((R (*)(double, double, FfiWord, double))fn)(v[0].d, v[1].d, v[2].w, v[3].d); \
+	case 27: return ((R (*)(FfiWord, FfiWord, double, double))fn)(v[0].w, v[1].w, v[2].d, v[3].d); \
+	case 28: return ((R (*)(double, FfiWord, double, double))fn)(v[0].d, v[1].w, v[2].d, v[3].d); \
+	case 29: return ((R (*)(FfiWord, double, double, double))fn)(v[0].w, v[1].d, v[2].d, v[3].d); \
+	case 30: return ((R (*)(double, double, double, double))fn)(v[0].d, v[1].d, v[2].d, v[3].d); \
+	} \
+	return 0
+
+FfiWord ffi_call_word(void *fn, int sig, const union FfiValue *v)
+{
+	FFI_DISPATCH(FfiWord);
+}
+
+double ffi_call_double(void *fn, int sig, const union FfiValue *v)
+{
+	FFI_DISPATCH(double);
+}
+
+Error ffi_arg(enum FfiType type, Atom a, union FfiValue *v)
+{
+	switch (type) {
+	case FfiType_Int:
+	case FfiType_Long:
+		if (a.type != AtomType_Integer)
+			return Error_Type;
+		v->w = (FfiWord)a.value.integer;
+		return Error_OK;
+	case FfiType_Double:
+		if (a.type == AtomType_Integer)
+			v->d = (double)a.value.integer;
+		else if (a.type == AtomType_Real)
+			v->d = a.value.real;
+		else
+			return Error_Type;
+		return Error_OK;
+	default:
+		switch (a.type) {
+		case AtomType_Nil:
+			v->w = 0;
+			return Error_OK;
+		case AtomType_Integer:
+			v->w = (FfiWord)a.value.integer;
+			return Error_OK;
+		case AtomType_String:
+			v->w = (FfiWord)string_of(a)->chars;
+			return Error_OK;
+		case AtomType_Vector:
+			if (vector_of(a)->kind == VectorKind_Ints)
+				v->w = (FfiWord)vector_of(a)->ints;
+			else if (vector_of(a)->kind == VectorKind_Reals)
+				v->w = (FfiWord)vector_of(a)->reals;
+			else
+				return Error_Type;
+			return Error_OK;
+		default:
+			return Error_Type;
+		}
+	}
+}
+
+Error ffi_call(struct Foreign *f, Atom args, Atom *result)
+{
+	union FfiValue v[FFI_MAX_ARGS];
+	FfiWord w;
+	Atom p;
+	int i;
+	Error err;
+
+	if (f->builtin) {
+		for (i = 0, p = args; !nilp(p); p = cdr(p))
+			i++;
+		if (i < f->min_args || (f->max_args >= 0 && i > f->max_args))
+			return Error_Args;
+		return f->builtin(args, result);
+	}
+
+	for (i = 0; i < f->nargs; i++) {
+		if (nilp(args))
+			return Error_Args;
+		err = ffi_arg(f->args[i], car(args), &v[i]);
+		if (err)
+			return err;
+		args = cdr(args);
+	}
+	if (!nilp(args))
+		return Error_Args;
+
+	if (f->ret == FfiType_Double) {
+		*result = make_real(ffi_call_double(f->fn, f->sig, v));
+		return Error_OK;
+	}
+
+	w = ffi_call_word(f->fn, f->sig, v);
+	switch (f->ret) {
+	case FfiType_Int:
+		*result = make_int((int)w);
+		break;
+	case FfiType_String:
+		*result = w ? make_string((const char *)w, (long)strlen((const char *)w)) : nil;
+		break;
+	case FfiType_Void:
+		*result = nil;
+		break;
+	default:
+		*result = make_int((long)w);
+		break;
+	}
+	return Error_OK;
+}
+
+/* A library object, or nil if path cannot be loaded */
+Atom library_open(const char *path)
+{
+	struct Library *lib;
+	void *handle;
+
+#ifdef _WIN32
+	handle = (void *)LoadLibraryA(path);
+#else
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+#endif
+	if (!handle)
+		return nil;
+	lib = (struct Library *)malloc(sizeof(struct Library));
+	lib->handle = handle;
+	return make_object(&lib->object, AtomType_Library);
+}
+
+void *library_sym(Atom library, const char *name)
+{
+	struct Library *lib = (struct Library *)library.value.object;
+
+#ifdef _WIN32
+	return (void *)GetProcAddress((HMODULE)lib->handle, name);
+#else
+	return dlsym(lib->handle, name);
+#endif
+}
+
+Atom make_foreign(Atom library, void *fn, Builtin builtin)
+{
+	struct Foreign *f = (struct Foreign *)malloc(sizeof(struct Foreign));
+
+	f->fn = fn;
+	f->library = library;
+	f->builtin = builtin;
+	f->min_args = 0;
+	f->max_args = -1;
+	f->nargs = 0;
+	f->sig = 0;
+	f->ret = FfiType_Void;
+	return make_object(&f->object, AtomType_Foreign);
+}
+
+Error builtin_ffi_open(Atom args, Atom *result)
+{
+	const char *path;
+	Error err;
+
+	err = string_arg(args, &path);
+	if (err)
+		return err;
+
+	*result = library_open(path);
+	return Error_OK;
+}
+
+/* (ffi-fn lib name arg-types ret-type) */
+Error builtin_ffi_fn(Atom args, Atom *result)
+{
+	struct Foreign *f;
+	enum FfiType types[FFI_MAX_ARGS], ret;
+	Atom name, p;
+	void *fn;
+	int n = 0, mask = 0;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| nilp(cdr(cdr(cdr(args)))) || !nilp(cdr(cdr(cdr(cdr(args))))))
+		return Error_Args;
+	name = car(cdr(args));
+	if (car(args).type != AtomType_Library
+		|| (name.type != AtomType_String && name.type != AtomType_Symbol))
+		return Error_Type;
+
+	for (p = car(cdr(cdr(args))); !nilp(p); p = cdr(p)) {
+		if (p.type != AtomType_Pair)
+			return Error_Type;
+		if (n == FFI_MAX_ARGS)
+			return Error_Args;
+		if (!ffi_type(car(p), &types[n]) || types[n] == FfiType_Void)
+			return Error_Type;
+		if (types[n] == FfiType_Double)
+			mask |= 1 << n;
+		n++;
+	}
+	if (!ffi_type(car(cdr(cdr(cdr(args)))), &ret))
+		return Error_Type;
+
+	fn = library_sym(car(args),
+		name.type == AtomType_String ? string_of(name)->chars : name.value.symbol);
+	if (!fn) {
+		*result = nil;
+		return Error_OK;
+	}
+
+	*result = make_foreign(car(args), fn, NULL);
+	f = (struct Foreign *)result->value.object;
+	f->nargs = n;
+	f->sig = (1 << n) - 1 + mask;
+	memcpy(f->args, types, sizeof(types));
+	f->ret = ret;
+	return Error_OK;
+}
+
+/* Native extensions.  (load-extension path) loads a shared library and
+ * calls its toylisp_extension_init with a struct ToyLispApi, through
+ * which it defines builtins; see ToyLisp.h.  Returns the library, or nil
+ * if it cannot be loaded or has no init function. */
+static Atom extension_library = { AtomType_Nil };  /* being initialized */
+
+Error extension_define_builtin(const char *name, Builtin fn, int min_args, int max_args)
+{
+	struct Foreign *f;
+	Atom a;
+
+	a = make_foreign(extension_library, NULL, fn);
+	f = (struct Foreign *)a.value.object;
+	f->min_args = min_args;
+	f->max_args = max_args;
+	return env_set(toplevel_env, make_sym(name), a);
+}
+
+Atom extension_make_string(const char *s, long length)
+{
+	return make_string(s, length);
+}
+
+const char *extension_string_chars(Atom a, long *length)
+{
+	if (a.type != AtomType_String)
+		return NULL;
+	if (length)
+		*length = string_of(a)->length;
+	return string_of(a)->chars;
+}
+
+Error builtin_load_extension(Atom args, Atom *result)
+{
+	static const struct ToyLispApi api = {
+		TOYLISP_API_VERSION,
+		extension_define_builtin,
+		gc_protect,
+		gc_unprotect,
+		cons,
+		make_int,
+		make_real,
+		make_sym,
+		extension_make_string,
+		extension_string_chars,
+		apply,
+		eval_string
+	};
+	ToyLispExtensionInit init;
+	struct Root *roots = gc_roots, r;
+	const char *path;
+	Error err;
+
+	err = string_arg(args, &path);
+	if (err)
+		return err;
+
+	*result = library_open(path);
+	if (nilp(*result))
+		return Error_OK;
+	init = (ToyLispExtensionInit)library_sym(*result, "toylisp_extension_init");
+	if (!init) {
+		*result = nil;
+		return Error_OK;
+	}
+
+	gc_protect(&r, result);
+	extension_library = *result;
+	err = init(&api, toplevel_env);
+	extension_library = nil;
+	gc_roots = roots;
+	return err;
+}
+
+/* Key-value stores: an append-only log file with an in-memory hash index.
+ * (kv-open path) opens or creates a store, or returns nil if the file
+ * cannot be opened or is not a store.  kv-put, kv-get and kv-delete
+ * append records or read one value back with a single seek, and kv-scan
+ * iterates over the (key . value) pairs in no particular order; pairs
+ * added or removed during a scan may or may not be seen.  Keys and values
+ * are nil, integers, reals, symbols, strings, and lists and vectors of
+ * these, stored in a compact binary form; keys match when their encodings
+ * do, as with equal?.  Records carry a checksum, and a torn record at the
+ * end of the log, left by a crash, is dropped when the store is opened.
+ * Writes are synced to disk every KV_SYNC_BATCH records, by kv-sync and by
+ * kv-close.  (kv-compact kv) rewrites the log with only the live records. */
+#define KV_MAGIC "TLKV1\n"
+#define KV_MAGIC_SIZE 6
+#define KV_SYNC_BATCH 256
+#define KV_MAX_DEPTH 512
+
+enum KvTag {
+	KvTag_Nil, KvTag_Int, KvTag_Real, KvTag_Symbol, KvTag_String,
+	KvTag_List, KvTag_Vector, KvTag_IntVector, KvTag_RealVector
+};
+
+struct KvEntry {
+	unsigned char *key;  /* encoded; NULL if the slot is free */
+	long keylen;
+	unsigned long hash;
+	long offset;         /* of the record in the log */
+	long vallen;
+};
+
+struct Kv {
+	struct Object object;
+	char *path;
+	FILE *file;          /* NULL once closed */
+	long end;            /* of the log */
+	long count, capacity;
+	struct KvEntry *entries;
+	int pending;         /* records written since the last sync */
+	int appending;       /* the file is positioned at the end */
+};
+
+struct KvBuffer {
+	unsigned char *data;
+	long len, cap;
+};
+
+struct Kv *kv_of(Atom a)
+{
+	return (struct Kv *)a.value.object;
+}
+
+void kv_reserve(struct KvBuffer *b, long n)
+{
+	if (b->len + n > b->cap) {
+		while (b->len + n > b->cap)
+			b->cap = b->cap ? b->cap * 2 : 64;
+		b->data = (unsigned char *)realloc(b->data, b->cap);
+	}
+}
+
+void kv_put_byte(struct KvBuffer *b, int c)
+{
+	kv_reserve(b, 1);
+	b->data[b->len++] = (unsigned char)c;
+}
+
+void kv_put_varint(struct KvBuffer *b, unsigned long x)
+{
+	while (x >= 0x80) {
+		kv_put_byte(b, (int)(x & 0x7f) | 0x80);
+		x >>= 7;
+	}
+	kv_put_byte(b, (int)x);
+}
+
+void kv_put_bytes(struct KvBuffer *b, const void *s, long n)
+{
+	if (n == 0)
+		return;
+	kv_reserve(b, n);
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+}
+
+void kv_put_int(struct KvBuffer *b, long x)
+{
+	/* Zigzag, so that small negative numbers stay short */
+	kv_put_varint(b, ((unsigned long)x << 1) ^ (unsigned long)(x < 0 ? -1L : 0));
+}
+
+void kv_put_real(struct KvBuffer *b, double x)
+{
+	unsigned long long bits;
+	int i;
+
+	memcpy(&bits, &x, sizeof(bits));
+	for (i = 0; i < 8; i++)
+		kv_put_byte(b, (int)(bits >> (8 * i)) & 0xff);
+}
+
+Error kv_encode(struct KvBuffer *b, Atom a, int depth)
+{
+	struct Vector *v;
+	Atom p;
+	long i, n;
+	Error err;
+
+	if (depth > KV_MAX_DEPTH)
+		return Error_Args;
+
+	switch (a.type) {
+	case AtomType_Nil:
+		kv_put_byte(b, KvTag_Nil);
+		return Error_OK;
+	case AtomType_Integer:
+		kv_put_byte(b, KvTag_Int);
+		kv_put_int(b, a.value.integer);
+		return Error_OK;
+	case AtomType_Real:
+		kv_put_byte(b, KvTag_Real);
+		kv_put_real(b, a.value.real);
+		return Error_OK;
+	case AtomType_Symbol:
+		n = (long)strlen(a.value.symbol);
+		kv_put_byte(b, KvTag_Symbol);
+		kv_put_varint(b, n);
+		kv_put_bytes(b, a.value.symbol, n);
+		return Error_OK;
+	case AtomType_String:
+		kv_put_byte(b, KvTag_String);
+		kv_put_varint(b, string_of(a)->length);
+		kv_put_bytes(b, string_of(a)->chars, string_of(a)->length);
+		return Error_OK;
+	case AtomType_Pair:
+		/* The elements, then the tail of an improper list */
+		for (n = 0, p = a; p.type == AtomType_Pair; p = cdr(p))
+			n++;
+		kv_put_byte(b, KvTag_List);
+		kv_put_varint(b, n);
+		for (p = a; p.type == AtomType_Pair; p = cdr(p)) {
+			err = kv_encode(b, car(p), depth + 1);
+			if (err)
+				return err;
+		}
+		return kv_encode(b, p, depth + 1);
+	case AtomType_Vector:
+		v = vector_of(a);
+		kv_put_byte(b, v->kind == VectorKind_Ints ? KvTag_IntVector
+			: v->kind == VectorKind_Reals ? KvTag_RealVector : KvTag_Vector);
+		kv_put_varint(b, v->length);
+		for (i = 0; i < v->length; i++) {
+			if (v->kind == VectorKind_Ints)
+				kv_put_int(b, v->ints[i]);
+			else if (v->kind == VectorKind_Reals)
+				kv_put_real(b, v->reals[i]);
+			else {
+				err = kv_encode(b, v->items[i], depth + 1);
+				if (err)
+					return err;
+			}
+		}
+		return Error_OK;
+	default:
+		return Error_Type;
+	}
+}
+
+struct KvReader {
+	const unsigned char *p, *end;
+};
+
+int kv_get_varint(struct KvReader *r, unsigned long *x)
+{
+	int shift = 0;
+
+	*x = 0;
+	while (r->p < r->end && shift < 64) {
+		*x |= (unsigned long)(*r->p & 0x7f) << shift;
+		if (!(*r->p++ & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+int kv_get_int(struct KvReader *r, long *x)
+{
+	unsigned long u;
+
+	if (!kv_get_varint(r, &u))
+		return 0;
+	*x = (long)(u >> 1) ^ -(long)(u & 1);
+	return 1;
+}
+
+int kv_get_real(struct KvReader *r, double *x)
+{
+	unsigned long long bits = 0;
+	int i;
+
+	if (r->end - r->p < 8)
+		return 0;
+	for (i = 0; i < 8; i++)
+		bits |= (unsigned long long)*r->p++ << (8 * i);
+	memcpy(x, &bits, sizeof(bits));
+	return 1;
+}
+
+Error kv_decode(struct KvReader *r, Atom *result, int depth)
+{
+	struct Vector *v;
+	unsigned long n, i;
+	Atom *tail, p;
+	char *s;
+	int tag;
+	Error err;
+
+	if (r->p == r->end || depth > KV_MAX_DEPTH)
+		return Error_Syntax;
+
+	tag = *r->p++;
+	switch (tag) {
+	case KvTag_Nil:
+		*result = nil;
+		return Error_OK;
+	case KvTag_Int:
+		*result = make_int(0);
+		return kv_get_int(r, &result->value.integer) ? Error_OK : Error_Syntax;
+	case KvTag_Real:
+		*result = make_real(0);
+		return kv_get_real(r, &result->value.real) ? Error_OK : Error_Syntax;
+	case KvTag_Symbol:
+		if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		s = (char *)malloc(n + 1);
+		memcpy(s, r->p, n);
+		s[n] = '\0';
+		*result = make_sym_cached(s, (long)n);
+		free(s);
+		r->p += n;
+		return Error_OK;
+	case KvTag_String:
+		if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_string((const char *)r->p, (long)n);
+		r->p += n;
+		return Error_OK;
+	case KvTag_List:
+		if (!kv_get_varint(r, &n))
+			return Error_Syntax;
+		tail = result;
+		for (i = 0; i < n; i++) {
+			*tail = cons(nil, nil);
+			err = kv_decode(r, &car(*tail), depth + 1);
+			if (err)
+				return err;
+			tail = &cdr(*tail);
+		}
+		err = kv_decode(r, tail, depth + 1);
+		/* The cells were consed onto nil; an improper tail unmarks them */
+		if (!err && !nilp(*tail))
+			for (p = *result; p.type == AtomType_Pair; p = cdr(p))
+				allocation_of(p)->proper = 0;
+		return err;
+	case KvTag_Vector:
+	case KvTag_IntVector:
+	case KvTag_RealVector:
+		/* Every element takes at least one byte */
+		if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_typed_vector(tag == KvTag_IntVector ? VectorKind_Ints
+			: tag == KvTag_RealVector ? VectorKind_Reals : VectorKind_Atoms, (long)n);
+		v = vector_of(*result);
+		for (i = 0; i < n; i++) {
+			if (tag == KvTag_IntVector)
+				err = kv_get_int(r, &v->ints[i]) ? Error_OK : Error_Syntax;
+			else if (tag == KvTag_RealVector)
+				err = kv_get_real(r, &v->reals[i]) ? Error_OK : Error_Syntax;
+			else
+				err = kv_decode(r, &v->items[i], depth + 1);
+			if (err)
+				return err;
+		}
+		return Error_OK;
+	default:
+		return Error_Syntax;
+	}
+}
+
+unsigned long kv_hash(const unsigned char *s, long n)
+{
+	unsigned long h = 2166136261UL;
+	long i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ s[i]) * 16777619UL;
+	return h & 0xffffffffUL;
+}
+
+/* The slot holding key, or the free slot where it would go */
+struct KvEntry *kv_slot(struct Kv *kv, const unsigned char *key, long keylen, unsigned long hash)
+{
+	long i = (long)(hash & (kv->capacity - 1));
+	struct KvEntry *e;
+
+	for (;;) {
+		e = &kv->entries[i];
+		if (!e->key || (e->hash == hash && e->keylen == keylen
+				&& memcmp(e->key, key, keylen) == 0))
+			return e;
+		i = (i + 1) & (kv->capacity - 1);
+	}
+}
+
+void kv_grow(struct Kv *kv)
+{
+	struct KvEntry *old = kv->entries;
+	long i, n = kv->capacity;
+
+	kv->capacity = n ? n * 2 : 64;
+	kv->entries = (struct KvEntry *)calloc(kv->capacity, sizeof(struct KvEntry));
+	for (i = 0; i < n; i++)
+		if (old[i].key)
+			*kv_slot(kv, old[i].key, old[i].keylen, old[i].hash) = old[i];
+	free(old);
+}
+
+/* Remove an entry, shifting back the entries that probed past it */
+void kv_remove(struct Kv *kv, struct KvEntry *e)
+{
+	long i = e - kv->entries, j = i, k;
+
+	free(e->key);
+	kv->count--;
+	for (;;) {
+		kv->entries[i].key = NULL;
+		do {
+			j = (j + 1) & (kv->capacity - 1);
+			if (!kv->entries[j].key)
+				return;
+			k = (long)(kv->entries[j].hash & (kv->capacity - 1));
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		kv->entries[i] = kv->entries[j];
+		i = j;
+	}
+}
+
+long kv_record_size(long keylen, long vallen)
+{
+	long n = 1 + keylen + vallen + 4, x;
+
+	for (x = keylen; x >= 0x80; x >>= 7)
+		n++;
+	for (x = vallen; x >= 0x80; x >>= 7)
+		n++;
+	return n + 2;
+}
+
+/* Update the index for a record at offset */
+void kv_index(struct Kv *kv, int op, const unsigned char *key, long keylen,
+		long offset, long vallen)
+{
+	unsigned long hash = kv_hash(key, keylen);
+	struct KvEntry *e;
+
+	if (2 * (kv->count + 1) > kv->capacity)
+		kv_grow(kv);
+	e = kv_slot(kv, key, keylen, hash);
+	if (e->key) {
+		if (op == 'D') {
+			kv_remove(kv, e);
+			return;
+		}
+	}
+	else {
+		if (op == 'D')
+			return;
+		e->key = (unsigned char *)malloc(keylen > 0 ? keylen : 1);
+		memcpy(e->key, key, keylen);
+		e->keylen = keylen;
+		e->hash = hash;
+		kv->count++;
+	}
+	e->offset = offset;
+	e->vallen = vallen;
+}
+
+/* A record is op, the key and value lengths, the key, the value and a
+ * checksum of all of these */
+void kv_record(struct KvBuffer *b, int op, const unsigned char *key, long keylen,
+		const unsigned char *value, long vallen)
+{
+	unsigned long sum;
+
+	b->len = 0;
+	kv_put_byte(b, op);
+	kv_put_varint(b, keylen);
+	kv_put_varint(b, vallen);
+	kv_put_bytes(b, key, keylen);
+	kv_put_bytes(b, value, vallen);
+	sum = kv_hash(b->data, b->len);
+	kv_put_byte(b, (int)(sum & 0xff));
+	kv_put_byte(b, (int)(sum >> 8) & 0xff);
+	kv_put_byte(b, (int)(sum >> 16) & 0xff);
+	kv_put_byte(b, (int)(sum >> 24) & 0xff);
+}
+
+void kv_sync(struct Kv *kv)
+{
+	fflush(kv->file);
+#ifdef _WIN32
+	_commit(_fileno(kv->file));
+#else
+	fsync(fileno(kv->file));
+#endif
+	kv->pending = 0;
+}
+
+Error kv_append(struct Kv *kv, struct KvBuffer *record)
+{
+	/* Seeking flushes the stdio buffer, so only seek after reading */
+	if (!kv->appending && fseek(kv->file, kv->end, SEEK_SET) != 0)
+		return Error_Type;
+	kv->appending = 1;
+	if (fwrite(record->data, 1, record->len, kv->file) != (size_t)record->len) {
+		kv->appending = 0;
+		return Error_Type;
+	}
+	kv->end += record->len;
+	if (++kv->pending >= KV_SYNC_BATCH)
+		kv_sync(kv);
+	return Error_OK;
+}
+
+/* Read the value of a record at offset */
+int kv_read_value(struct Kv *kv, struct KvEntry *e, struct KvBuffer *b)
+{
+	long start = e->offset + kv_record_size(e->keylen, e->vallen) - 4 - e->vallen;
+
+	b->len = 0;
+	kv_reserve(b, e->vallen);
+	kv->appending = 0;
+	if (fseek(kv->file, start, SEEK_SET) != 0
+		|| fread(b->data, 1, e->vallen, kv->file) != (size_t)e->vallen)
+		return 0;
+	b->len = e->vallen;
+	return 1;
+}
+
+/* Rebuild the index from the log, cutting off a torn last record */
+void kv_replay(struct Kv *kv)
+{
+	struct KvBuffer b = { NULL, 0, 0 };
+	unsigned long keylen, vallen, sum;
+	long offset = KV_MAGIC_SIZE, n;
+	int op, c, shift, i;
+
+	fseek(kv->file, offset, SEEK_SET);
+	for (;;) {
+		op = getc(kv->file);
+		if (op != 'P' && op != 'D')
+			break;
+		b.len = 0;
+		kv_put_byte(&b, op);
+		for (i = 0; i < 2; i++) {
+			unsigned long *x = i ? &vallen : &keylen;
+
+			*x = 0;
+			shift = 0;
+			do {
+				c = getc(kv->file);
+				if (c == EOF || shift > 56)
+					goto done;
+				*x |= (unsigned long)(c & 0x7f) << shift;
+				shift += 7;
+				kv_put_byte(&b, c);
+			} while (c & 0x80);
+		}
+		if (keylen > 0x7fffffffUL || vallen > 0x7fffffffUL)
+			break;
+		n = (long)(keylen + vallen + 4);
+		kv_reserve(&b, n);
+		if (fread(b.data + b.len, 1, n, kv->file) != (size_t)n)
+			break;
+		sum = b.data[b.len + n - 4] | (unsigned long)b.data[b.len + n - 3] << 8
+			| (unsigned long)b.data[b.len + n - 2] << 16
+			| (unsigned long)b.data[b.len + n - 1] << 24;
+		if (sum != kv_hash(b.data, b.len + n - 4))
+			break;
+		kv_index(kv, op, b.data + b.len, (long)keylen, offset, (long)vallen);
+		offset += b.len + n;
+	}
+done:
+	free(b.data);
+	kv->end = offset;
+	fflush(kv->file);
+#ifdef _WIN32
+	_chsize(_fileno(kv->file), offset);
+#else
+	/* If this fails, new records still overwrite the torn one */
+	if (ftruncate(fileno(kv->file), offset) != 0)
+		clearerr(kv->file);
+#endif
+}
+
+void kv_close(struct Kv *kv)
+{
+	long i;
+
+	if (kv->file) {
+		kv_sync(kv);
+		fclose(kv->file);
+		kv->file = NULL;
+	}
+	for (i = 0; i < kv->capacity; i++)
+		free(kv->entries[i].key);
+	free(kv->entries);
+	kv->entries = NULL;
+	kv->count = kv->capacity = 0;
+}
+
+void kv_free(struct Kv *kv)
+{
+	kv_close(kv);
+	free(kv->path);
+	free(kv);
+}
+
+Error builtin_kv_open(Atom args, Atom *result)
+{
+	struct Kv *kv;
+	const char *path;
+	char magic[KV_MAGIC_SIZE];
+	FILE *file;
+	long n;
+	Error err;
+
+	err = string_arg(args, &path);
+	if (err)
+		return err;
+
+	file = fopen(path, "r+b");
+	if (!file)
+		file = fopen(path, "w+b");
+	*result = nil;
+	if (!file)
+		return Error_OK;
+
+	n = (long)fread(magic, 1, KV_MAGIC_SIZE, file);
+	if (n == 0) {
+		fseek(file, 0, SEEK_SET);
+		fwrite(KV_MAGIC, 1, KV_MAGIC_SIZE, file);
+	}
+	else if (n != KV_MAGIC_SIZE || memcmp(magic, KV_MAGIC, KV_MAGIC_SIZE) != 0) {
+		fclose(file);
+		return Error_OK;
+	}
+
+	kv = (struct Kv *)malloc(sizeof(struct Kv));
+	kv->path = strdup(path);
+	kv->file = file;
+	kv->count = kv->capacity = 0;
+	kv->entries = NULL;
+	kv->pending = 0;
+	kv->appending = 0;
+	kv_grow(kv);
+	kv_replay(kv);
+	*result = make_object(&kv->object, AtomType_Kv);
+	return Error_OK;
+}
+
+/* The store of the first argument, which must be open */
+Error kv_open_arg(Atom args, struct Kv **kv)
+{
+	if (nilp(args))
+		return Error_Args;
+	if (car(args).type != AtomType_Kv)
+		return Error_Type;
+	*kv = kv_of(car(args));
+	return (*kv)->file ? Error_OK : Error_Type;
+}
+
+/* (kv-put kv key value) returns kv */
+Error builtin_kv_put(Atom args, Atom *result)
+{
+	struct KvBuffer key = { NULL, 0, 0 }, value = { NULL, 0, 0 }, record = { NULL, 0, 0 };
+	struct Kv *kv;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (!err)
+		err = kv_encode(&key, car(cdr(args)), 0);
+	if (!err)
+		err = kv_encode(&value, car(cdr(cdr(args))), 0);
+	if (!err) {
+		kv_record(&record, 'P', key.data, key.len, value.data, value.len);
+		err = kv_append(kv, &record);
+	}
+	if (!err)
+		kv_index(kv, 'P', key.data, key.len, kv->end - record.len, value.len);
+	free(key.data);
+	free(value.data);
+	free(record.data);
+	*result = car(args);
+	return err;
+}
+
+/* (kv-get kv key [default]) */
+Error builtin_kv_get(Atom args, Atom *result)
+{
+	struct KvBuffer key = { NULL, 0, 0 }, value = { NULL, 0, 0 };
+	struct KvReader r;
+	struct KvEntry *e;
+	struct Kv *kv;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args))
+		|| (!nilp(cdr(cdr(args))) && !nilp(cdr(cdr(cdr(args))))))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (!err)
+		err = kv_encode(&key, car(cdr(args)), 0);
+	if (err) {
+		free(key.data);
+		return err;
+	}
+
+	e = kv_slot(kv, key.data, key.len, kv_hash(key.data, key.len));
+	free(key.data);
+	if (!e->key) {
+		*result = nilp(cdr(cdr(args))) ? nil : car(cdr(cdr(args)));
+		return Error_OK;
+	}
+
+	if (!kv_read_value(kv, e, &value))
+		err = Error_Type;
+	else {
+		r.p = value.data;
+		r.end = value.data + value.len;
+		err = kv_decode(&r, result, 0);
+	}
+	free(value.data);
+	return err;
+}
+
+/* (kv-delete kv key) returns t if key was present */
+Error builtin_kv_delete(Atom args, Atom *result)
+{
+	struct KvBuffer key = { NULL, 0, 0 }, record = { NULL, 0, 0 };
+	struct KvEntry *e;
+	struct Kv *kv;
+	Error err;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (!err)
+		err = kv_encode(&key, car(cdr(args)), 0);
+
+	*result = nil;
+	if (!err) {
+		e = kv_slot(kv, key.data, key.len, kv_hash(key.data, key.len));
+		if (e->key) {
+			kv_record(&record, 'D', key.data, key.len, NULL, 0);
+			err = kv_append(kv, &record);
+			if (!err) {
+				kv_index(kv, 'D', key.data, key.len, 0, 0);
+				*result = sym_t;
+			}
+		}
+	}
+	free(key.data);
+	free(record.data);
+	return err;
+}
+
+Error builtin_kv_count(Atom args, Atom *result)
+{
+	struct Kv *kv;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (err)
+		return err;
+	*result = make_int(kv->count);
+	return Error_OK;
+}
+
+Error builtin_kv_sync(Atom args, Atom *result)
+{
+	struct Kv *kv;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (err)
+		return err;
+	kv_sync(kv);
+	*result = nil;
+	return Error_OK;
+}
+
+Error builtin_kv_close(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Kv)
+		return Error_Type;
+	kv_close(kv_of(car(args)));
+	*result = nil;
+	return Error_OK;
+}
+
+/* (kv-compact kv) copies the live records to a new log, which then
+ * replaces the old one.  Returns the number of bytes reclaimed. */
+Error builtin_kv_compact(Atom args, Atom *result)
+{
+	struct KvBuffer value = { NULL, 0, 0 }, record = { NULL, 0, 0 };
+	struct Kv *kv;
+	struct KvEntry *e;
+	char *tmp;
+	FILE *out;
+	long i, end = KV_MAGIC_SIZE, *offsets;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (err)
+		return err;
+
+	tmp = (char *)malloc(strlen(kv->path) + 5);
+	sprintf(tmp, "%s.tmp", kv->path);
+	out = fopen(tmp, "w+b");
+	if (!out) {
+		free(tmp);
+		return Error_Type;
+	}
+
+	/* New offsets are only installed once the new log is complete */
+	offsets = (long *)malloc(sizeof(long) * kv->capacity);
+	fwrite(KV_MAGIC, 1, KV_MAGIC_SIZE, out);
+	for (i = 0; i < kv->capacity && !err; i++) {
+		e = &kv->entries[i];
+		if (!e->key)
+			continue;
+		if (!kv_read_value(kv, e, &value)) {
+			err = Error_Type;
+			break;
+		}
+		kv_record(&record, 'P', e->key, e->keylen, value.data, value.len);
+		if (fwrite(record.data, 1, record.len, out) != (size_t)record.len)
+			err = Error_Type;
+		offsets[i] = end;
+		end += record.len;
+	}
+	free(value.data);
+	free(record.data);
+
+	if (!err && fflush(out) != 0)
+		err = Error_Type;
+	if (err) {
+		fclose(out);
+		remove(tmp);
+		free(tmp);
+		free(offsets);
+		return err;
+	}
+#ifdef _WIN32
+	_commit(_fileno(out));
+#else
+	fsync(fileno(out));
+#endif
+
+	fclose(kv->file);
+#ifdef _WIN32
+	remove(kv->path);
+#endif
+	if (rename(tmp, kv->path) != 0) {
+		/* Keep using the old log */
+		fclose(out);
+		remove(tmp);
+		free(tmp);
+		free(offsets);
+		kv->file = fopen(kv->path, "r+b");
+		if (!kv->file)
+			kv_close(kv);
+		return Error_Type;
+	}
+	free(tmp);
+	kv->file = out;
+
+	*result = make_int(kv->end - end);
+	for (i = 0; i < kv->capacity; i++)
+		if (kv->entries[i].key)
+			kv->entries[i].offset = offsets[i];
+	free(offsets);
+	kv->end = end;
+	kv->pending = 0;
+	kv->appending = 0;
+	return Error_OK;
+}
+
+struct KvIterator {
+	struct Iterator iterator;
+	Atom kv;
+	long slot;  /* next slot to look at */
+};
+
+Error kv_iterator_next(struct Iterator *iterator, Atom *result)
+{
+	struct KvIterator *it = (struct KvIterator *)iterator;
+	struct Kv *kv = kv_of(it->kv);
+	struct KvBuffer value = { NULL, 0, 0 };
+	struct KvReader r;
+	struct KvEntry *e;
+	Atom key, item;
+	Error err;
+
+	if (!kv->file)
+		return Error_Type;
+	while (it->slot < kv->capacity && !kv->entries[it->slot].key)
+		it->slot++;
+	if (it->slot >= kv->capacity) {
+		*result = nil;
+		return Error_OK;
+	}
+
+	e = &kv->entries[it->slot++];
+	r.p = e->key;
+	r.end = e->key + e->keylen;
+	err = kv_decode(&r, &key, 0);
+	if (err)
+		return err;
+	if (!kv_read_value(kv, e, &value))
+		err = Error_Type;
+	else {
+		r.p = value.data;
+		r.end = value.data + value.len;
+		err = kv_decode(&r, &item, 0);
+		if (!err)
+			*result = cons(key, item);
+	}
+	free(value.data);
+	return err;
+}
+
+void kv_iterator_mark(struct Iterator *iterator)
+{
+	gc_mark(((struct KvIterator *)iterator)->kv);
+}
+
+/* (kv-scan kv) iterates over the (key . value) pairs */
+Error builtin_kv_scan(Atom args, Atom *result)
+{
+	struct KvIterator *it;
+	struct Kv *kv;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	err = kv_open_arg(args, &kv);
+	if (err)
+		return err;
+
+	it = (struct KvIterator *)malloc(sizeof(struct KvIterator));
+	it->iterator.next = kv_iterator_next;
+	it->iterator.mark = kv_iterator_mark;
+	it->kv = car(args);
+	it->slot = 0;
+	*result = make_iterator(&it->iterator);
+	return Error_OK;
+}
+
+/* Checkpoints.  The evaluator's stack is a list of frames, so a running
+ * computation is just data.  (checkpoint path) writes everything
+ * reachable from the stack, the global environment and the rest of the
+ * REPL line to path, and returns nil; `ToyLisp --resume path` reads it
+ * back and continues from there, with the checkpoint form returning t.
+ * Pairs are written with their evaluator flags, builtins by the names
+ * they were bound to at startup, and memoized functions without their
+ * caches.  Strings, vectors, bit vectors, records, promises and cells
+ * are saved, cells with the cells they depend on; other native objects
+ * such as ports, maps and foreign functions are not, and make checkpoint
+ * fail with a type error, as does a checkpoint taken inside a call from
+ * C code, such as a sort predicate. */
+#define CHECKPOINT_MAGIC "TLCK1\n"
+#define CHECKPOINT_MAGIC_SIZE 6
+
+enum CheckpointTag {
+	CheckpointTag_Nil, CheckpointTag_Int, CheckpointTag_Real, CheckpointTag_Symbol,
+	CheckpointTag_Uninterned, CheckpointTag_Builtin, CheckpointTag_Pair,
+	CheckpointTag_Closure, CheckpointTag_Macro, CheckpointTag_Object,
+	CheckpointTag_Stdout
+};
+
+struct BuiltinName {
+	Builtin fn;
+	char *name;
+};
+
+static struct BuiltinName *builtin_names = NULL;
+static long nbuiltin_names = 0;
+
+/* Remember the names of the builtins bound in env */
+void builtins_record(Atom env)
+{
+	Atom bs;
+
+	for (bs = cdr(env); !nilp(bs); bs = cdr(bs)) {
+		if (cdr(car(bs)).type != AtomType_Builtin)
+			continue;
+		builtin_names = (struct BuiltinName *)realloc(builtin_names,
+			sizeof(struct BuiltinName) * (nbuiltin_names + 1));
+		builtin_names[nbuiltin_names].fn = cdr(car(bs)).value.builtin;
+		builtin_names[nbuiltin_names].name = strdup(car(car(bs)).value.symbol);
+		nbuiltin_names++;
+	}
+}
+
+/* Heap nodes are pair cells and native objects, numbered in the order
+ * they are found */
+struct Checkpoint {
+	Atom *nodes;
+	long count, cap;
+	void **keys;  /* open addressing: node address -> index + 1 */
+	long *ids;
+	long table_size;
+	struct KvBuffer out;
+};
+
+void *checkpoint_key(Atom a)
+{
+	switch (a.type) {
+	case AtomType_Pair:
+	case AtomType_Closure:
+	case AtomType_Macro:
+		return allocation_of(a);
+	case AtomType_Nil:
+	case AtomType_Integer:
+	case AtomType_Real:
+	case AtomType_Symbol:
+	case AtomType_Builtin:
+		return NULL;
+	default:
+		return a.value.object;
+	}
+}
+
+long *checkpoint_slot(struct Checkpoint *c, void *key)
+{
+	unsigned long i = ((unsigned long)(size_t)key >> 4) & (c->table_size - 1);
+
+	while (c->keys[i] && c->keys[i] != key)
+		i = (i + 1) & (c->table_size - 1);
+	c->keys[i] = key;
+	return &c->ids[i];
+}
+
+/* The index of the node of a, adding it if new */
+long checkpoint_node(struct Checkpoint *c, Atom a)
+{
+	long *id, i;
+
+	if (2 * (c->count + 1) > c->table_size) {
+		void **keys = c->keys;
+		long *ids = c->ids, n = c->table_size;
+
+		c->table_size = n ? n * 2 : 1024;
+		c->keys = (void **)calloc(c->table_size, sizeof(void *));
+		c->ids = (long *)calloc(c->table_size, sizeof(long));
+		for (i = 0; i < n; i++)
+			if (keys[i])
+				*checkpoint_slot(c, keys[i]) = ids[i];
+		free(keys);
+		free(ids);
+	}
+
+	id = checkpoint_slot(c, checkpoint_key(a));
+	if (*id == 0) {
+		if (c->count == c->cap) {
+			c->cap = c->cap ? c->cap * 2 : 1024;
+			c->nodes = (Atom *)realloc(c->nodes, sizeof(Atom) * c->cap);
+		}
+		if (a.type == AtomType_Closure || a.type == AtomType_Macro)
+			a.type = AtomType_Pair;
+		c->nodes[c->count++] = a;
+		*id = c->count;
+	}
+	return *id - 1;
+}
+
+Error checkpoint_atom(struct Checkpoint *c, Atom a)
+{
+	struct KvBuffer *b = &c->out;
+	long i;
+
+	switch (a.type) {
+	case AtomType_Nil:
+		kv_put_byte(b, CheckpointTag_Nil);
+		return Error_OK;
+	case AtomType_Integer:
+		kv_put_byte(b, CheckpointTag_Int);
+		kv_put_int(b, a.value.integer);
+		return Error_OK;
+	case AtomType_Real:
+		kv_put_byte(b, CheckpointTag_Real);
+		kv_put_real(b, a.value.real);
+		return Error_OK;
+	case AtomType_Symbol:
+		kv_put_byte(b, a.value.symbol == sym_fixnum.value.symbol
+			|| a.value.symbol == sym_fixnum_guard.value.symbol
+			|| a.value.symbol == sym_memo.value.symbol
+			|| a.value.symbol == sym_values.value.symbol
+			|| a.value.symbol == sym_eof.value.symbol
+			? CheckpointTag_Uninterned : CheckpointTag_Symbol);
+		kv_put_varint(b, strlen(a.value.symbol));
+		kv_put_bytes(b, a.value.symbol, (long)strlen(a.value.symbol));
+		return Error_OK;
+	case AtomType_Builtin:
+		for (i = 0; i < nbuiltin_names; i++) {
+			if (builtin_names[i].fn == a.value.builtin) {
+				kv_put_byte(b, CheckpointTag_Builtin);
+				kv_put_varint(b, strlen(builtin_names[i].name));
+				kv_put_bytes(b, builtin_names[i].name, (long)strlen(builtin_names[i].name));
+				return Error_OK;
+			}
+		}
+		return Error_Type;
+	case AtomType_Port:
+		if (a.value.object != stdout_port.value.object)
+			return Error_Type;
+		kv_put_byte(b, CheckpointTag_Stdout);
+		return Error_OK;
+	case AtomType_Pair:
+		kv_put_byte(b, CheckpointTag_Pair);
+		break;
+	case AtomType_Closure:
+		kv_put_byte(b, CheckpointTag_Closure);
+		break;
+	case AtomType_Macro:
+		kv_put_byte(b, CheckpointTag_Macro);
+		break;
+	case AtomType_String:
+	case AtomType_Vector:
+	case AtomType_Bitvec:
+	case AtomType_Memo:
+	case AtomType_Record:
+	case AtomType_Promise:
+	case AtomType_Cell:
+		kv_put_byte(b, CheckpointTag_Object);
+		break;
+	default:
+		return Error_Type;
+	}
+	kv_put_varint(b, checkpoint_node(c, a));
+	return Error_OK;
+}
+
+/* A node's kind and contents that need no other nodes */
+void checkpoint_header(struct Checkpoint *c, Atom a)
+{
+	struct KvBuffer *b = &c->out;
+	struct Allocation *p;
+	struct Vector *v;
+	struct Bitvec *bv;
+	struct Memo *m;
+	struct CellLink *l;
+	long i;
+
+	kv_put_byte(b, a.type);
+	switch (a.type) {
+	case AtomType_Pair:
+		p = allocation_of(a);
+		kv_put_byte(b, (p->analyzed ? 1 : 0) | (p->noescape ? 2 : 0)
+			| (p->release ? 4 : 0) | (p->captured ? 8 : 0)
+			| (p->owned ? 16 : 0) | (p->proper ? 32 : 0)
+			| (p->applied ? 64 : 0) | (p->open ? 128 : 0));
+		break;
+	case AtomType_String:
+		kv_put_varint(b, string_of(a)->length);
+		kv_put_bytes(b, string_of(a)->chars, string_of(a)->length);
+		break;
+	case AtomType_Vector:
+		v = vector_of(a);
+		kv_put_byte(b, v->kind);
+		kv_put_varint(b, v->length);
+		for (i = 0; i < v->length; i++) {
+			if (v->kind == VectorKind_Ints)
+				kv_put_int(b, v->ints[i]);
+			else if (v->kind == VectorKind_Reals)
+				kv_put_real(b, v->reals[i]);
+		}
+		break;
+	case AtomType_Bitvec:
+		bv = bitvec_of(a);
+		kv_put_varint(b, bv->nwords);
+		for (i = 0; i < bv->nwords; i++) {
+			kv_put_varint(b, (unsigned long)(bv->words[i] & 0xffffffffUL));
+			kv_put_varint(b, (unsigned long)(bv->words[i] >> 32));
+		}
+		break;
+	case AtomType_Memo:
+		m = (struct Memo *)a.value.object;
+		kv_put_byte(b, m->eq);
+		kv_put_varint(b, m->size);
+		break;
+	case AtomType_Record:
+		kv_put_varint(b, record_of(a)->length);
+		break;
+	case AtomType_Promise:
+		kv_put_byte(b, ((struct Promise *)a.value.object)->forced);
+		break;
+	case AtomType_Cell:
+		kv_put_byte(b, ((struct Cell *)a.value.object)->dirty);
+		for (i = 0, l = ((struct Cell *)a.value.object)->deps; l; l = l->next)
+			i++;
+		kv_put_varint(b, i);
+		break;
+	default:
+		break;
+	}
+}
+
+Error checkpoint_body(struct Checkpoint *c, Atom a)
+{
+	struct Vector *v;
+	struct Cell *cell;
+	struct CellLink *l;
+	long i;
+	Error err = Error_OK;
+
+	switch (a.type) {
+	case AtomType_Pair:
+		err = checkpoint_atom(c, car(a));
+		if (!err)
+			err = checkpoint_atom(c, cdr(a));
+		break;
+	case AtomType_Vector:
+		v = vector_of(a);
+		if (v->kind == VectorKind_Atoms)
+			for (i = 0; i < v->length && !err; i++)
+				err = checkpoint_atom(c, v->items[i]);
+		break;
+	case AtomType_Memo:
+		err = checkpoint_atom(c, ((struct Memo *)a.value.object)->fn);
+		break;
+	case AtomType_Record:
+		err = checkpoint_atom(c, record_of(a)->tag);
+		for (i = 0; i < record_of(a)->length && !err; i++)
+			err = checkpoint_atom(c, record_of(a)->slots[i]);
+		break;
+	case AtomType_Promise:
+		err = checkpoint_atom(c, ((struct Promise *)a.value.object)->value);
+		if (!err)
+			err = checkpoint_atom(c, ((struct Promise *)a.value.object)->thunk);
+		break;
+	case AtomType_Cell:
+		cell = (struct Cell *)a.value.object;
+		err = checkpoint_atom(c, cell->value);
+		if (!err)
+			err = checkpoint_atom(c, cell->thunk);
+		for (l = cell->deps; l != NULL && !err; l = l->next) {
+			Atom dep;
+
+			dep.type = AtomType_Cell;
+			dep.value.object = &l->cell->object;
+			err = checkpoint_atom(c, dep);
+		}
+		break;
+	default:
+		break;
+	}
+	return err;
+}
+
+/* Write the continuation stack, with the REPL's state, to path */
+Error checkpoint_write(Atom path, Atom stack)
+{
+	struct Checkpoint c;
+	struct KvBuffer roots = { NULL, 0, 0 };
+	Atom root[4];
+	char *tmp;
+	FILE *file;
+	long i, done;
+	Error err = Error_OK;
+
+	if (path.type != AtomType_String)
+		return Error_Type;
+
+	memset(&c, 0, sizeof(c));
+	root[0] = toplevel_env;
+	root[1] = stack;
+	root[2] = toplevel_rest;
+	root[3] = inline_deps;
+
+	/* Number the nodes; bodies refer to nodes by number, which appends
+	 * the ones not yet seen */
+	for (i = 0; i < 4 && !err; i++)
+		err = checkpoint_atom(&c, root[i]);
+	roots = c.out;
+	memset(&c.out, 0, sizeof(c.out));
+	for (done = 0; done < c.count && !err; done++)
+		err = checkpoint_body(&c, c.nodes[done]);
+	if (!err) {
+		struct KvBuffer bodies = c.out;
+
+		memset(&c.out, 0, sizeof(c.out));
+		kv_put_bytes(&c.out, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE);
+		kv_put_varint(&c.out, c.count);
+		for (i = 0; i < c.count; i++)
+			checkpoint_header(&c, c.nodes[i]);
+		kv_put_bytes(&c.out, bodies.data, bodies.len);
+		kv_put_bytes(&c.out, roots.data, roots.len);
+		free(bodies.data);
+
+		tmp = (char *)malloc(strlen(string_of(path)->chars) + 5);
+		sprintf(tmp, "%s.tmp", string_of(path)->chars);
+		file = fopen(tmp, "wb");
+		if (!file || fwrite(c.out.data, 1, c.out.len, file) != (size_t)c.out.len
+			|| fflush(file) != 0)
+			err = Error_Type;
+		if (file) {
+#ifdef _WIN32
+			_commit(_fileno(file));
+#else
+			fsync(fileno(file));
+#endif
+			fclose(file);
+		}
+#ifdef _WIN32
+		if (!err)
+			remove(string_of(path)->chars);
+#endif
+		if (!err && rename(tmp, string_of(path)->chars) != 0)
+			err = Error_Type;
+		if (err)
+			remove(tmp);
+		free(tmp);
 	}
-	if (!nilp(args))
-		return Error_Args;
 
-	/* Evaluate the body */
-	while (!nilp(body)) {
-		Error err = eval_expr(car(body), env, result);
+	free(roots.data);
+	free(c.out.data);
+	free(c.nodes);
+	free(c.keys);
+	free(c.ids);
+	return err;
+}
+
+struct CheckpointReader {
+	struct KvReader r;
+	Atom *nodes;
+	long count;
+};
+
+Error checkpoint_read_name(struct KvReader *r, char **name)
+{
+	unsigned long n;
+
+	if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+		return Error_Syntax;
+	*name = (char *)malloc(n + 1);
+	memcpy(*name, r->p, n);
+	(*name)[n] = '\0';
+	r->p += n;
+	return Error_OK;
+}
+
+Error checkpoint_read_atom(struct CheckpointReader *c, Atom *result)
+{
+	struct KvReader *r = &c->r;
+	unsigned long id;
+	char *name;
+	long i;
+	int tag;
+	Error err;
+
+	if (r->p == r->end)
+		return Error_Syntax;
+	tag = *r->p++;
+	switch (tag) {
+	case CheckpointTag_Nil:
+		*result = nil;
+		return Error_OK;
+	case CheckpointTag_Int:
+		*result = make_int(0);
+		return kv_get_int(r, &result->value.integer) ? Error_OK : Error_Syntax;
+	case CheckpointTag_Real:
+		*result = make_real(0);
+		return kv_get_real(r, &result->value.real) ? Error_OK : Error_Syntax;
+	case CheckpointTag_Symbol:
+	case CheckpointTag_Uninterned:
+	case CheckpointTag_Builtin:
+		err = checkpoint_read_name(r, &name);
 		if (err)
 			return err;
-		body = cdr(body);
+		if (tag == CheckpointTag_Symbol)
+			*result = make_sym(name);
+		else if (tag == CheckpointTag_Uninterned) {
+			Atom specials[5];
+
+			specials[0] = sym_fixnum;
+			specials[1] = sym_fixnum_guard;
+			specials[2] = sym_memo;
+			specials[3] = sym_eof;
+			specials[4] = sym_values;
+			err = Error_Syntax;
+			for (i = 0; i < 5; i++) {
+				if (strcmp(specials[i].value.symbol, name) == 0) {
+					*result = specials[i];
+					err = Error_OK;
+				}
+			}
+		}
+		else {
+			err = Error_Unbound;
+			for (i = 0; i < nbuiltin_names; i++) {
+				if (strcmp(builtin_names[i].name, name) == 0) {
+					*result = make_builtin(builtin_names[i].fn);
+					err = Error_OK;
+					break;
+				}
+			}
+		}
+		free(name);
+		return err;
+	case CheckpointTag_Stdout:
+		port_stdout();
+		*result = stdout_port;
+		return Error_OK;
+	case CheckpointTag_Pair:
+	case CheckpointTag_Closure:
+	case CheckpointTag_Macro:
+	case CheckpointTag_Object:
+		if (!kv_get_varint(r, &id) || id >= (unsigned long)c->count)
+			return Error_Syntax;
+		*result = c->nodes[id];
+		if ((tag == CheckpointTag_Object) != (result->type != AtomType_Pair))
+			return Error_Syntax;
+		if (tag == CheckpointTag_Closure)
+			result->type = AtomType_Closure;
+		else if (tag == CheckpointTag_Macro)
+			result->type = AtomType_Macro;
+		return Error_OK;
+	default:
+		return Error_Syntax;
+	}
+}
+
+Error checkpoint_read_header(struct KvReader *r, Atom *result)
+{
+	struct Allocation *p;
+	struct Vector *v;
+	struct Bitvec *bv;
+	struct Cell *cell;
+	unsigned long n, lo, hi, i;
+	int type, flags;
+
+	if (r->end - r->p < 2)
+		return Error_Syntax;
+	type = *r->p++;
+	switch (type) {
+	case AtomType_Pair:
+		flags = *r->p++;
+		*result = cons(nil, nil);
+		p = allocation_of(*result);
+		p->analyzed = (flags & 1) != 0;
+		p->noescape = (flags & 2) != 0;
+		p->release = (flags & 4) != 0;
+		p->captured = (flags & 8) != 0;
+		p->owned = (flags & 16) != 0;
+		p->proper = (flags & 32) != 0;
+		p->applied = (flags & 64) != 0;
+		p->open = (flags & 128) != 0;
+		return Error_OK;
+	case AtomType_String:
+		if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_string((const char *)r->p, (long)n);
+		r->p += n;
+		return Error_OK;
+	case AtomType_Vector:
+		/* Every element takes at least one byte */
+		flags = *r->p++;
+		if (flags > VectorKind_Reals || !kv_get_varint(r, &n)
+			|| n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_typed_vector((enum VectorKind)flags, (long)n);
+		v = vector_of(*result);
+		for (i = 0; i < n && flags != VectorKind_Atoms; i++) {
+			if (flags == VectorKind_Ints ? !kv_get_int(r, &v->ints[i])
+					: !kv_get_real(r, &v->reals[i]))
+				return Error_Syntax;
+		}
+		return Error_OK;
+	case AtomType_Bitvec:
+		if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_bitvec((long)n);
+		bv = bitvec_of(*result);
+		for (i = 0; i < n; i++) {
+			if (!kv_get_varint(r, &lo) || !kv_get_varint(r, &hi))
+				return Error_Syntax;
+			bv->words[i] = (BitWord)(lo & 0xffffffffUL) | (BitWord)hi << 32;
+		}
+		return Error_OK;
+	case AtomType_Memo:
+		flags = *r->p++;
+		if (!kv_get_varint(r, &n))
+			return Error_Syntax;
+		*result = make_memo(nil, flags, (long)n);
+		return Error_OK;
+	case AtomType_Record:
+		/* The tag and every slot take at least one byte each */
+		if (!kv_get_varint(r, &n) || n >= (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_record(nil, (long)n);
+		return Error_OK;
+	case AtomType_Promise:
+		*result = make_promise_thunk(nil);
+		((struct Promise *)result->value.object)->forced = *r->p++ != 0;
+		return Error_OK;
+	case AtomType_Cell:
+		/* The links are filled in with the body; each takes a byte */
+		flags = *r->p++;
+		if (!kv_get_varint(r, &n) || n > (unsigned long)(r->end - r->p))
+			return Error_Syntax;
+		*result = make_cell(nil, nil);
+		cell = (struct Cell *)result->value.object;
+		cell->dirty = flags != 0;
+		for (i = 0; i < n; i++)
+			cell_link(&cell->deps, NULL);
+		return Error_OK;
+	default:
+		return Error_Syntax;
+	}
+}
+
+Error checkpoint_read_body(struct CheckpointReader *c, Atom a)
+{
+	struct Vector *v;
+	struct Cell *cell;
+	struct CellLink *l;
+	long i;
+	Error err = Error_OK;
+
+	switch (a.type) {
+	case AtomType_Pair:
+		err = checkpoint_read_atom(c, &car(a));
+		if (!err)
+			err = checkpoint_read_atom(c, &cdr(a));
+		break;
+	case AtomType_Vector:
+		v = vector_of(a);
+		if (v->kind == VectorKind_Atoms)
+			for (i = 0; i < v->length && !err; i++)
+				err = checkpoint_read_atom(c, &v->items[i]);
+		break;
+	case AtomType_Memo:
+		err = checkpoint_read_atom(c, &((struct Memo *)a.value.object)->fn);
+		break;
+	case AtomType_Record:
+		err = checkpoint_read_atom(c, &record_of(a)->tag);
+		for (i = 0; i < record_of(a)->length && !err; i++)
+			err = checkpoint_read_atom(c, &record_of(a)->slots[i]);
+		break;
+	case AtomType_Promise:
+		err = checkpoint_read_atom(c, &((struct Promise *)a.value.object)->value);
+		if (!err)
+			err = checkpoint_read_atom(c, &((struct Promise *)a.value.object)->thunk);
+		break;
+	case AtomType_Cell:
+		/* Dependents are not saved; they are the reverse links */
+		cell = (struct Cell *)a.value.object;
+		err = checkpoint_read_atom(c, &cell->value);
+		if (!err)
+			err = checkpoint_read_atom(c, &cell->thunk);
+		for (l = cell->deps; l != NULL && !err; l = l->next) {
+			Atom dep;
+
+			err = checkpoint_read_atom(c, &dep);
+			if (!err && dep.type != AtomType_Cell)
+				err = Error_Syntax;
+			if (!err) {
+				l->cell = (struct Cell *)dep.value.object;
+				cell_link(&l->cell->dependents, cell);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	return err;
+}
+
+/* Read a checkpoint into root: the global environment, the stack, the
+ * rest of the REPL line and the inlining dependencies */
+Error checkpoint_read(const char *path, Atom root[4])
+{
+	struct CheckpointReader c;
+	unsigned char *data;
+	unsigned long n;
+	FILE *file;
+	long len, i;
+	Error err = Error_OK;
+
+	file = fopen(path, "rb");
+	if (!file)
+		return Error_Type;
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	data = (unsigned char *)malloc(len > 0 ? len : 1);
+	if (len < CHECKPOINT_MAGIC_SIZE || fread(data, 1, len, file) != (size_t)len
+		|| memcmp(data, CHECKPOINT_MAGIC, CHECKPOINT_MAGIC_SIZE) != 0) {
+		fclose(file);
+		free(data);
+		return Error_Syntax;
+	}
+	fclose(file);
+
+	c.r.p = data + CHECKPOINT_MAGIC_SIZE;
+	c.r.end = data + len;
+	/* Every node takes at least two bytes */
+	if (!kv_get_varint(&c.r, &n) || n > (unsigned long)(c.r.end - c.r.p)) {
+		free(data);
+		return Error_Syntax;
+	}
+	c.count = (long)n;
+	c.nodes = (Atom *)malloc(sizeof(Atom) * (n > 0 ? n : 1));
+	for (i = 0; i < c.count && !err; i++)
+		err = checkpoint_read_header(&c.r, &c.nodes[i]);
+	for (i = 0; i < c.count && !err; i++)
+		err = checkpoint_read_body(&c, c.nodes[i]);
+	for (i = 0; i < 4 && !err; i++)
+		err = checkpoint_read_atom(&c, &root[i]);
+
+	free(c.nodes);
+	free(data);
+	return err;
+}
+
+/* Reactive cells.  (cell v) makes an input cell and (computed thunk) a
+ * cell whose value is (thunk).  (cell-ref c) returns the value, first
+ * recomputing a computed cell if it is dirty; reads made while a thunk
+ * runs are recorded as its dependencies.  (cell-set! c v) changes an
+ * input cell and marks everything that depends on it dirty, so only what
+ * is read again is recomputed.  Cells keep their dependencies alive but
+ * not their dependents; gc() drops links to dependents it frees. */
+static struct Cell *all_cells = NULL;
+static struct Cell *cell_reader = NULL;  /* being computed */
+
+struct Cell *cell_of(Atom a)
+{
+	return (struct Cell *)a.value.object;
+}
+
+Atom make_cell(Atom value, Atom thunk)
+{
+	struct Cell *c = (struct Cell *)malloc(sizeof(struct Cell));
+
+	c->value = value;
+	c->thunk = thunk;
+	c->dirty = !nilp(thunk);
+	c->computing = 0;
+	c->deps = NULL;
+	c->dependents = NULL;
+	c->prev = NULL;
+	c->next = all_cells;
+	if (all_cells)
+		all_cells->prev = c;
+	all_cells = c;
+	return make_object(&c->object, AtomType_Cell);
+}
+
+void cell_link(struct CellLink **list, struct Cell *cell)
+{
+	struct CellLink *l = (struct CellLink *)malloc(sizeof(struct CellLink));
+
+	l->cell = cell;
+	l->next = *list;
+	*list = l;
+}
+
+void cell_unlink(struct CellLink **list, struct Cell *cell)
+{
+	struct CellLink *l;
+
+	for (; *list != NULL; list = &(*list)->next) {
+		if ((*list)->cell == cell) {
+			l = *list;
+			*list = l->next;
+			free(l);
+			return;
+		}
+	}
+}
+
+void cell_links_free(struct CellLink *l)
+{
+	struct CellLink *next;
+
+	for (; l != NULL; l = next) {
+		next = l->next;
+		free(l);
+	}
+}
+
+/* Forget what c read last time */
+void cell_clear_deps(struct Cell *c)
+{
+	struct CellLink *l;
+
+	for (l = c->deps; l != NULL; l = l->next)
+		cell_unlink(&l->cell->dependents, c);
+	cell_links_free(c->deps);
+	c->deps = NULL;
+}
+
+void cell_mark(struct Cell *c)
+{
+	struct CellLink *l;
+
+	gc_mark(c->value);
+	gc_mark(c->thunk);
+	for (l = c->deps; l != NULL; l = l->next)
+		object_mark(&l->cell->object);
+}
+
+void cell_free(struct Cell *c)
+{
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		all_cells = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	cell_links_free(c->deps);
+	cell_links_free(c->dependents);
+	free(c);
+}
+
+/* Before a sweep: drop links from live cells to dependents about to be
+ * freed.  A live cell's dependencies are always marked. */
+void cells_prune(void)
+{
+	struct Cell *c;
+	struct CellLink **l, *dead;
+
+	for (c = all_cells; c != NULL; c = c->next) {
+		if (!c->object.mark)
+			continue;
+		l = &c->dependents;
+		while (*l != NULL) {
+			if (!(*l)->cell->object.mark) {
+				dead = *l;
+				*l = dead->next;
+				free(dead);
+			}
+			else {
+				l = &(*l)->next;
+			}
+		}
+	}
+}
+
+/* Mark the cells that depend on c dirty, transitively */
+void cell_invalidate(struct Cell *c)
+{
+	struct Cell **stack, *d;
+	struct CellLink *l;
+	long n = 0, cap = 16;
+
+	stack = (struct Cell **)malloc(sizeof(struct Cell *) * cap);
+	stack[n++] = c;
+	while (n > 0) {
+		d = stack[--n];
+		for (l = d->dependents; l != NULL; l = l->next) {
+			if (l->cell->dirty)
+				continue;
+			l->cell->dirty = 1;
+			if (n == cap) {
+				cap *= 2;
+				stack = (struct Cell **)realloc(stack, sizeof(struct Cell *) * cap);
+			}
+			stack[n++] = l->cell;
+		}
+	}
+	free(stack);
+}
+
+Error cell_value(Atom a, Atom *result)
+{
+	struct Cell *c = cell_of(a), *reader = cell_reader;
+	struct CellLink *l;
+	struct Root *roots = gc_roots, r;
+	Error err;
+
+	if (c->dirty) {
+		if (c->computing)
+			return Error_Type;  /* depends on itself */
+		cell_clear_deps(c);
+		gc_protect(&r, &a);
+		c->computing = 1;
+		cell_reader = c;
+		err = apply(c->thunk, nil, result);
+		cell_reader = reader;
+		c->computing = 0;
+		gc_roots = roots;
+		if (err)
+			return err;
+		c->value = *result;
+		c->dirty = 0;
+	}
+
+	if (reader) {
+		for (l = reader->deps; l != NULL && l->cell != c; l = l->next)
+			;
+		if (!l) {
+			cell_link(&reader->deps, c);
+			cell_link(&c->dependents, reader);
+		}
 	}
+	*result = c->value;
+	return Error_OK;
+}
+
+Error builtin_cell(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	*result = make_cell(car(args), nil);
+	return Error_OK;
+}
+
+/* (computed thunk) is computed when first read */
+Error builtin_computed(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (nilp(car(args)))
+		return Error_Type;
+	*result = make_cell(nil, car(args));
+	return Error_OK;
+}
+
+Error builtin_cell_ref(Atom args, Atom *result)
+{
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+	if (car(args).type != AtomType_Cell)
+		return Error_Type;
+	return cell_value(car(args), result);
+}
+
+/* (cell-set! c v) returns v; setting a cell to an eq? value changes
+ * nothing */
+Error builtin_cell_set(Atom args, Atom *result)
+{
+	struct Cell *c;
+
+	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+		return Error_Args;
+	if (car(args).type != AtomType_Cell || !nilp(cell_of(car(args))->thunk))
+		return Error_Type;
 
+	c = cell_of(car(args));
+	*result = car(cdr(args));
+	if (eqp(c->value, *result))
+		return Error_OK;
+	c->value = *result;
+	cell_invalidate(c);
 	return Error_OK;
+}
+
+/* Promises.  The special form (delay expr) keeps expr as a thunk closed
+ * over the current environment.  (force p) calls the thunk once and keeps
+ * the value; forcing anything that is not a promise returns it unchanged. */
+void promise_mark(struct Promise *p)
+{
+	gc_mark(p->value);
+	gc_mark(p->thunk);
+}
+
+Atom make_promise_thunk(Atom thunk)
+{
+	struct Promise *p = (struct Promise *)malloc(sizeof(struct Promise));
+
+	p->value = nil;
+	p->thunk = thunk;
+	p->forced = 0;
+	return make_object(&p->object, AtomType_Promise);
+}
+
+Error make_promise(Atom env, Atom body, Atom *result)
+{
+	Atom thunk;
+	Error err;
+
+	err = make_closure(env, nil, body, &thunk);
+	if (!err)
+		*result = make_promise_thunk(thunk);
+	return err;
+}
 
+Error builtin_force(Atom args, Atom *result)
+{
+	struct Promise *p;
+	struct Root *roots = gc_roots, r;
+	Atom a;
+	Error err;
+
+	if (nilp(args) || !nilp(cdr(args)))
+		return Error_Args;
+
+	a = car(args);
+	if (a.type != AtomType_Promise) {
+		*result = a;
+		return Error_OK;
+	}
+
+	p = (struct Promise *)a.value.object;
+	if (!p->forced) {
+		gc_protect(&r, &a);
+		err = apply(p->thunk, nil, result);
+		gc_roots = roots;
+		if (err)
+			return err;
+		/* The thunk may have forced p itself; the first value wins */
+		if (!p->forced) {
+			p->value = *result;
+			p->thunk = nil;
+			p->forced = 1;
+		}
+	}
+	*result = p->value;
+	return Error_OK;
 }
 
-Error builtin_car(Atom args, Atom *result)
+Error builtin_promisep(Atom args, Atom *result)
 {
 	if (nilp(args) || !nilp(cdr(args)))
 		return Error_Args;
-
-	if (nilp(car(args)))
-		*result = nil;
-	else if (car(args).type != AtomType_Pair)
-		return Error_Type;
-	else
-		*result = car(car(args));
-
+	*result = car(args).type == AtomType_Promise ? sym_t : nil;
 	return Error_OK;
 }
 
-Error builtin_cdr(Atom args, Atom *result)
+/* Records.  (define-record point x y), a macro in library.lisp, calls
+ * (record-define 'point '(x y)), which defines make-point, point?, point-x,
+ * point-y, set-point-x! and set-point-y! in the global environment.  The
+ * tag of a point is the symbol point; the accessors check it, so they can
+ * index the slots without looking up field names. */
+Atom make_record(Atom tag, long length)
 {
-	if (nilp(args) || !nilp(cdr(args)))
-		return Error_Args;
+	struct Record *r = (struct Record *)malloc(sizeof(struct Record)
+		+ sizeof(Atom) * (length > 0 ? length - 1 : 0));
+	long i;
+
+	r->tag = tag;
+	r->length = length;
+	for (i = 0; i < length; i++)
+		r->slots[i] = nil;
+	return make_object(&r->object, AtomType_Record);
+}
 
-	if (nilp(car(args)))
-		*result = nil;
-	else if (car(args).type != AtomType_Pair)
-		return Error_Type;
-	else
-		*result = cdr(car(args));
+struct Record *record_of(Atom a)
+{
+	return (struct Record *)a.value.object;
+}
 
-	return Error_OK;
+void record_mark(struct Record *r)
+{
+	long i;
+
+	gc_mark(r->tag);
+	for (i = 0; i < r->length; i++)
+		gc_mark(r->slots[i]);
 }
 
-Error builtin_cons(Atom args, Atom *result)
+/* (record tag x ...) */
+Error builtin_record(Atom args, Atom *result)
 {
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
-		return Error_Args;
+	struct Record *r;
+	Atom p;
+	long n = 0;
 
-	*result = cons(car(args), car(cdr(args)));
+	if (nilp(args))
+		return Error_Args;
+	for (p = cdr(args); !nilp(p); p = cdr(p))
+		n++;
 
+	*result = make_record(car(args), n);
+	r = record_of(*result);
+	for (p = cdr(args), n = 0; !nilp(p); p = cdr(p))
+		r->slots[n++] = car(p);
 	return Error_OK;
 }
 
-Error builtin_add(Atom args, Atom *result)
+/* (record? x [tag]) */
+Error builtin_recordp(Atom args, Atom *result)
 {
-	Atom a, b;
+	Atom x;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+	if (nilp(args) || (!nilp(cdr(args)) && !nilp(cdr(cdr(args)))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	x = car(args);
+	*result = x.type == AtomType_Record
+		&& (nilp(cdr(args)) || eqp(record_of(x)->tag, car(cdr(args))))
+		? sym_t : nil;
+	return Error_OK;
+}
+
+/* The slot of (r tag i ...) that record-ref and record-set! use */
+Error record_slot(Atom args, Atom **slot)
+{
+	struct Record *r;
+	Atom i;
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
+	if (car(args).type != AtomType_Record)
+		return Error_Type;
+	r = record_of(car(args));
+	i = car(cdr(cdr(args)));
+	if (!eqp(r->tag, car(cdr(args))) || i.type != AtomType_Integer
+		|| i.value.integer < 0 || i.value.integer >= r->length)
 		return Error_Type;
+	*slot = &r->slots[i.value.integer];
+	return Error_OK;
+}
+
+/* (record-ref r tag i) */
+Error builtin_record_ref(Atom args, Atom *result)
+{
+	Atom *slot;
+	Error err;
 
-	*result = make_int(a.value.integer + b.value.integer);
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
 
-	return Error_OK;
+	err = record_slot(args, &slot);
+	if (!err)
+		*result = *slot;
+	return err;
 }
 
-Error builtin_subtract(Atom args, Atom *result)
+/* (record-set! r tag i x) returns x */
+Error builtin_record_set(Atom args, Atom *result)
 {
-	Atom a, b;
+	Atom *slot;
+	Error err;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| nilp(cdr(cdr(cdr(args)))) || !nilp(cdr(cdr(cdr(cdr(args))))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	err = record_slot(args, &slot);
+	if (!err)
+		*slot = *result = car(cdr(cdr(cdr(args))));
+	return err;
+}
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
-		return Error_Type;
+/* The symbol fmt names for a record type and field */
+Atom record_name(const char *fmt, const char *type, const char *field)
+{
+	char *s = (char *)malloc(strlen(fmt) + strlen(type) + strlen(field) + 1);
+	Atom sym;
 
-	*result = make_int(a.value.integer - b.value.integer);
+	sprintf(s, fmt, type, field);
+	sym = make_sym(s);
+	free(s);
+	return sym;
+}
 
-	return Error_OK;
+/* Define name in the global environment as (lambda params body) */
+Error record_define_fn(Atom name, Atom params, Atom body)
+{
+	Atom fn;
+	Error err;
+
+	err = make_closure(toplevel_env, params, cons(body, nil), &fn);
+	if (!err)
+		err = env_define(toplevel_env, name, fn);
+	return err;
 }
 
-Error builtin_multiply(Atom args, Atom *result)
+/* (record-define name fields) returns name */
+Error builtin_record_define(Atom args, Atom *result)
 {
-	Atom a, b;
+	Atom name, fields, p, tag, r, v, index;
+	const char *s, *f;
+	long i;
+	Error err;
 
 	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
-
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
+	name = car(args);
+	fields = car(cdr(args));
+	if (name.type != AtomType_Symbol || !listp(fields))
 		return Error_Type;
+	for (p = fields; !nilp(p); p = cdr(p))
+		if (car(p).type != AtomType_Symbol || memq(car(p), cdr(p)))
+			return Error_Type;
+
+	/* The builtins themselves, so neither fields nor globals shadow them */
+	s = name.value.symbol;
+	tag = cons(sym_quote, cons(name, nil));
+	r = make_sym("r");
+	v = make_sym("v");
+
+	err = record_define_fn(record_name("make-%s", s, ""), fields,
+		cons(make_builtin(builtin_record), cons(tag, fields)));
+	if (!err)
+		err = record_define_fn(record_name("%s?", s, ""), cons(r, nil),
+			cons(make_builtin(builtin_recordp), cons(r, cons(tag, nil))));
+	for (p = fields, i = 0; !nilp(p) && !err; p = cdr(p), i++) {
+		f = car(p).value.symbol;
+		index = make_int(i);
+		err = record_define_fn(record_name("%s-%s", s, f), cons(r, nil),
+			cons(make_builtin(builtin_record_ref),
+				cons(r, cons(tag, cons(index, nil)))));
+		if (!err)
+			err = record_define_fn(record_name("set-%s-%s!", s, f),
+				cons(r, cons(v, nil)),
+				cons(make_builtin(builtin_record_set),
+					cons(r, cons(tag, cons(index, cons(v, nil))))));
+	}
+	*result = name;
+	return err;
+}
+
+/* Multiple values.  (values x y ...) copies its arguments into
+ * value_regs and returns a marker atom instead of a list.  The marker
+ * holds the number of the values call that made it, so a marker kept
+ * past the next call to values is detected rather than misread.
+ * (call-with-values producer consumer) applies consumer to the values
+ * of (producer), and (receive formals expr body ...) in library.lisp is
+ * shorthand for it.  The evaluator runs it without recursion: the frame
+ * of the call waits for the producer and is then reused for the
+ * consumer (values_apply), so the consumer is called in tail position;
+ * the builtin below serves apply from C. */
+Error builtin_values(Atom args, Atom *result)
+{
+	Atom p;
+	int n = 0;
 
-	*result = make_int(a.value.integer * b.value.integer);
+	if (!nilp(args) && nilp(cdr(args))) {
+		*result = car(args);
+		return Error_OK;
+	}
+
+	for (p = args; !nilp(p); p = cdr(p)) {
+		if (n == VALUES_MAX)
+			return Error_Args;
+		value_regs[n++] = car(p);
+	}
+	value_count = n;
+	value_generation++;
 
+	result->type = AtomType_Values;
+	result->value.integer = value_generation;
 	return Error_OK;
 }
 
-Error builtin_divide(Atom args, Atom *result)
+Error builtin_call_with_values(Atom args, Atom *result)
 {
-	Atom a, b;
+	Atom consumer, values = nil;
+	struct Root *roots = gc_roots, r[2];
+	int i;
+	Error err;
 
 	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	consumer = car(cdr(args));
+	gc_protect(&r[0], &consumer);
+	err = apply(car(args), nil, result);
+	if (!err && result->type == AtomType_Values) {
+		if (result->value.integer != value_generation)
+			err = Error_Type;
+		for (i = value_count - 1; i >= 0 && !err; i--)
+			values = cons(value_regs[i], values);
+	}
+	else if (!err) {
+		values = cons(*result, nil);
+	}
+	if (!err) {
+		gc_protect(&r[1], &values);
+		err = apply(consumer, values, result);
+	}
+	gc_roots = roots;
+	return err;
+}
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
-		return Error_Type;
+/* Weak tables.  (make-weak-table) makes a mutable hash table whose keys,
+ * compared with eq?, do not keep the entries alive: once a key is
+ * referenced from nowhere else, gc() removes its entry.  A value is only
+ * kept alive by its entry while the key is, so a value that refers back
+ * to its own key does not pin it. */
+struct WeakEntry {
+	Atom key, value;
+	unsigned long hash;
+	struct WeakEntry *next;
+};
+
+struct WeakTable {
+	struct Object object;
+	long count, size;
+	struct WeakEntry **buckets;
+	struct WeakTable *prev, *next;  /* all_weak_tables */
+};
 
-	*result = make_int(a.value.integer / b.value.integer);
+static struct WeakTable *all_weak_tables = NULL;
 
-	return Error_OK;
+struct WeakTable *weak_table_of(Atom a)
+{
+	return (struct WeakTable *)a.value.object;
 }
 
-Error builtin_numeq(Atom args, Atom *result)
+void weak_table_free(struct WeakTable *t)
 {
-	Atom a, b;
+	struct WeakEntry *e, *next;
+	long i;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
-		return Error_Args;
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		all_weak_tables = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	for (i = 0; i < t->size; i++) {
+		for (e = t->buckets[i]; e != NULL; e = next) {
+			next = e->next;
+			free(e);
+		}
+	}
+	free(t->buckets);
+	free(t);
+}
 
-	a = car(args);
-	b = car(cdr(args));
+/* After the roots are marked: mark the values of entries with live keys
+ * until nothing changes, then drop the entries whose keys are dead */
+void weak_tables_trace(void)
+{
+	struct WeakTable *t;
+	struct WeakEntry **p, *e;
+	long i;
+	int changed;
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
-		return Error_Type;
+	do {
+		changed = 0;
+		for (t = all_weak_tables; t != NULL; t = t->next) {
+			if (!t->object.mark)
+				continue;
+			for (i = 0; i < t->size; i++) {
+				for (e = t->buckets[i]; e != NULL; e = e->next) {
+					if (atom_marked(e->key) && !atom_marked(e->value)) {
+						gc_mark(e->value);
+						changed = 1;
+					}
+				}
+			}
+		}
+	} while (changed);
+
+	for (t = all_weak_tables; t != NULL; t = t->next) {
+		if (!t->object.mark)
+			continue;
+		for (i = 0; i < t->size; i++) {
+			p = &t->buckets[i];
+			while (*p != NULL) {
+				e = *p;
+				if (!atom_marked(e->key)) {
+					*p = e->next;
+					free(e);
+					t->count--;
+				}
+				else {
+					p = &e->next;
+				}
+			}
+		}
+	}
+}
 
-	*result = (a.value.integer == b.value.integer) ? sym_t : nil;
+struct WeakEntry **weak_table_slot(struct WeakTable *t, Atom key, unsigned long hash)
+{
+	struct WeakEntry **p = &t->buckets[hash % t->size];
 
-	return Error_OK;
+	while (*p != NULL && !((*p)->hash == hash && eqp((*p)->key, key)))
+		p = &(*p)->next;
+	return p;
 }
 
-Error builtin_less(Atom args, Atom *result)
+void weak_table_grow(struct WeakTable *t)
 {
-	Atom a, b;
+	struct WeakEntry **old = t->buckets, *e, *next;
+	long i, n = t->size;
+
+	t->size *= 2;
+	t->buckets = (struct WeakEntry **)calloc(t->size, sizeof(struct WeakEntry *));
+	for (i = 0; i < n; i++) {
+		for (e = old[i]; e != NULL; e = next) {
+			next = e->next;
+			e->next = t->buckets[e->hash % t->size];
+			t->buckets[e->hash % t->size] = e;
+		}
+	}
+	free(old);
+}
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+Error builtin_make_weak_table(Atom args, Atom *result)
+{
+	struct WeakTable *t;
+
+	if (!nilp(args))
 		return Error_Args;
 
-	a = car(args);
-	b = car(cdr(args));
+	t = (struct WeakTable *)malloc(sizeof(struct WeakTable));
+	t->count = 0;
+	t->size = 16;
+	t->buckets = (struct WeakEntry **)calloc(t->size, sizeof(struct WeakEntry *));
+	t->prev = NULL;
+	t->next = all_weak_tables;
+	if (all_weak_tables)
+		all_weak_tables->prev = t;
+	all_weak_tables = t;
+	*result = make_object(&t->object, AtomType_WeakTable);
+	return Error_OK;
+}
 
-	if (a.type != AtomType_Integer || b.type != AtomType_Integer)
-		return Error_Type;
+/* (weak-table-put t key value) returns t */
+Error builtin_weak_table_put(Atom args, Atom *result)
+{
+	struct WeakTable *t;
+	struct WeakEntry **p;
+	Atom key;
+	unsigned long hash;
 
-	*result = (a.value.integer < b.value.integer) ? sym_t : nil;
+	if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
+		|| !nilp(cdr(cdr(cdr(args)))))
+		return Error_Args;
+	if (car(args).type != AtomType_WeakTable)
+		return Error_Type;
 
+	t = weak_table_of(car(args));
+	key = car(cdr(args));
+	hash = hash_atom(key, 1);
+	p = weak_table_slot(t, key, hash);
+	if (*p == NULL) {
+		if (t->count >= t->size) {
+			weak_table_grow(t);
+			p = weak_table_slot(t, key, hash);
+		}
+		*p = (struct WeakEntry *)malloc(sizeof(struct WeakEntry));
+		(*p)->key = key;
+		(*p)->hash = hash;
+		(*p)->next = NULL;
+		t->count++;
+	}
+	(*p)->value = car(cdr(cdr(args)));
+	*result = car(args);
 	return Error_OK;
 }
 
-Error builtin_apply(Atom args, Atom *result)
+/* (weak-table-get t key [default]) */
+Error builtin_weak_table_get(Atom args, Atom *result)
 {
-	Atom fn;
+	struct WeakEntry *e;
+	Atom key;
 
-	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+	if (nilp(args) || nilp(cdr(args))
+		|| (!nilp(cdr(cdr(args))) && !nilp(cdr(cdr(cdr(args))))))
 		return Error_Args;
+	if (car(args).type != AtomType_WeakTable)
+		return Error_Type;
 
-	fn = car(args);
-	args = car(cdr(args));
-
-	if (!listp(args))
-		return Error_Syntax;
-
-	return apply(fn, args, result);
+	key = car(cdr(args));
+	e = *weak_table_slot(weak_table_of(car(args)), key, hash_atom(key, 1));
+	if (e != NULL)
+		*result = e->value;
+	else
+		*result = nilp(cdr(cdr(args))) ? nil : car(cdr(cdr(args)));
+	return Error_OK;
 }
 
-Error builtin_eq(Atom args, Atom *result)
+/* (weak-table-delete t key) returns t if the key was present */
+Error builtin_weak_table_delete(Atom args, Atom *result)
 {
-	Atom a, b;
-	int eq = 0;
+	struct WeakTable *t;
+	struct WeakEntry **p, *e;
+	Atom key;
 
 	if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
 		return Error_Args;
+	if (car(args).type != AtomType_WeakTable)
+		return Error_Type;
 
-	a = car(args);
-	b = car(cdr(args));
-
-	if (a.type == b.type) {
-		switch (a.type) {
-		case AtomType_Nil:
-			eq = 1;
-			break;
-		case AtomType_Pair:
-		case AtomType_Closure:
-		case AtomType_Macro:
-			eq = (a.value.pair == b.value.pair);
-			break;
-		case AtomType_Symbol:
-			eq = (a.value.symbol == b.value.symbol);
-			break;
-		case AtomType_Integer:
-			eq = (a.value.integer == b.value.integer);
-			break;
-		case AtomType_Builtin:
-			eq = (a.value.builtin == b.value.builtin);
-			break;
-		default:
-			/* impossible */
-			break;
-		}
+	t = weak_table_of(car(args));
+	key = car(cdr(args));
+	p = weak_table_slot(t, key, hash_atom(key, 1));
+	*result = nil;
+	if (*p != NULL) {
+		e = *p;
+		*p = e->next;
+		free(e);
+		t->count--;
+		*result = sym_t;
 	}
-
-	*result = eq ? sym_t : nil;
 	return Error_OK;
 }
 
-Error builtin_pairp(Atom args, Atom *result)
+Error builtin_weak_table_count(Atom args, Atom *result)
 {
 	if (nilp(args) || !nilp(cdr(args)))
 		return Error_Args;
+	if (car(args).type != AtomType_WeakTable)
+		return Error_Type;
 
-	*result = (car(args).type == AtomType_Pair) ? sym_t : nil;
+	*result = make_int(weak_table_of(car(args))->count);
 	return Error_OK;
 }
 
@@ -756,31 +9072,59 @@ char *slurp(const char *path)
 	return buf;
 }
 
-void load_file(Atom env, const char *path)
+/* Evaluate the expressions of a file, printing their values if verbose;
+ * errors are always reported */
+void load_file(Atom env, const char *path, int verbose)
 {
-	char *text;
+	FILE *file;
+	Atom port, expr = nil;
+	struct Root root[2];
 
-	printf("Reading %s...\n", path);
-	text = slurp(path);
-	if (text) {
-		const char *p = text;
-		Atom expr;
-		while (read_expr(p, &p, &expr) == Error_OK) {
-			Atom result;
-			Error err = eval_expr(expr, env, &result);
-			if (err) {
-				print_err(err);
-				printf("Error in expression:\n\t");
-				print_expr(expr);				
-				putchar('\n');
-			}			
-			else {
-				print_expr(result);
-				putchar('\n');
-			}			
-		}
-		free(text);
+	if (verbose)
+		printf("Reading %s...\n", path);
+	file = fopen(path, "rb");
+	if (!file) {
+		printf("Reading %s filed.\n", path);
+		return;
+	}
+
+	port = make_port(PortKind_FileIn, file,
+		(char *)malloc(PORT_BUFFER_SIZE), 0, PORT_BUFFER_SIZE);
+	gc_protect(&root[0], &port);
+	gc_protect(&root[1], &expr);
+	while (port_read(port_of(port), &expr) == Error_OK) {
+		Atom result;
+		Error err = eval_expr(expr, env, &result);
+		if (err) {
+			print_err(err);
+			printf("Error in expression:\n\t");
+			print_expr(expr);				
+			putchar('\n');
+		}			
+		else if (verbose) {
+			print_expr(result);
+			putchar('\n');
+		}			
 	}
+	port_close(port_of(port));
+	gc_unprotect(&root[0]);
+}
+
+/* Evaluate every expression of text, stopping at the first error */
+Error eval_string(Atom env, const char *text)
+{
+	struct Port port;
+	Atom expr = nil, result;
+	struct Root root;
+	Error err = Error_OK;
+
+	port_open_text(&port, text);
+	gc_protect(&root, &expr);
+	while (!err && port_read(&port, &expr) == Error_OK)
+		err = eval_expr(expr, env, &result);
+	gc_unprotect(&root);
+
+	return err;
 }
 
 Atom list_get(Atom list, int k)
@@ -820,6 +9164,13 @@ Atom make_frame(Atom parent, Atom env, Atom tail)
 		nil))))));
 }
 
+void frame_pop(Atom *stack)
+{
+	Atom frame = *stack;
+	*stack = car(frame);
+	release_list(frame);
+}
+
 Error eval_do_exec(Atom *stack, Atom *expr, Atom *env)
 {
 	Atom body;
@@ -829,8 +9180,24 @@ Error eval_do_exec(Atom *stack, Atom *expr, Atom *env)
 	*expr = car(body);
 	body = cdr(body);
 	if (nilp(body)) {
-		/* Finished function; pop the stack */
-		*stack = car(*stack);
+		/* Finished function; pop the stack, unless the environment can be
+		 * released once the last expression has been evaluated */
+		if (closure_noescape(list_get(*stack, 2))) {
+			Atom parent = car(*stack);
+
+			list_set(*stack, 5, nil);
+			allocation_of(*stack)->release = 1;
+
+			/* Tail call: the caller's environment is dead already */
+			if (!nilp(parent) && allocation_of(parent)->release) {
+				car(*stack) = car(parent);
+				env_release(list_get(parent, 1));
+				release_list(parent);
+			}
+		}
+		else {
+			frame_pop(stack);
+		}
 	}
 	else {
 		list_set(*stack, 5, body);
@@ -850,9 +9217,9 @@ Error eval_do_bind(Atom *stack, Atom *expr, Atom *env)
 	op = list_get(*stack, 2);
 	args = list_get(*stack, 4);
 
-	*env = env_create(car(op));
+	*env = env_create(car(car(op)));
 	arg_names = car(cdr(op));
-	body = cdr(cdr(op));
+	body = cdr(car(op));
 	list_set(*stack, 1, *env);
 	list_set(*stack, 5, body);
 
@@ -873,6 +9240,9 @@ Error eval_do_bind(Atom *stack, Atom *expr, Atom *env)
 	if (!nilp(args))
 		return Error_Args;
 
+	if (closure_defines(op))
+		allocation_of(*env)->open = 1;
+
 	list_set(*stack, 4, nil);
 
 	return eval_do_exec(stack, expr, env);
@@ -881,6 +9251,8 @@ Error eval_do_bind(Atom *stack, Atom *expr, Atom *env)
 Error eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result)
 {
 	Atom op, args;
+	int fresh = 1; /* args were consed by eval_do_return */
+	Error err;
 
 	op = list_get(*stack, 2);
 	args = list_get(*stack, 4);
@@ -892,11 +9264,15 @@ Error eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result)
 
 	if (op.type == AtomType_Symbol) {
 		if (op.value.symbol == sym_apply.value.symbol) {
+			Atom apply_args = args;
+
 			/* Replace the current frame */
-			*stack = car(*stack);
+			frame_pop(stack);
 			*stack = make_frame(*stack, *env, nil);
-			op = car(args);
-			args = car(cdr(args));
+			op = car(apply_args);
+			args = car(cdr(apply_args));
+			release_list(apply_args);
+			fresh = 0;
 			if (!listp(args))
 				return Error_Syntax;
 
@@ -905,16 +9281,114 @@ Error eval_do_apply(Atom *stack, Atom *expr, Atom *env, Atom *result)
 		}
 	}
 
-	if (op.type == AtomType_Builtin) {
-		*stack = car(*stack);
-		*expr = cons(op, args);
-		return Error_OK;
+	if (op.type == AtomType_Builtin
+		&& op.value.builtin == builtin_call_with_values) {
+		/* Call the producer from a new frame; this one calls the consumer */
+		if (nilp(args) || nilp(cdr(args)) || !nilp(cdr(cdr(args))))
+			return Error_Args;
+		list_set(*stack, 2, sym_values);
+		list_set(*stack, 4, car(cdr(args)));
+		op = car(args);
+		if (fresh)
+			release_list(args);
+		*stack = make_frame(*stack, *env, nil);
+		list_set(*stack, 2, op);
+		args = nil;
+		fresh = 0;
+	}
+
+	if (op.type == AtomType_Memo) {
+		struct Memo *m = (struct Memo *)op.value.object;
+		Atom value;
+
+		if (memo_lookup(m, args, &value)) {
+			frame_pop(stack);
+			if (fresh)
+				release_list(args);
+			*expr = cons(sym_quote, cons(value, nil));
+			return Error_OK;
+		}
+
+		/* Call the function from a new frame; this one stores the result */
+		if (!fresh)
+			args = copy_list(args);
+		list_set(*stack, 2, sym_memo);
+		list_set(*stack, 4, cons(op, args));
+		*stack = make_frame(*stack, *env, nil);
+		op = m->fn;
+		list_set(*stack, 2, op);
+		list_set(*stack, 4, args);
+		fresh = 0;
+	}
+
+	if (op.type == AtomType_Builtin || op.type == AtomType_Foreign) {
+		frame_pop(stack);
+		*expr = cons(op, args);
+		allocation_of(*expr)->owned = fresh;
+		allocation_of(*expr)->applied = 1;
+		return Error_OK;
+	}
+	else if (op.type != AtomType_Closure) {
+		return Error_Type;
+	}
+
+	err = eval_do_bind(stack, expr, env);
+
+	/* Only the values of a fixed argument list are kept by the bindings */
+	if (!err && fresh && fixed_argsp(car(cdr(op))))
+		release_list(args);
+
+	return err;
+}
+
+/* Call the consumer of call-with-values in place of its frame, binding
+ * the parameters of a closure straight from the value registers */
+Error values_apply(Atom *stack, Atom *expr, Atom *env, Atom *result)
+{
+	Atom consumer, names, rest, args = nil;
+	Atom *values = result;
+	int n = 1, i, j;
+
+	if (result->type == AtomType_Values) {
+		if (result->value.integer != value_generation)
+			return Error_Type;
+		values = value_regs;
+		n = value_count;
+	}
+
+	consumer = list_get(*stack, 4);
+	list_set(*stack, 2, consumer);
+	list_set(*stack, 4, nil);
+
+	if (consumer.type != AtomType_Closure) {
+		for (i = 0; i < n; i++)
+			args = cons(values[i], args);
+		list_set(*stack, 4, args);
+		return eval_do_apply(stack, expr, env, result);
+	}
+
+	*env = env_create(car(car(consumer)));
+	names = car(cdr(consumer));
+	for (i = 0; names.type == AtomType_Pair; names = cdr(names), i++) {
+		if (i == n)
+			return Error_Args;
+		env_set(*env, car(names), values[i]);
 	}
-	else if (op.type != AtomType_Closure) {
-		return Error_Type;
+	if (names.type == AtomType_Symbol) {
+		rest = nil;
+		for (j = n - 1; j >= i; j--)
+			rest = cons(values[j], rest);
+		env_set(*env, names, rest);
 	}
+	else if (i < n)
+		return Error_Args;
+
+	list_set(*stack, 1, *env);
+	list_set(*stack, 5, cdr(car(consumer)));
+	if (closure_defines(consumer))
+		allocation_of(*env)->open = 1;
 
-	return eval_do_bind(stack, expr, env);
+	return eval_do_exec(stack, expr, env);
 }
 
 Error eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
@@ -949,17 +9423,36 @@ Error eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
 		/* Finished working on special form */
 		if (op.value.symbol == sym_define.value.symbol) {
 			Atom sym = list_get(*stack, 4);
-			(void)env_set(*env, sym, *result);
-			*stack = car(*stack);
+			(void)env_define(*env, sym, *result);
+			frame_pop(stack);
 			*expr = cons(sym_quote, cons(sym, nil));
 			return Error_OK;
 		}
 		else if (op.value.symbol == sym_if.value.symbol) {
 			args = list_get(*stack, 3);
 			*expr = nilp(*result) ? car(cdr(args)) : car(args);
-			*stack = car(*stack);
+			frame_pop(stack);
 			return Error_OK;
 		}
+		else if (op.value.symbol == sym_checkpoint.value.symbol) {
+			/* Only the outermost evaluation can be resumed */
+			frame_pop(stack);
+			if (eval_depth != 1)
+				return Error_Type;
+			*expr = cons(sym_quote, cons(nil, nil));
+			return checkpoint_write(*result, *stack);
+		}
+		else if (op.value.symbol == sym_memo.value.symbol) {
+			args = list_get(*stack, 4);
+			memo_store((struct Memo *)car(args).value.object, cdr(args), *result);
+			release(args);
+			frame_pop(stack);
+			*expr = cons(sym_quote, cons(*result, nil));
+			return Error_OK;
+		}
+		else if (op.value.symbol == sym_values.value.symbol) {
+			return values_apply(stack, expr, env, result);
+		}
 		else {
 			goto store_arg;
 		}
@@ -967,7 +9460,7 @@ Error eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
 	else if (op.type == AtomType_Macro) {
 		/* Finished evaluating macro */
 		*expr = *result;
-		*stack = car(*stack);
+		frame_pop(stack);
 		return Error_OK;
 	}
 	else {
@@ -989,17 +9482,18 @@ Error eval_do_return(Atom *stack, Atom *expr, Atom *env, Atom *result)
 	return Error_OK;
 }
 
-Error eval_expr(Atom expr, Atom env, Atom *result)
+Error eval_loop(Atom expr, Atom env, Atom stack, Atom *result)
 {
 	static int count = 0;
 	Error err = Error_OK;
-	Atom stack = nil;
+	struct Root roots[3];
+
+	gc_protect(&roots[0], &expr);
+	gc_protect(&roots[1], &env);
+	gc_protect(&roots[2], &stack);
 
 	do {
-		if (++count > 100000) {
-			gc_mark(expr);
-			gc_mark(env);
-			gc_mark(stack);
+		if (++count > 100000 && !gc_inhibit) {
 			gc();
 			count = 0;
 		}
@@ -1038,7 +9532,7 @@ Error eval_expr(Atom expr, Atom env, Atom *result)
 						sym = car(sym);
 						if (sym.type != AtomType_Symbol)
 							return Error_Type;
-						(void)env_set(env, sym, *result);
+						(void)env_define(env, sym, *result);
 						*result = sym;
 					}
 					else if (sym.type == AtomType_Symbol) {
@@ -1060,6 +9554,12 @@ Error eval_expr(Atom expr, Atom env, Atom *result)
 
 					err = make_closure(env, car(args), cdr(args), result);
 				}
+				else if (op.value.symbol == sym_delay.value.symbol) {
+					if (nilp(args) || !nilp(cdr(args)))
+						return Error_Args;
+
+					err = make_promise(env, args, result);
+				}
 				else if (op.value.symbol == sym_if.value.symbol) {
 					if (nilp(args) || nilp(cdr(args)) || nilp(cdr(cdr(args)))
 						|| !nilp(cdr(cdr(cdr(args)))))
@@ -1088,7 +9588,7 @@ Error eval_expr(Atom expr, Atom env, Atom *result)
 					if (!err) {
 						macro.type = AtomType_Macro;
 						*result = name;
-						(void)env_set(env, name, macro);
+						(void)env_define(env, name, macro);
 					}
 				}
 				else if (op.value.symbol == sym_apply.value.symbol) {
@@ -1100,12 +9600,43 @@ Error eval_expr(Atom expr, Atom env, Atom *result)
 					expr = car(args);
 					continue;
 				}
+				else if (op.value.symbol == sym_fixnum.value.symbol) {
+					*result = fixnum_eval(expr, env);
+				}
+				else if (op.value.symbol == sym_checkpoint.value.symbol) {
+					if (nilp(args) || !nilp(cdr(args)))
+						return Error_Args;
+
+					stack = make_frame(stack, env, nil);
+					list_set(stack, 2, op);
+					expr = car(args);
+					continue;
+				}
+				else if (op.value.symbol == sym_fixnum_guard.value.symbol) {
+					Atom p, value;
+
+					for (p = car(args); !nilp(p); p = cdr(p)) {
+						if (env_get(env, car(p), &value)
+							|| value.type != AtomType_Integer)
+							break;
+					}
+					expr = nilp(p) ? car(cdr(args)) : car(cdr(cdr(args)));
+					continue;
+				}
 				else {
 					goto push;
 				}
 			}
-			else if (op.type == AtomType_Builtin) {
-				err = (*op.value.builtin)(args, result);
+			else if ((op.type == AtomType_Builtin || op.type == AtomType_Foreign)
+				&& allocation_of(expr)->applied) {
+				if (op.type == AtomType_Builtin)
+					err = (*op.value.builtin)(args, result);
+				else
+					err = ffi_call((struct Foreign *)op.value.object, args, result);
+				/* Foreign builtins may keep or return their arguments */
+				if (!err && op.type == AtomType_Builtin
+					&& allocation_of(expr)->owned)
+					release_list(expr);
 			}
 			else {
 			push:
@@ -1116,6 +9647,12 @@ Error eval_expr(Atom expr, Atom env, Atom *result)
 			}
 		}
 
+		/* Returned from closures whose environments did not escape */
+		while (!err && !nilp(stack) && allocation_of(stack)->release) {
+			env_release(list_get(stack, 1));
+			frame_pop(&stack);
+		}
+
 		if (nilp(stack))
 			break;
 
@@ -1126,7 +9663,21 @@ Error eval_expr(Atom expr, Atom env, Atom *result)
 	return err;
 }
 
+Error eval_expr(Atom expr, Atom env, Atom *result)
+{
+	/* eval_loop may return early with its roots still registered */
+	struct Root *roots = gc_roots;
+	Error err;
+
+	eval_depth++;
+	err = eval_loop(expr, env, nil, result);
+	eval_depth--;
+	gc_roots = roots;
+	return err;
+}
+
 void print_err(Error err) {
+	port_flush(port_stdout());
 	switch (err) {
 	case Error_OK:
 		break;
@@ -1145,21 +9696,812 @@ void print_err(Error err) {
 	}
 }
 
-int main(int argc, char **argv)
+/* Ahead-of-time compiler.
+ *
+ *   toylisp-compile module.lisp -o module.c
+ *
+ * Every top-level (define (name params...) body...) with a fixed
+ * argument list whose body, after macro expansion, only uses quote, if,
+ * apply and calls becomes a C function.  Calls between compiled
+ * functions are direct C calls, self tail calls are loops, other tail
+ * calls between them return to a trampoline so that mutual recursion
+ * runs in constant C stack, and two
+ * argument +, -, *, /, = and < on integers are computed inline while
+ * the operator is still bound to its builtin, falling back to the global
+ * binding otherwise.  All other forms are kept as source and evaluated
+ * when the module is initialized.
+ *
+ * The generated file defines toylisp_init_<module>(Atom env).  Built with
+ * TOYLISP_MODULE_MAIN it also defines main, so
+ *
+ *   cc -pthread -DTOYLISP_NO_MAIN -DTOYLISP_MODULE_MAIN ToyLisp.c module.c -ldl
+ *
+ * links an interpreter with the module preloaded. */
+
+struct Text {
+	char *data;
+	size_t len, cap;
+};
+
+void text_printf(struct Text *text, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		size_t room = text->cap - text->len;
+		va_start(ap, fmt);
+		n = vsnprintf(text->data + text->len, room, fmt, ap);
+		va_end(ap);
+		if (n >= 0 && (size_t)n < room)
+			break;
+		text->cap = text->cap * 2 + (n > 0 ? n : 0) + 64;
+		text->data = (char *)realloc(text->data, text->cap);
+	}
+	text->len += n;
+}
+
+/* Write atom as Lisp source, escaped for a C string literal */
+void text_datum(struct Text *text, Atom atom)
+{
+	const char *s;
+
+	switch (atom.type) {
+	case AtomType_Nil:
+		text_printf(text, "nil");
+		break;
+	case AtomType_Pair:
+		text_printf(text, "(");
+		text_datum(text, car(atom));
+		atom = cdr(atom);
+		while (!nilp(atom)) {
+			if (atom.type == AtomType_Pair) {
+				text_printf(text, " ");
+				text_datum(text, car(atom));
+				atom = cdr(atom);
+			}
+			else {
+				text_printf(text, " . ");
+				text_datum(text, atom);
+				break;
+			}
+		}
+		text_printf(text, ")");
+		break;
+	case AtomType_Symbol:
+		for (s = atom.value.symbol; *s; s++) {
+			if (*s == '"' || *s == '\\')
+				text_printf(text, "\\%c", *s);
+			else if (*s == '?')
+				text_printf(text, "\\?"); /* no trigraphs */
+			else
+				text_printf(text, "%c", *s);
+		}
+		break;
+	case AtomType_Integer:
+		text_printf(text, "%ld", atom.value.integer);
+		break;
+	case AtomType_Real: {
+		char buf[32];
+		format_real(buf, atom.value.real);
+		text_printf(text, "%s", buf);
+		break;
+	}
+	case AtomType_String:
+		/* A Lisp string literal inside a C string literal */
+		text_printf(text, "\\\"");
+		for (s = string_of(atom)->chars; s < string_of(atom)->chars + string_of(atom)->length; s++) {
+			if (*s == '"' || *s == '\\')
+				text_printf(text, "\\\\\\%c", *s);
+			else if (*s == '\n')
+				text_printf(text, "\\\\n");
+			else if (*s == '?')
+				text_printf(text, "\\?");
+			else
+				text_printf(text, "%c", *s);
+		}
+		text_printf(text, "\\\"");
+		break;
+	default:
+		text_printf(text, "nil");
+		break;
+	}
+}
+
+struct Compiler {
+	struct Text *code;
+	Atom env;      /* compile-time environment, for macros */
+	Atom fns;      /* ((name arity . index) ...) of compiled functions */
+	Atom consts;   /* quoted data and global symbols, newest first */
+	int nconsts;
+	Atom self;     /* function being compiled */
+	Atom params;
+	int temps;
+	int looped;    /* a self tail call was emitted */
+};
+
+int compile_const(struct Compiler *c, Atom datum)
+{
+	Atom p;
+	int i = c->nconsts - 1;
+
+	for (p = c->consts; !nilp(p); p = cdr(p), i--) {
+		if (car(p).type == datum.type && car(p).value.pair == datum.value.pair)
+			return i;
+	}
+	c->consts = cons(datum, c->consts);
+	return c->nconsts++;
+}
+
+int compile_param(struct Compiler *c, Atom sym)
+{
+	Atom p;
+	int i = 0;
+
+	for (p = c->params; !nilp(p); p = cdr(p), i++)
+		if (car(p).value.symbol == sym.value.symbol)
+			return i;
+	return -1;
+}
+
+/* ((name arity . index)) entry of a compiled function, or nil */
+Atom compile_fn(struct Compiler *c, Atom sym)
+{
+	Atom p;
+
+	for (p = c->fns; !nilp(p); p = cdr(p))
+		if (car(car(p)).value.symbol == sym.value.symbol)
+			return car(p);
+	return nil;
+}
+
+int compile_specialp(Atom sym)
+{
+	return sym.value.symbol == sym_define.value.symbol
+		|| sym.value.symbol == sym_lambda.value.symbol
+		|| sym.value.symbol == sym_defmacro.value.symbol;
+}
+
+/* Expand macros everywhere in expr; fails on forms that are not compiled */
+Error compile_expand(struct Compiler *c, Atom expr, Atom *result)
+{
+	Atom op, value, head = nil, tail = nil;
+	struct Root *roots = gc_roots, r[2];
+	Error err = Error_OK;
+
+	if (expr.type != AtomType_Pair) {
+		*result = expr;
+		return Error_OK;
+	}
+	if (!listp(expr))
+		return Error_Syntax;
+
+	/* Macro expanders may collect garbage */
+	gc_protect(&r[0], &expr);
+	gc_protect(&r[1], &head);
+
+	op = car(expr);
+	if (op.type == AtomType_Symbol) {
+		if (op.value.symbol == sym_quote.value.symbol) {
+			*result = expr;
+			gc_roots = roots;
+			return Error_OK;
+		}
+		if (compile_specialp(op)) {
+			gc_roots = roots;
+			return Error_Syntax;
+		}
+		if (compile_param(c, op) < 0
+			&& !env_get(c->env, op, &value) && value.type == AtomType_Macro) {
+			value.type = AtomType_Closure;
+			err = apply(value, cdr(expr), &expr);
+			if (!err)
+				err = compile_expand(c, expr, result);
+			gc_roots = roots;
+			return err;
+		}
+	}
+
+	for (; !nilp(expr); expr = cdr(expr)) {
+		Atom x;
+		err = compile_expand(c, car(expr), &x);
+		if (err)
+			break;
+		if (nilp(head))
+			head = tail = cons(x, nil);
+		else {
+			cdr(tail) = cons(x, nil);
+			tail = cdr(tail);
+		}
+	}
+	*result = head;
+	gc_roots = roots;
+	return err;
+}
+
+int compile_length(Atom list)
+{
+	int n = 0;
+	for (; !nilp(list); list = cdr(list))
+		n++;
+	return n;
+}
+
+int compile_value(struct Compiler *c, Atom expr);
+
+/* Operators computed inline on integers, and the builtins they must
+ * still be bound to; k_op[i] holds the global binding of the i-th */
+#define COMPILE_INLINE_OPS 6
+
+static const char *compile_ops[COMPILE_INLINE_OPS] = { "+", "-", "*", "/", "=", "<" };
+static const char *compile_op_builtins[COMPILE_INLINE_OPS] = {
+	"builtin_add", "builtin_subtract", "builtin_multiply",
+	"builtin_divide", "builtin_numeq", "builtin_less"
+};
+
+/* Index of op in compile_ops, or -1 */
+int compile_inline_op(Atom op)
+{
+	int i;
+
+	for (i = 0; i < COMPILE_INLINE_OPS; i++)
+		if (strcmp(op.value.symbol, compile_ops[i]) == 0)
+			return i;
+	return -1;
+}
+
+/* Compile the arguments of a call into consecutive temporaries */
+int compile_args(struct Compiler *c, Atom args, int *count)
+{
+	int first = c->temps, i;
+
+	*count = compile_length(args);
+	c->temps += *count;
+	for (i = 0; !nilp(args); args = cdr(args), i++)
+		text_printf(c->code, "\tt[%d] = t[%d];\n",
+			first + i, compile_value(c, car(args)));
+	return first;
+}
+
+void compile_arg_list(struct Compiler *c, int first, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		text_printf(c->code, "cons(t[%d], ", first + i);
+	text_printf(c->code, "nil");
+	for (i = 0; i < count; i++)
+		text_printf(c->code, ")");
+}
+
+int compile_call(struct Compiler *c, Atom expr)
+{
+	Atom op = car(expr), fn;
+	int r, first, count, i, inl;
+
+	if (op.type == AtomType_Symbol && compile_param(c, op) < 0) {
+		fn = compile_fn(c, op);
+		if (op.value.symbol == sym_if.value.symbol) {
+			int test = compile_value(c, car(cdr(expr)));
+			r = c->temps++;
+			text_printf(c->code, "\tif (!nilp(t[%d])) {\n", test);
+			text_printf(c->code, "\tt[%d] = t[%d];\n",
+				r, compile_value(c, car(cdr(cdr(expr)))));
+			text_printf(c->code, "\t} else {\n");
+			text_printf(c->code, "\tt[%d] = t[%d];\n",
+				r, compile_value(c, car(cdr(cdr(cdr(expr))))));
+			text_printf(c->code, "\t}\n");
+			return r;
+		}
+		if (op.value.symbol == sym_apply.value.symbol) {
+			first = compile_args(c, cdr(expr), &count);
+			r = c->temps++;
+			text_printf(c->code,
+				"\tif (!listp(t[%d])) { err = Error_Syntax; goto out; }\n"
+				"\tif ((err = apply(t[%d], t[%d], &t[%d]))) goto out;\n",
+				first + 1, first, first + 1, r);
+			return r;
+		}
+		if (!nilp(fn)
+			&& car(cdr(fn)).value.integer == compile_length(cdr(expr))) {
+			first = compile_args(c, cdr(expr), &count);
+			r = c->temps++;
+			text_printf(c->code, "\tif ((err = tail_run(lisp_fn_%ld(",
+				cdr(cdr(fn)).value.integer);
+			for (i = 0; i < count; i++)
+				text_printf(c->code, "t[%d], ", first + i);
+			text_printf(c->code, "&t[%d]), &t[%d]))) goto out;\n", r, r);
+			return r;
+		}
+		inl = compile_inline_op(op);
+		first = compile_args(c, cdr(expr), &count);
+		r = c->temps++;
+		if (inl >= 0 && count == 2) {
+			const char *s = compile_ops[inl];
+
+			text_printf(c->code,
+				"\tif (BOUND_TO(k_op[%d], %s)\n"
+				"\t\t&& t[%d].type == AtomType_Integer && t[%d].type == AtomType_Integer)\n",
+				inl, compile_op_builtins[inl], first, first + 1);
+			if (*s == '=' || *s == '<')
+				text_printf(c->code,
+					"\t\tt[%d] = (t[%d].value.integer %s t[%d].value.integer) ? k_t : nil;\n",
+					r, first, *s == '=' ? "==" : "<", first + 1);
+			else
+				text_printf(c->code,
+					"\t\tt[%d] = make_int(t[%d].value.integer %s t[%d].value.integer);\n",
+					r, first, s, first + 1);
+			text_printf(c->code, "\telse ");
+		}
+		else {
+			text_printf(c->code, "\t");
+		}
+		text_printf(c->code, "if ((err = call_global(k[%d], ",
+			compile_const(c, op));
+		compile_arg_list(c, first, count);
+		text_printf(c->code, ", &t[%d]))) goto out;\n", r);
+		return r;
+	}
+
+	/* Computed operator */
+	i = compile_value(c, op);
+	text_printf(c->code, "\tt[%d] = t[%d];\n", c->temps, i);
+	i = c->temps++;
+	first = compile_args(c, cdr(expr), &count);
+	r = c->temps++;
+	text_printf(c->code, "\tif ((err = apply(t[%d], ", i);
+	compile_arg_list(c, first, count);
+	text_printf(c->code, ", &t[%d]))) goto out;\n", r);
+	return r;
+}
+
+int compile_value(struct Compiler *c, Atom expr)
+{
+	int r, i;
+
+	switch (expr.type) {
+	case AtomType_Nil:
+		r = c->temps++;
+		text_printf(c->code, "\tt[%d] = nil;\n", r);
+		return r;
+	case AtomType_Integer:
+		r = c->temps++;
+		text_printf(c->code, "\tt[%d] = make_int(%ldL);\n", r, expr.value.integer);
+		return r;
+	case AtomType_Real:
+	case AtomType_String:
+		r = c->temps++;
+		text_printf(c->code, "\tt[%d] = k[%d];\n", r, compile_const(c, expr));
+		return r;
+	case AtomType_Symbol:
+		r = c->temps++;
+		i = compile_param(c, expr);
+		if (i >= 0)
+			text_printf(c->code, "\tt[%d] = a%d;\n", r, i);
+		else
+			text_printf(c->code,
+				"\tif ((err = env_get(module_env, k[%d], &t[%d]))) goto out;\n",
+				compile_const(c, expr), r);
+		return r;
+	default:
+		break;
+	}
+
+	if (car(expr).type == AtomType_Symbol
+		&& car(expr).value.symbol == sym_quote.value.symbol) {
+		Atom datum = car(cdr(expr));
+		if (datum.type != AtomType_Pair && datum.type != AtomType_Symbol)
+			return compile_value(c, datum);
+		r = c->temps++;
+		text_printf(c->code, "\tt[%d] = k[%d];\n", r, compile_const(c, datum));
+		return r;
+	}
+
+	return compile_call(c, expr);
+}
+
+/* Compile expr in tail position: set *result, loop on a self call, or
+ * leave a call to another compiled function to tail_run */
+void compile_tail(struct Compiler *c, Atom expr)
+{
+	Atom op, fn;
+
+	if (expr.type == AtomType_Pair) {
+		op = car(expr);
+		if (op.type == AtomType_Symbol && compile_param(c, op) < 0) {
+			if (op.value.symbol == sym_if.value.symbol) {
+				int test = compile_value(c, car(cdr(expr)));
+				text_printf(c->code, "\tif (!nilp(t[%d])) {\n", test);
+				compile_tail(c, car(cdr(cdr(expr))));
+				text_printf(c->code, "\t}\n");
+				compile_tail(c, car(cdr(cdr(cdr(expr)))));
+				return;
+			}
+			if (op.value.symbol == c->self.value.symbol
+				&& compile_length(cdr(expr)) == compile_length(c->params)) {
+				int first, count, i;
+				first = compile_args(c, cdr(expr), &count);
+				for (i = 0; i < count; i++)
+					text_printf(c->code, "\ta%d = t[%d];\n", i, first + i);
+				text_printf(c->code, "\tgoto top;\n");
+				c->looped = 1;
+				return;
+			}
+			fn = compile_fn(c, op);
+			if (!nilp(fn)
+				&& car(cdr(fn)).value.integer == compile_length(cdr(expr))) {
+				int first, count, i;
+				first = compile_args(c, cdr(expr), &count);
+				for (i = 0; i < count; i++)
+					text_printf(c->code, "\ttail_a[%d] = t[%d];\n", i, first + i);
+				text_printf(c->code, "\ttail_fn = %ld;\n\tgoto out;\n",
+					cdr(cdr(fn)).value.integer);
+				return;
+			}
+		}
+	}
+
+	text_printf(c->code, "\t*result = t[%d];\n\tgoto out;\n", compile_value(c, expr));
+}
+
+/* (define (name params...) body...) to compile, with its arity; or -1 */
+int compile_definable(Atom form)
+{
+	Atom p;
+	int arity = 0;
+
+	if (form.type != AtomType_Pair || car(form).type != AtomType_Symbol
+		|| car(form).value.symbol != sym_define.value.symbol
+		|| nilp(cdr(form)) || car(cdr(form)).type != AtomType_Pair
+		|| car(car(cdr(form))).type != AtomType_Symbol
+		|| nilp(cdr(cdr(form))) || !listp(form))
+		return -1;
+
+	for (p = cdr(car(cdr(form))); !nilp(p); p = cdr(p), arity++)
+		if (p.type != AtomType_Pair || car(p).type != AtomType_Symbol)
+			return -1;
+	return arity;
+}
+
+/* Check that if forms have all three parts */
+int compile_checked(Atom expr)
+{
+	if (expr.type != AtomType_Pair)
+		return 1;
+	if (car(expr).type == AtomType_Symbol) {
+		if (car(expr).value.symbol == sym_quote.value.symbol)
+			return !nilp(cdr(expr)) && nilp(cdr(cdr(expr)));
+		if (car(expr).value.symbol == sym_if.value.symbol) {
+			Atom p = cdr(expr);
+			int n = 0;
+			for (; !nilp(p); p = cdr(p))
+				n++;
+			if (n != 3)
+				return 0;
+		}
+		if (car(expr).value.symbol == sym_apply.value.symbol) {
+			Atom p = cdr(expr);
+			if (nilp(p) || nilp(cdr(p)) || !nilp(cdr(cdr(p))))
+				return 0;
+		}
+	}
+	for (; !nilp(expr); expr = cdr(expr))
+		if (!compile_checked(car(expr)))
+			return 0;
+	return 1;
+}
+
+void compile_function(struct Compiler *c, struct Text *out, Atom form,
+	Atom body, int arity, long index)
+{
+	struct Text code = { NULL, 0, 0 };
+	int i;
+
+	c->code = &code;
+	c->self = car(car(cdr(form)));
+	c->params = cdr(car(cdr(form)));
+	c->temps = 0;
+	c->looped = 0;
+
+	for (; !nilp(cdr(body)); body = cdr(body))
+		compile_value(c, car(body));
+	compile_tail(c, car(body));
+
+	text_printf(out, "/* ");
+	text_datum(out, c->self);
+	text_printf(out, " */\nstatic Error lisp_fn_%ld(", index);
+	for (i = 0; i < arity; i++)
+		text_printf(out, "Atom a%d, ", i);
+	text_printf(out, "Atom *result)\n{\n"
+		"\tError err = Error_OK;\n"
+		"\tstruct Root *roots = gc_roots;\n"
+		"\tstruct Root r[%d];\n"
+		"\tAtom t[%d];\n"
+		"\tint i;\n\n"
+		"\tfor (i = 0; i < %d; i++) {\n"
+		"\t\tt[i] = nil;\n"
+		"\t\tgc_protect(&r[i], &t[i]);\n"
+		"\t}\n",
+		c->temps + arity + 1, c->temps + 1, c->temps + 1);
+	for (i = 0; i < arity; i++)
+		text_printf(out, "\tgc_protect(&r[%d], &a%d);\n", c->temps + 1 + i, i);
+	if (c->looped)
+		text_printf(out, "top:\n");
+	text_printf(out, "%s", code.data ? code.data : "");
+	text_printf(out, "out:\n\tgc_roots = roots;\n\treturn err;\n}\n\n");
+
+	text_printf(out, "static Error builtin_fn_%ld(Atom args, Atom *result)\n{\n", index);
+	if (arity > 0)
+		text_printf(out, "\tAtom a[%d];\n\tint i;\n\n"
+			"\tfor (i = 0; i < %d; i++) {\n"
+			"\t\tif (nilp(args))\n\t\t\treturn Error_Args;\n"
+			"\t\ta[i] = car(args);\n\t\targs = cdr(args);\n\t}\n",
+			arity, arity);
+	text_printf(out, "\tif (!nilp(args))\n\t\treturn Error_Args;\n\n"
+		"\treturn tail_run(lisp_fn_%ld(", index);
+	for (i = 0; i < arity; i++)
+		text_printf(out, "a[%d], ", i);
+	text_printf(out, "result), result);\n}\n\n");
+
+	free(code.data);
+}
+
+int compile_module(Atom env, const char *in_path, const char *out_path)
+{
+	struct Compiler c;
+	struct Text fns = { NULL, 0, 0 }, init = { NULL, 0, 0 };
+	struct Root *roots = gc_roots, r[5];
+	struct Port port;
+	Atom forms = nil, plan = nil, p, q;
+	char *text, name[256];
+	const char *s, *base;
+	FILE *out;
+	long index = 0;
+	int i, nargs = 1;
+
+	text = slurp(in_path);
+	if (!text)
+		return 1;
+
+	c.env = env;
+	c.fns = nil;
+	c.consts = nil;
+	c.nconsts = 0;
+	gc_protect(&r[0], &forms);
+	gc_protect(&r[1], &plan);
+	gc_protect(&r[2], &c.fns);
+	gc_protect(&r[3], &c.consts);
+	gc_protect(&r[4], &p);
+
+	/* Read the module; plan holds the expanded body of each form to
+	 * compile, or nil.  defmacro forms also take effect at compile time */
+	port_open_text(&port, text);
+	while (port_read(&port, &p) == Error_OK) {
+		Atom form = p, body = nil;
+		int arity = compile_definable(form);
+
+		forms = cons(form, forms);
+		if (arity >= 0 && nilp(compile_fn(&c, car(car(cdr(form)))))) {
+			c.params = cdr(car(cdr(form)));
+			for (q = cdr(cdr(form)); !nilp(q); q = cdr(q)) {
+				Atom x;
+				if (compile_expand(&c, car(q), &x) || !compile_checked(x)) {
+					body = nil;
+					break;
+				}
+				body = cons(x, body);
+			}
+			list_reverse(&body);
+		}
+		if (!nilp(body)) {
+			c.fns = cons(cons(car(car(cdr(form))),
+				cons(make_int(arity), make_int(index++))), c.fns);
+			if (arity > nargs)
+				nargs = arity;
+		}
+		else if (form.type == AtomType_Pair
+			&& car(form).type == AtomType_Symbol
+			&& car(form).value.symbol == sym_defmacro.value.symbol) {
+			Error err = eval_expr(form, env, &p);
+			if (err) {
+				print_err(err);
+				free(text);
+				gc_roots = roots;
+				return 1;
+			}
+		}
+		plan = cons(body, plan);
+	}
+	s = text + port.pos;
+	if (s[strspn(s, " \t\r\n")] != '\0') {
+		printf("%s: syntax error\n", in_path);
+		free(text);
+		gc_roots = roots;
+		return 1;
+	}
+	free(text);
+	list_reverse(&forms);
+	list_reverse(&plan);
+
+	/* Module name for the init function */
+	base = strrchr(in_path, '/');
+	base = base ? base + 1 : in_path;
+	for (i = 0; base[i] && base[i] != '.' && i < (int)sizeof(name) - 1; i++)
+		name[i] = (base[i] >= 'a' && base[i] <= 'z') || (base[i] >= 'A' && base[i] <= 'Z')
+			|| (base[i] >= '0' && base[i] <= '9') ? base[i] : '_';
+	name[i] = '\0';
+
+	/* Functions, and the init function in source order */
+	index = 0;
+	for (p = forms, q = plan; !nilp(p); p = cdr(p), q = cdr(q)) {
+		Atom form = car(p);
+
+		if (!nilp(car(q))) {
+			Atom fn = compile_fn(&c, car(car(cdr(form))));
+			compile_function(&c, &fns, form, car(q),
+				(int)car(cdr(fn)).value.integer, index);
+			text_printf(&init, "\tenv_define(env, k[%d], make_builtin(builtin_fn_%ld));\n",
+				compile_const(&c, car(fn)), index);
+			index++;
+		}
+		else {
+			text_printf(&init, "\tif ((err = eval_string(env, \"");
+			text_datum(&init, form);
+			text_printf(&init, "\")))\n\t\treturn;\n");
+		}
+	}
+
+	out = fopen(out_path, "w");
+	if (!out) {
+		printf("Writing %s failed.\n", out_path);
+		gc_roots = roots;
+		return 1;
+	}
+
+	fprintf(out, "/* Generated by toylisp-compile from %s */\n\n", base);
+	fprintf(out, "#include \"ToyLisp.h\"\n\n");
+	fprintf(out, "static Atom module_env, k_t, k[%d], k_op[%d];\n",
+		c.nconsts + 1, COMPILE_INLINE_OPS);
+	fprintf(out, "static struct Root module_roots[%d];\n\n",
+		c.nconsts + 1 + COMPILE_INLINE_OPS + nargs);
+	fprintf(out, "/* Is the binding cell still holding the builtin fn? */\n"
+		"#define BOUND_TO(cell, fn) (!nilp(cell) && cdr(cell).type == AtomType_Builtin\\\n"
+		"\t&& cdr(cell).value.builtin == (fn))\n\n");
+	fprintf(out, "static Error call_global(Atom sym, Atom args, Atom *result)\n{\n"
+		"\tAtom fn;\n\tError err = env_get(module_env, sym, &fn);\n"
+		"\tif (err)\n\t\treturn err;\n"
+		"\treturn apply(fn, args, result);\n}\n\n");
+	fprintf(out, "static Atom global_binding(const char *name)\n{\n"
+		"\tAtom sym = make_sym(name), bs;\n\n"
+		"\tfor (bs = cdr(module_env); !nilp(bs); bs = cdr(bs))\n"
+		"\t\tif (car(car(bs)).value.symbol == sym.value.symbol)\n"
+		"\t\t\treturn car(bs);\n"
+		"\treturn nil;\n}\n\n");
+	for (p = c.fns; !nilp(p); p = cdr(p)) {
+		fprintf(out, "static Error lisp_fn_%ld(", cdr(cdr(car(p))).value.integer);
+		for (i = 0; i < car(cdr(car(p))).value.integer; i++)
+			fprintf(out, "Atom a%d, ", i);
+		fprintf(out, "Atom *result);\n");
+	}
+	if (!nilp(c.fns)) {
+		/* A compiled function returns with tail_fn set to have its caller
+		 * make its tail call */
+		fprintf(out, "\nstatic long tail_fn = -1;\n"
+			"static Atom tail_a[%d];\n\n"
+			"static Error tail_run(Error err, Atom *result)\n{\n"
+			"\tAtom a[%d];\n\tint i;\n\n"
+			"\twhile (tail_fn >= 0) {\n"
+			"\t\tlong fn = tail_fn;\n\n"
+			"\t\ttail_fn = -1;\n"
+			"\t\tfor (i = 0; i < %d; i++) {\n"
+			"\t\t\ta[i] = tail_a[i];\n"
+			"\t\t\ttail_a[i] = nil;\n"
+			"\t\t}\n"
+			"\t\tif (err)\n\t\t\tbreak;\n"
+			"\t\tswitch (fn) {\n", nargs, nargs, nargs);
+		for (p = c.fns; !nilp(p); p = cdr(p)) {
+			fprintf(out, "\t\tcase %ld: err = lisp_fn_%ld(",
+				cdr(cdr(car(p))).value.integer, cdr(cdr(car(p))).value.integer);
+			for (i = 0; i < car(cdr(car(p))).value.integer; i++)
+				fprintf(out, "a[%d], ", i);
+			fprintf(out, "result); break;\n");
+		}
+		fprintf(out, "\t\t}\n\t}\n\treturn err;\n}\n");
+	}
+	fprintf(out, "\n%s", fns.data ? fns.data : "");
+
+	fprintf(out, "void toylisp_init_%s(Atom env)\n{\n"
+		"\tconst char *end;\n\tError err;\n\tint i;\n\n", name);
+	fprintf(out, "\tmodule_env = env;\n\tk_t = make_sym(\"t\");\n");
+	fprintf(out, "\tgc_protect(&module_roots[0], &module_env);\n");
+	fprintf(out, "\tfor (i = 0; i < %d; i++)\n\t\tgc_protect(&module_roots[i + 1], &k[i]);\n",
+		c.nconsts);
+	for (i = 0; i < COMPILE_INLINE_OPS; i++) {
+		fprintf(out, "\tk_op[%d] = global_binding(\"%s\");\n", i, compile_ops[i]);
+		fprintf(out, "\tgc_protect(&module_roots[%d], &k_op[%d]);\n", c.nconsts + 1 + i, i);
+	}
+	if (!nilp(c.fns))
+		fprintf(out, "\tfor (i = 0; i < %d; i++)\n\t\tgc_protect(&module_roots[i + %d], &tail_a[i]);\n",
+			nargs, c.nconsts + 1 + COMPILE_INLINE_OPS);
+	list_reverse(&c.consts);
+	for (i = 0, p = c.consts; !nilp(p); p = cdr(p), i++) {
+		struct Text datum = { NULL, 0, 0 };
+		text_datum(&datum, car(p));
+		fprintf(out, "\tread_expr(\"%s\", &end, &k[%d]);\n", datum.data, i);
+		free(datum.data);
+	}
+	fprintf(out, "\n%s", init.data ? init.data : "");
+	fprintf(out, "\t(void)err;\n}\n\n");
+
+	fprintf(out, "#ifdef TOYLISP_MODULE_MAIN\n"
+		"int main(int argc, char **argv)\n{\n"
+		"\treturn toylisp_main(argc, argv, toylisp_init_%s);\n}\n#endif\n", name);
+	fclose(out);
+
+	free(fns.data);
+	free(init.data);
+	gc_roots = roots;
+	return 0;
+}
+
+/* Evaluate and print each of forms, stopping evaluation at the first
+ * error; the forms still to come are kept for checkpoints */
+void repl_eval(Atom env, Atom *forms, Error err)
+{
+	Atom result;
+
+	while (!nilp(*forms)) {
+		toplevel_rest = cdr(*forms);
+		if (!err)
+			err = eval_expr(car(*forms), env, &result);
+		if (err)
+			print_err(err);
+		else {
+			print_expr(result);
+			putchar('\n');
+		}
+		*forms = cdr(*forms);
+	}
+	toplevel_rest = nil;
+}
+
+int toylisp_main(int argc, char **argv, void (*init)(Atom env))
 {
-	Atom env;
+	Atom env, expr = nil;
 	char *input;
+	struct Root roots[2];
+	const char *prog = NULL;
+	int compiling = 0;
+
+	/* toylisp-compile module.lisp -o module.c */
+	if (argc > 0) {
+		prog = strrchr(argv[0], '/');
+		prog = prog ? prog + 1 : argv[0];
+		compiling = strcmp(prog, "toylisp-compile") == 0
+			|| (argc > 1 && strcmp(argv[1], "--compile") == 0);
+	}
 
 	env = env_create(nil);
+	toplevel_env = env;
+	gc_protect(&roots[0], &env);
+	gc_protect(&roots[1], &expr);
 
 	/* Set up the initial environment */
-	sym_t = make_sym("t");
-	sym_quote = make_sym("quote");
-	sym_define = make_sym("define");
-	sym_lambda = make_sym("lambda");
-	sym_if = make_sym("if");
-	sym_defmacro = make_sym("defmacro");
-	sym_apply = make_sym("apply");
+	sym_t = make_permanent_sym("t");
+	sym_quote = make_permanent_sym("quote");
+	sym_define = make_permanent_sym("define");
+	sym_lambda = make_permanent_sym("lambda");
+	sym_if = make_permanent_sym("if");
+	sym_defmacro = make_permanent_sym("defmacro");
+	sym_apply = make_permanent_sym("apply");
+	sym_checkpoint = make_permanent_sym("checkpoint");
+	sym_delay = make_permanent_sym("delay");
+	sym_fixnum = make_uninterned_sym("#fixnum");
+	sym_fixnum_guard = make_uninterned_sym("#fixnum-guard");
+	sym_memo = make_uninterned_sym("#memo");
+	sym_values = make_uninterned_sym("#values");
+	sym_eof = make_uninterned_sym("#eof");
+	atexit(ports_flush_all);
 
 	env_set(env, make_sym("car"), make_builtin(builtin_car));
 	env_set(env, make_sym("cdr"), make_builtin(builtin_cdr));
@@ -1174,29 +10516,145 @@ int main(int argc, char **argv)
 	env_set(env, make_sym("apply"), make_builtin(builtin_apply));
 	env_set(env, make_sym("eq?"), make_builtin(builtin_eq));
 	env_set(env, make_sym("pair?"), make_builtin(builtin_pairp));	
+	env_set(env, make_sym("specialize"), make_builtin(builtin_specialize));
+	env_set(env, make_sym("equal?"), make_builtin(builtin_equal));
+	env_set(env, make_sym("memoize"), make_builtin(builtin_memoize));
+	env_set(env, make_sym("map-assoc"), make_builtin(builtin_map_assoc));
+	env_set(env, make_sym("map-dissoc"), make_builtin(builtin_map_dissoc));
+	env_set(env, make_sym("map-get"), make_builtin(builtin_map_get));
+	env_set(env, make_sym("map-count"), make_builtin(builtin_map_count));
+	env_set(env, make_sym("vector"), make_builtin(builtin_vector));
+	env_set(env, make_sym("make-vector"), make_builtin(builtin_make_vector));
+	env_set(env, make_sym("vector-ref"), make_builtin(builtin_vector_ref));
+	env_set(env, make_sym("vector-set!"), make_builtin(builtin_vector_set));
+	env_set(env, make_sym("vector-length"), make_builtin(builtin_vector_length));
+	env_set(env, make_sym("vector->list"), make_builtin(builtin_vector_to_list));
+	env_set(env, make_sym("list->vector"), make_builtin(builtin_list_to_vector));
+	env_set(env, make_sym("sort"), make_builtin(builtin_sort));
+	env_set(env, make_sym("iter-next"), make_builtin(builtin_iter_next));
+	env_set(env, make_sym("make-omap"), make_builtin(builtin_make_omap));
+	env_set(env, make_sym("omap-put"), make_builtin(builtin_omap_put));
+	env_set(env, make_sym("omap-get"), make_builtin(builtin_omap_get));
+	env_set(env, make_sym("omap-range"), make_builtin(builtin_omap_range));
+	env_set(env, make_sym("omap-min"), make_builtin(builtin_omap_min));
+	env_set(env, make_sym("omap-max"), make_builtin(builtin_omap_max));
+	env_set(env, make_sym("make-bitvec"), make_builtin(builtin_make_bitvec));
+	env_set(env, make_sym("bitvec-set!"), make_builtin(builtin_bitvec_set));
+	env_set(env, make_sym("bitvec-ref"), make_builtin(builtin_bitvec_ref));
+	env_set(env, make_sym("bitvec-count"), make_builtin(builtin_bitvec_count));
+	env_set(env, make_sym("bitvec-and"), make_builtin(builtin_bitvec_and));
+	env_set(env, make_sym("bitvec-or"), make_builtin(builtin_bitvec_or));
+	env_set(env, make_sym("bitvec-xor"), make_builtin(builtin_bitvec_xor));
+	env_set(env, make_sym("bitvec-andnot"), make_builtin(builtin_bitvec_andnot));
+	env_set(env, make_sym("bitvec-iter"), make_builtin(builtin_bitvec_iter));
+	env_set(env, make_sym("make-pq"), make_builtin(builtin_make_pq));
+	env_set(env, make_sym("pq-push!"), make_builtin(builtin_pq_push));
+	env_set(env, make_sym("pq-pop!"), make_builtin(builtin_pq_pop));
+	env_set(env, make_sym("pq-peek"), make_builtin(builtin_pq_peek));
+	env_set(env, make_sym("pq-size"), make_builtin(builtin_pq_size));
+	env_set(env, make_sym("open-input-file"), make_builtin(builtin_open_input_file));
+	env_set(env, make_sym("open-output-file"), make_builtin(builtin_open_output_file));
+	env_set(env, make_sym("open-input-string"), make_builtin(builtin_open_input_string));
+	env_set(env, make_sym("open-output-string"), make_builtin(builtin_open_output_string));
+	env_set(env, make_sym("get-output-string"), make_builtin(builtin_get_output_string));
+	env_set(env, make_sym("read-char"), make_builtin(builtin_read_char));
+	env_set(env, make_sym("peek-char"), make_builtin(builtin_peek_char));
+	env_set(env, make_sym("read-line"), make_builtin(builtin_read_line));
+	env_set(env, make_sym("read"), make_builtin(builtin_read));
+	env_set(env, make_sym("write"), make_builtin(builtin_write));
+	env_set(env, make_sym("display"), make_builtin(builtin_display));
+	env_set(env, make_sym("newline"), make_builtin(builtin_newline));
+	env_set(env, make_sym("flush-output"), make_builtin(builtin_flush_output));
+	env_set(env, make_sym("close-port"), make_builtin(builtin_close_port));
+	env_set(env, make_sym("eof-object?"), make_builtin(builtin_eof_objectp));
+	env_set(env, make_sym("string-length"), make_builtin(builtin_string_length));
+	env_set(env, make_sym("make-string"), make_builtin(builtin_make_string));
+	env_set(env, make_sym("string-ref"), make_builtin(builtin_string_ref));
+	env_set(env, make_sym("string-append"), make_builtin(builtin_string_append));
+	env_set(env, make_sym("symbol->string"), make_builtin(builtin_symbol_to_string));
+	env_set(env, make_sym("string->symbol"), make_builtin(builtin_string_to_symbol));
+	env_set(env, make_sym("json-parse"), make_builtin(builtin_json_parse));
+	env_set(env, make_sym("json-write"), make_builtin(builtin_json_write));
+	env_set(env, make_sym("read-csv"), make_builtin(builtin_read_csv));
+	env_set(env, make_sym("read-tsv"), make_builtin(builtin_read_tsv));
+	env_set(env, make_sym("ffi-open"), make_builtin(builtin_ffi_open));
+	env_set(env, make_sym("ffi-fn"), make_builtin(builtin_ffi_fn));
+	env_set(env, make_sym("load-extension"), make_builtin(builtin_load_extension));
+	env_set(env, make_sym("kv-open"), make_builtin(builtin_kv_open));
+	env_set(env, make_sym("kv-put"), make_builtin(builtin_kv_put));
+	env_set(env, make_sym("kv-get"), make_builtin(builtin_kv_get));
+	env_set(env, make_sym("kv-delete"), make_builtin(builtin_kv_delete));
+	env_set(env, make_sym("kv-count"), make_builtin(builtin_kv_count));
+	env_set(env, make_sym("kv-scan"), make_builtin(builtin_kv_scan));
+	env_set(env, make_sym("kv-compact"), make_builtin(builtin_kv_compact));
+	env_set(env, make_sym("kv-sync"), make_builtin(builtin_kv_sync));
+	env_set(env, make_sym("kv-close"), make_builtin(builtin_kv_close));
+	env_set(env, make_sym("cell"), make_builtin(builtin_cell));
+	env_set(env, make_sym("computed"), make_builtin(builtin_computed));
+	env_set(env, make_sym("cell-ref"), make_builtin(builtin_cell_ref));
+	env_set(env, make_sym("cell-set!"), make_builtin(builtin_cell_set));
+	env_set(env, make_sym("force"), make_builtin(builtin_force));
+	env_set(env, make_sym("promise?"), make_builtin(builtin_promisep));
+	env_set(env, make_sym("record"), make_builtin(builtin_record));
+	env_set(env, make_sym("record?"), make_builtin(builtin_recordp));
+	env_set(env, make_sym("record-ref"), make_builtin(builtin_record_ref));
+	env_set(env, make_sym("record-set!"), make_builtin(builtin_record_set));
+	env_set(env, make_sym("record-define"), make_builtin(builtin_record_define));
+	env_set(env, make_sym("values"), make_builtin(builtin_values));
+	env_set(env, make_sym("call-with-values"), make_builtin(builtin_call_with_values));
+	env_set(env, make_sym("make-weak-table"), make_builtin(builtin_make_weak_table));
+	env_set(env, make_sym("weak-table-put"), make_builtin(builtin_weak_table_put));
+	env_set(env, make_sym("weak-table-get"), make_builtin(builtin_weak_table_get));
+	env_set(env, make_sym("weak-table-delete"), make_builtin(builtin_weak_table_delete));
+	env_set(env, make_sym("weak-table-count"), make_builtin(builtin_weak_table_count));
+	builtins_record(env);
+
+	load_file(env, "library.lisp", !compiling);
+
+	if (init)
+		(*init)(env);
+
+	if (compiling) {
+		int i = strcmp(prog, "toylisp-compile") == 0 ? 1 : 2;
+		if (argc == i + 3 && strcmp(argv[i + 1], "-o") == 0)
+			return compile_module(env, argv[i], argv[i + 2]);
+		printf("usage: toylisp-compile module.lisp -o module.c\n");
+		return 1;
+	}
+
+	/* ToyLisp --resume file */
+	if (argc > 2 && strcmp(argv[1], "--resume") == 0) {
+		struct Root *saved = gc_roots;
+		Atom root[4], result;
+		Error err;
 
-	load_file(env, "library.lisp");
+		err = checkpoint_read(argv[2], root);
+		if (!err) {
+			env = toplevel_env = root[0];
+			inline_deps = root[3];
+			expr = toplevel_rest = root[2];
+			eval_depth++;
+			err = eval_loop(cons(sym_quote, cons(sym_t, nil)), env, root[1], &result);
+			eval_depth--;
+			gc_roots = saved;
+		}
+		if (err)
+			print_err(err);
+		else {
+			print_expr(result);
+			putchar('\n');
+		}
+		repl_eval(env, &expr, err);
+	}
 
 	while ((input = readline("> ")) != NULL) {
 		char *buf = (char *)malloc(strlen(input) + 3);
 		sprintf(buf, "(%s)", input);
 		const char *p = buf;
 		Error err;
-		Atom expr, result;
 
 		err = read_expr(p, &p, &expr);
-
-		while (!nilp(expr)) {
-			if (!err)
-				err = eval_expr(car(expr), env, &result);
-			if (err)
-				print_err(err);
-			else {
-				print_expr(result);
-				putchar('\n');
-			}				
-			expr = cdr(expr);
-		}
+		repl_eval(env, &expr, err);
 
 		free(buf);
 		free(input);
@@ -1205,3 +10663,10 @@ int main(int argc, char **argv)
 	return 0;
 }
 
+
+#ifndef TOYLISP_NO_MAIN
+int main(int argc, char **argv)
+{
+	return toylisp_main(argc, argv, NULL);
+}
+#endif
@@ -0,0 +1,135 @@
+/* ToyLisp runtime interface, used by ToyLisp.c and by C code generated
+ * with toylisp-compile */
+
+#ifndef TOYLISP_H
+#define TOYLISP_H
+
+enum AtomType {
+	AtomType_Nil,
+	AtomType_Pair,
+	AtomType_Symbol,
+	AtomType_Integer,
+	AtomType_Builtin,
+	AtomType_Closure,
+	AtomType_Macro,
+	AtomType_Memo,
+	AtomType_Map,
+	AtomType_Vector,
+	AtomType_Iterator,
+	AtomType_Omap,
+	AtomType_Bitvec,
+	AtomType_Pq,
+	AtomType_String,
+	AtomType_Port,
+	AtomType_Real,
+	AtomType_Library,
+	AtomType_Foreign,
+	AtomType_Kv,
+	AtomType_Cell,
+	AtomType_Promise,
+	AtomType_Record,
+	AtomType_Values,
+	AtomType_WeakTable
+};
+
+typedef enum {
+	Error_OK = 0, Error_Syntax, Error_Unbound, Error_Args, Error_Type
+} Error;
+
+typedef struct Atom Atom;
+struct Object;
+typedef Error(*Builtin)(Atom args, Atom *result);
+
+struct Atom {
+	enum AtomType type;
+
+	union {		
+		long integer;
+		double real;
+		struct Pair *pair;
+		char *symbol;
+		Builtin builtin;
+		struct Object *object;
+	} value;
+};
+
+struct Pair {
+	struct Atom atom[2];
+};
+
+#define car(p) ((p).value.pair->atom[0])
+#define cdr(p) ((p).value.pair->atom[1])
+#define nilp(atom) ((atom).type == AtomType_Nil)
+
+static const Atom nil = { AtomType_Nil };
+
+/* Atoms held by C code across evaluation, marked by gc() */
+struct Root {
+	Atom *atom;
+	struct Root *prev;
+};
+
+extern struct Root *gc_roots;
+
+void gc_protect(struct Root *root, Atom *atom);
+void gc_unprotect(struct Root *root);
+
+Atom cons(Atom car_val, Atom cdr_val);
+Atom make_int(long x);
+Atom make_real(double x);
+Atom make_sym(const char *s);
+Atom make_builtin(Builtin fn);
+int listp(Atom expr);
+
+Error env_get(Atom env, Atom symbol, Atom *result);
+Error env_set(Atom env, Atom symbol, Atom value);
+Error env_define(Atom env, Atom symbol, Atom value);
+Error apply(Atom fn, Atom args, Atom *result);
+Error read_expr(const char *input, const char **end, Atom *result);
+Error eval_expr(Atom expr, Atom env, Atom *result);
+Error eval_string(Atom env, const char *text);
+
+/* Arithmetic builtins, which compiled code computes inline on integers
+ * while they are still bound to their names */
+Error builtin_add(Atom args, Atom *result);
+Error builtin_subtract(Atom args, Atom *result);
+Error builtin_multiply(Atom args, Atom *result);
+Error builtin_divide(Atom args, Atom *result);
+Error builtin_numeq(Atom args, Atom *result);
+Error builtin_less(Atom args, Atom *result);
+
+/* Native extensions.  (load-extension "foo.so") loads a shared library
+ * and calls its
+ *
+ *   Error toylisp_extension_init(const struct ToyLispApi *api, Atom env)
+ *
+ * which defines builtins with api->define_builtin, passing -1 as
+ * max_args for no limit.  The runtime is only reached through the
+ * table, so the interpreter does not need to export its symbols.
+ * The argument list passed to such a builtin is its own, so it may be
+ * kept or returned as the result.  Atoms kept across apply or
+ * eval_string must be protected. */
+#define TOYLISP_API_VERSION 1
+
+struct ToyLispApi {
+	int version;
+	Error (*define_builtin)(const char *name, Builtin fn, int min_args, int max_args);
+	void (*gc_protect)(struct Root *root, Atom *atom);
+	void (*gc_unprotect)(struct Root *root);
+	Atom (*cons)(Atom car_val, Atom cdr_val);
+	Atom (*make_int)(long x);
+	Atom (*make_real)(double x);
+	Atom (*make_sym)(const char *s);
+	Atom (*make_string)(const char *s, long length);
+	const char *(*string_chars)(Atom a, long *length);  /* NULL if not a string */
+	Error (*apply)(Atom fn, Atom args, Atom *result);
+	Error (*eval_string)(Atom env, const char *text);
+};
+
+typedef Error (*ToyLispExtensionInit)(const struct ToyLispApi *api, Atom env);
+
+/* Runs the interpreter; init, if given, is called with the global
+ * environment once library.lisp has been loaded */
+int toylisp_main(int argc, char **argv, void (*init)(Atom env));
+
+#endif
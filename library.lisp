@@ -59,3 +59,43 @@
 (define +
   (let ((old+ +))
     (lambda xs (foldl old+ 0 xs))))
+
+(defmacro (define-memo spec . body)
+  `(define ,(car spec) (memoize (lambda ,(cdr spec) ,@body))))
+
+(defmacro (define-record name . fields)
+  `(record-define ',name ',fields))
+
+(defmacro (receive formals expr . body)
+  `(call-with-values (lambda () ,expr) (lambda ,formals ,@body)))
+
+(define (stream-car s) (car s))
+
+(define (stream-cdr s) (force (cdr s)))
+
+(define (stream-map proc s)
+  (if s
+      (cons (proc (stream-car s))
+            (delay (stream-map proc (stream-cdr s))))
+      nil))
+
+(define (stream-filter pred s)
+  (if s
+      (if (pred (stream-car s))
+          (cons (stream-car s)
+                (delay (stream-filter pred (stream-cdr s))))
+          (stream-filter pred (stream-cdr s)))
+      nil))
+
+(define (stream-take s n)
+  (if (< 0 n)
+      (if s
+          (cons (stream-car s)
+                (delay (stream-take (stream-cdr s) (- n 1))))
+          nil)
+      nil))
+
+(define (stream->list s)
+  (if s
+      (cons (stream-car s) (stream->list (stream-cdr s)))
+      nil))
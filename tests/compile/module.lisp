@@ -0,0 +1,5 @@
+(define (none) 42)
+(define (evn n) (if (= n 0) t (od (- n 1))))
+(define (od n) (if (= n 0) nil (evn (- n 1))))
+(define (sum n acc) (if (= n 0) acc (sum (- n 1) (+ acc n))))
+(define (sub a b) (- a b))
@@ -0,0 +1,7 @@
+(none)
+(evn 10)
+(od 100001)
+(sum 1000 0)
+(sub 7 2)
+(define (- a b) (list a b))
+(sub 7 2)
@@ -0,0 +1,15 @@
+(define counter 0)
+(define (bump) (define counter (+ counter 1)) counter)
+(bump)
+(define x 'global)
+(define (h) (define x (list x 'local)) x)
+(h)
+(define (k) (define g (lambda () y)) (if t (define y 5) nil) (g))
+(k)
+(define (mk) (define n 0) (lambda () (define n (+ n 1)) n))
+(define c (mk))
+(c)
+(define (adder a) (lambda (b) (+ a b)))
+((adder 2) 3)
+(define (ev n) (define (e n) (if (= n 0) t (o (- n 1)))) (define (o n) (if (= n 0) nil (e (- n 1)))) (e n))
+(ev 10)
@@ -0,0 +1,12 @@
+(define db (kv-open "tests/kv.db"))
+(if (kv-put db 'a (cons 1 2)) 'ok nil)
+(if (kv-put db 'c '(1 2 3 . 4)) 'ok nil)
+(if (kv-put db 'n '(1 (2 . 3) 4)) 'ok nil)
+(kv-close db)
+(define db (kv-open "tests/kv.db"))
+(kv-get db 'a)
+(kv-get db 'c)
+(kv-get db 'n)
+(apply (lambda (a b) a) (kv-get db 'a))
+(apply cons (kv-get db 'c))
+(kv-close db)
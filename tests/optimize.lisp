@@ -0,0 +1,14 @@
+(define (f a b) (+ (* a 2) b))
+f
+(f 3 4)
+(f 3.5 1)
+(define h (specialize f 10))
+h
+(h 1)
+(define (second x) (car (cdr x)))
+(define (g x) (second x))
+g
+(g '(1 2 3))
+(define (second x) (car x))
+g
+(g '(1 2 3))
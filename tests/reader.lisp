@@ -0,0 +1,8 @@
+'0x10
+'-inf
+'nan
+1.5
+-2.5e3
+.5
+'1e
+(eq? '0x10 '0x10)
@@ -0,0 +1,9 @@
+(define (vv . xs) xs)
+(define h (specialize vv 1 2))
+(h)
+(h 3 4)
+(define (f a . xs) (cons a xs))
+((specialize f 1 'b "c"))
+((specialize f 1) 2 3)
+((specialize f 1 2) 3)
+(specialize (lambda (a b) a) 1 2 3)